@@ -0,0 +1,560 @@
+#include "asgi.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include "header.hxx"
+#include "http.hxx"
+#include "module.hxx"
+#include "python.hxx"
+
+#include "util/CharUtil.hxx"
+#include "util/NumberParser.hxx"
+
+namespace {
+
+// The glue between the event loop and the blocking I/O of the WAS backends. `read` and `write` block, so they are run
+// in the executor of the loop. `http.response.start` only stores the status and headers, so it can be called directly.
+constexpr const char *bridge_source = R"(
+import asyncio
+
+async def run(app, scope, read, write):
+    loop = asyncio.get_running_loop()
+    response_complete = asyncio.Event()
+    body_complete = False
+
+    async def receive():
+        nonlocal body_complete
+        if not body_complete:
+            body, more_body = await loop.run_in_executor(None, read)
+            body_complete = not more_body
+            return {"type": "http.request", "body": body, "more_body": more_body}
+        await response_complete.wait()
+        return {"type": "http.disconnect"}
+
+    async def send(message):
+        if message["type"] == "http.response.start":
+            write(message)
+        elif await loop.run_in_executor(None, write, message):
+            response_complete.set()
+
+    try:
+        await app(scope, receive, send)
+    finally:
+        response_complete.set()
+)";
+
+constexpr size_t read_chunk_size = 64 * 1024;
+
+// Shared between Process and the `read`/`write` callables, which may outlive the request, if the application keeps
+// references to them. `body` and `responder` belong to the WAS backend and are reset when Process returns.
+// They may only be used while `mutex` is locked, everything else is protected by the GIL. The exception are reads
+// of `body`, which may block for a long time: They happen without the mutex, but are counted in `readers`, and
+// DetachRequest cancels and waits for them.
+struct AsgiRequest {
+	std::mutex mutex;
+	std::condition_variable readers_done;
+	InputStream *body = nullptr;
+	HttpResponder *responder = nullptr;
+	unsigned readers = 0;
+
+	std::optional<uint64_t> body_remaining;
+	HttpResponse response;
+	bool response_started = false;
+	bool response_complete = false;
+};
+
+constexpr const char *capsule_name = "AsgiRequest";
+
+void
+DestroyCapsule(PyObject *capsule) noexcept
+{
+	delete static_cast<std::shared_ptr<AsgiRequest> *>(PyCapsule_GetPointer(capsule, capsule_name));
+}
+
+std::shared_ptr<AsgiRequest>
+GetRequest(PyObject *capsule) noexcept
+{
+	auto ptr = static_cast<std::shared_ptr<AsgiRequest> *>(PyCapsule_GetPointer(capsule, capsule_name));
+	return ptr ? *ptr : nullptr;
+}
+
+PyObject *
+AsgiRead(PyObject *self, PyObject * /*args*/)
+{
+	auto request = GetRequest(self);
+	if (!request) {
+		return nullptr;
+	}
+
+	const auto size = std::min<uint64_t>(request->body_remaining.value_or(read_chunk_size), read_chunk_size);
+	auto buffer = Py::wrap(PyBytes_FromStringAndSize(nullptr, size));
+	if (!buffer) {
+		return nullptr;
+	}
+
+	size_t n = 0;
+	std::optional<std::string> error;
+	if (size > 0) {
+		auto *const data = PyBytes_AS_STRING(static_cast<PyObject *>(buffer));
+		const Py::ReleaseGil release;
+		std::unique_lock lock(request->mutex);
+		if (auto *const body = request->body) {
+			++request->readers;
+			lock.unlock();
+			try {
+				n = body->Read(std::span(data, size));
+			} catch (const std::exception &exc) {
+				error = exc.what();
+			}
+			lock.lock();
+			if (--request->readers == 0) {
+				request->readers_done.notify_all();
+			}
+		}
+	}
+
+	if (error) {
+		PyErr_SetString(PyExc_IOError, fmt::format("Error reading request body: {}", *error).c_str());
+		return nullptr;
+	}
+
+	if (request->body_remaining) {
+		*request->body_remaining -= n;
+	}
+	const bool more_body = n > 0 && request->body_remaining != 0;
+
+	if (n < size && _PyBytes_Resize(&buffer, n) < 0) {
+		return nullptr;
+	}
+
+	return Py_BuildValue("(NO)", buffer.Release(), more_body ? Py_True : Py_False);
+}
+
+bool
+StartResponse(AsgiRequest &request, PyObject *message)
+{
+	if (request.response_started) {
+		PyErr_SetString(PyExc_RuntimeError, "http.response.start must only be sent once");
+		return false;
+	}
+
+	PyObject *status_obj = PyDict_GetItemString(message, "status"); // borrowed reference
+	if (!status_obj || !PyLong_Check(status_obj)) {
+		PyErr_SetString(PyExc_TypeError, "http.response.start requires an integer status");
+		return false;
+	}
+	const auto status = static_cast<http_status_t>(PyLong_AsLong(status_obj));
+	if (!http_status_is_valid(status)) {
+		PyErr_SetString(PyExc_ValueError,
+				fmt::format("Invalid HTTP Status '{}'", fmt::underlying(status)).c_str());
+		return false;
+	}
+
+	auto &response = request.response;
+	response.status = status;
+
+	PyObject *headers = PyDict_GetItemString(message, "headers"); // borrowed reference
+	if (headers) {
+		auto iterator = Py::wrap(PyObject_GetIter(headers));
+		if (!iterator) {
+			return false;
+		}
+
+		for (auto item = Py::wrap(PyIter_Next(iterator)); item; item = PyIter_Next(iterator)) {
+			if (!PySequence_Check(item) || PySequence_Size(item) != 2) {
+				PyErr_SetString(PyExc_TypeError, "headers must be an iterable of [bytes, bytes]");
+				return false;
+			}
+
+			const auto name_obj = Py::wrap(PySequence_GetItem(item, 0));
+			const auto value_obj = Py::wrap(PySequence_GetItem(item, 1));
+			if (!name_obj || !value_obj || !PyBytes_Check(name_obj) || !PyBytes_Check(value_obj)) {
+				PyErr_SetString(PyExc_TypeError, "headers must be an iterable of [bytes, bytes]");
+				return false;
+			}
+
+			const auto name = Py::to_string_view(name_obj);
+			const auto value = Py::to_string_view(value_obj);
+			if (!check_header_name(name) || !check_header_value(value)) {
+				return false;
+			}
+
+			if (HeaderMatch(name, "Content-Length")) {
+				const auto num = ParseInteger<uint64_t>(value);
+				if (!num) {
+					PyErr_SetString(
+					    PyExc_ValueError,
+					    fmt::format("Could not parse Content-Length header: '{}'", value).c_str());
+					return false;
+				}
+				response.content_length = *num;
+				continue; // Content-Length should not be included in the WAS response
+			}
+
+			response.headers.emplace_back(name, value);
+		}
+
+		if (PyErr_Occurred()) {
+			return false;
+		}
+	}
+
+	request.response_started = true;
+	return true;
+}
+
+bool
+SendBody(AsgiRequest &request, PyObject *message)
+{
+	if (!request.response_started) {
+		PyErr_SetString(PyExc_RuntimeError, "http.response.start must be sent before http.response.body");
+		return false;
+	}
+	if (request.response_complete) {
+		PyErr_SetString(PyExc_RuntimeError, "Response has already been completed");
+		return false;
+	}
+
+	PyObject *more_body_obj = PyDict_GetItemString(message, "more_body"); // borrowed reference
+	const int more_body = more_body_obj ? PyObject_IsTrue(more_body_obj) : 0;
+	if (more_body < 0) {
+		return false;
+	}
+
+	Py_buffer view = {};
+	PyObject *body = PyDict_GetItemString(message, "body"); // borrowed reference
+	if (body && PyObject_GetBuffer(body, &view, PyBUF_SIMPLE) < 0) {
+		return false;
+	}
+	const auto body_data = std::string_view(static_cast<const char *>(view.buf), view.buf ? view.len : 0);
+
+	std::optional<std::string> error;
+	{
+		const Py::ReleaseGil release;
+		const std::lock_guard lock(request.mutex);
+		try {
+			if (!request.responder) {
+				throw std::runtime_error("Request has already ended");
+			}
+
+			auto &responder = *request.responder;
+			if (!responder.HeadersSent()) {
+				// The whole body is in the first message, so we know its length
+				if (!more_body && !request.response.content_length) {
+					request.response.content_length = body_data.size();
+				}
+				responder.SendHeaders(std::move(request.response));
+			}
+
+			if (!body_data.empty()) {
+				responder.SendBody(body_data);
+			}
+		} catch (const std::exception &exc) {
+			error = exc.what();
+		}
+	}
+
+	if (body) {
+		PyBuffer_Release(&view);
+	}
+
+	if (error) {
+		PyErr_SetString(PyExc_IOError, fmt::format("Error sending response: {}", *error).c_str());
+		return false;
+	}
+
+	request.response_complete = !more_body;
+	return true;
+}
+
+// Returns True once the response is complete
+PyObject *
+AsgiWrite(PyObject *self, PyObject *message)
+{
+	auto request = GetRequest(self);
+	if (!request) {
+		return nullptr;
+	}
+
+	if (!PyDict_Check(message)) {
+		PyErr_SetString(PyExc_TypeError, "ASGI messages must be dicts");
+		return nullptr;
+	}
+
+	PyObject *type_obj = PyDict_GetItemString(message, "type"); // borrowed reference
+	if (!type_obj || !PyUnicode_Check(type_obj)) {
+		PyErr_SetString(PyExc_TypeError, "ASGI messages must have a type");
+		return nullptr;
+	}
+
+	const auto type = Py::to_string_view(type_obj);
+	if (type == "http.response.start") {
+		if (!StartResponse(*request, message)) {
+			return nullptr;
+		}
+	} else if (type == "http.response.body") {
+		if (!SendBody(*request, message)) {
+			return nullptr;
+		}
+	} else {
+		PyErr_SetString(PyExc_ValueError, fmt::format("Unsupported ASGI message type '{}'", type).c_str());
+		return nullptr;
+	}
+
+	return PyBool_FromLong(request->response_complete);
+}
+
+PyMethodDef read_def = { "read", AsgiRead, METH_NOARGS, "Read the next chunk of the request body" };
+PyMethodDef write_def = { "write", AsgiWrite, METH_O, "Handle an ASGI send message" };
+
+Py::Object
+get_attr(PyObject *obj, const char *name)
+{
+	auto attr = Py::wrap(PyObject_GetAttrString(obj, name));
+	if (!attr) {
+		Py::rethrow_python_exception();
+	}
+	return attr;
+}
+
+void
+set_item(PyObject *dict, const char *key, Py::Object value)
+{
+	if (!value || PyDict_SetItemString(dict, key, value) < 0) {
+		Py::rethrow_python_exception();
+	}
+}
+
+Py::Object
+to_lower_bytes(std::string_view str)
+{
+	auto obj = Py::wrap(PyBytes_FromStringAndSize(nullptr, str.size()));
+	if (!obj) {
+		Py::rethrow_python_exception();
+	}
+	std::transform(str.begin(), str.end(), PyBytes_AS_STRING(static_cast<PyObject *>(obj)), ToLowerASCII);
+	return obj;
+}
+
+Py::Object
+BuildScope(const HttpRequest &req)
+{
+	auto scope = Py::wrap(PyDict_New());
+	if (!scope) {
+		Py::rethrow_python_exception();
+	}
+
+	const auto protocol = std::string_view(req.protocol);
+	const auto slash = protocol.find('/');
+	const auto http_version = slash == std::string_view::npos ? protocol : protocol.substr(slash + 1);
+
+	auto query = req.uri.query;
+	if (!query.empty() && query.front() == '?') {
+		query.remove_prefix(1);
+	}
+
+	set_item(scope, "type", Py::uc_from_utf8("http"));
+	set_item(scope, "asgi", Py::wrap(Py_BuildValue("{s:s,s:s}", "version", "3.0", "spec_version", "2.3")));
+	set_item(scope, "http_version", Py::uc_from_utf8(http_version));
+	set_item(scope, "method", Py::uc_from_utf8(http_method_to_string(req.method)));
+	set_item(scope, "scheme", Py::uc_from_utf8(req.scheme));
+	// PATH_INFO is already percent-decoded
+	set_item(scope,
+		 "path",
+		 Py::wrap(PyUnicode_DecodeUTF8(req.uri.path.data(), req.uri.path.size(), "surrogateescape")));
+	set_item(scope, "query_string", Py::to_bytes(query));
+	set_item(scope, "root_path", Py::uc_from_utf8(req.script_name));
+
+	auto headers = Py::wrap(PyList_New(0));
+	if (!headers) {
+		Py::rethrow_python_exception();
+	}
+	for (const auto &[name, value] : req.headers) {
+		auto header = Py::wrap(PyTuple_Pack(2,
+						    static_cast<PyObject *>(to_lower_bytes(name)),
+						    static_cast<PyObject *>(Py::to_bytes(value))));
+		if (!header || PyList_Append(headers, header) < 0) {
+			Py::rethrow_python_exception();
+		}
+	}
+	set_item(scope, "headers", std::move(headers));
+
+	// We don't know the port of the client
+	set_item(scope,
+		 "client",
+		 req.remote_addr.empty()
+		     ? Py::wrap(Py_NewRef(Py_None))
+		     : Py::wrap(Py_BuildValue("(s#i)", req.remote_addr.data(), req.remote_addr.size(), 0)));
+
+	const auto port = ParseInteger<uint16_t>(req.server_port);
+	set_item(scope,
+		 "server",
+		 Py::wrap(Py_BuildValue("(s#i)", req.server_name.data(), req.server_name.size(), port.value_or(0))));
+
+	return scope;
+}
+
+// Detaches the AsgiRequest from the WAS backend when Process returns, including when it throws
+struct DetachRequest {
+	AsgiRequest &request;
+
+	~DetachRequest()
+	{
+		const Py::ReleaseGil release;
+		std::unique_lock lock(request.mutex);
+		if (request.readers > 0) {
+			// An executor thread may be waiting for the client, which might never send the rest of the body
+			request.body->Cancel();
+			request.readers_done.wait(lock, [this]() { return request.readers == 0; });
+		}
+		request.body = nullptr;
+		request.responder = nullptr;
+	}
+};
+}
+
+bool
+AsgiRequestHandler::IsAsgiApp(PyObject *app)
+{
+	if (const auto asgi = Module::IsAsgi(app)) {
+		return *asgi;
+	}
+
+	auto inspect = Py::import("inspect");
+	if (!inspect) {
+		Py::rethrow_python_exception();
+	}
+	auto is_coroutine_function = get_attr(inspect, "iscoroutinefunction");
+
+	auto result = Py::wrap(PyObject_CallOneArg(is_coroutine_function, app));
+	if (result && !PyObject_IsTrue(result) && PyObject_HasAttrString(app, "__call__")) {
+		auto call = get_attr(app, "__call__");
+		result = PyObject_CallOneArg(is_coroutine_function, call);
+	}
+	if (!result) {
+		Py::rethrow_python_exception();
+	}
+	return PyObject_IsTrue(result);
+}
+
+AsgiRequestHandler::AsgiRequestHandler(Py::Object _app) : app(std::move(_app))
+{
+	auto code = Py::wrap(Py_CompileString(bridge_source, "<python_was_asgi>", Py_file_input));
+	if (!code) {
+		Py::rethrow_python_exception();
+	}
+	auto bridge = Py::wrap(PyImport_ExecCodeModule("python_was_asgi", code));
+	if (!bridge) {
+		Py::rethrow_python_exception();
+	}
+	run = get_attr(bridge, "run");
+
+	auto asyncio = Py::import("asyncio");
+	if (!asyncio) {
+		Py::rethrow_python_exception();
+	}
+	run_coroutine_threadsafe = get_attr(asyncio, "run_coroutine_threadsafe");
+
+	loop = Py::wrap(PyObject_CallMethod(asyncio, "new_event_loop", nullptr));
+	if (!loop) {
+		Py::rethrow_python_exception();
+	}
+
+	loop_thread = std::thread([this]() {
+		const Py::EnsureGil gil;
+		auto result = Py::wrap(PyObject_CallMethod(loop, "run_forever", nullptr));
+		if (!result) {
+			PyErr_Print();
+		}
+	});
+}
+
+AsgiRequestHandler::~AsgiRequestHandler()
+{
+	auto stop = Py::wrap(PyObject_GetAttrString(loop, "stop"));
+	Py::Object result;
+	if (stop) {
+		result = PyObject_CallMethod(loop, "call_soon_threadsafe", "O", static_cast<PyObject *>(stop));
+	}
+	if (!result) {
+		PyErr_Print();
+	}
+
+	{
+		const Py::ReleaseGil release;
+		loop_thread.join();
+	}
+
+	result = PyObject_CallMethod(loop, "close", nullptr);
+	if (!result) {
+		PyErr_Print();
+	}
+}
+
+void
+AsgiRequestHandler::Process(HttpRequest &&req, HttpResponder &responder)
+{
+	const Py::EnsureGil gil;
+
+	auto request = std::make_shared<AsgiRequest>();
+	request->body = req.body.get();
+	request->body_remaining = req.body ? req.body->ContentLength() : 0;
+	request->responder = &responder;
+	const DetachRequest detach{ *request };
+
+	auto scope = BuildScope(req);
+
+	auto capsule =
+	    Py::wrap(PyCapsule_New(new std::shared_ptr<AsgiRequest>(request), capsule_name, &DestroyCapsule));
+	if (!capsule) {
+		Py::rethrow_python_exception();
+	}
+
+	auto read = Py::wrap(PyCFunction_New(&read_def, capsule));
+	auto write = Py::wrap(PyCFunction_New(&write_def, capsule));
+	if (!read || !write) {
+		Py::rethrow_python_exception();
+	}
+
+	auto coroutine = Py::wrap(PyObject_CallFunctionObjArgs(run,
+							       static_cast<PyObject *>(app),
+							       static_cast<PyObject *>(scope),
+							       static_cast<PyObject *>(read),
+							       static_cast<PyObject *>(write),
+							       nullptr));
+	if (!coroutine) {
+		Py::rethrow_python_exception();
+	}
+
+	auto future = Py::wrap(PyObject_CallFunctionObjArgs(
+	    run_coroutine_threadsafe, static_cast<PyObject *>(coroutine), static_cast<PyObject *>(loop), nullptr));
+	if (!future) {
+		Py::rethrow_python_exception();
+	}
+
+	// Future.result() releases the GIL while waiting, so the event loop and other connections can make progress
+	auto result = Py::wrap(PyObject_CallMethod(future, "result", nullptr));
+	if (!result) {
+		Py::rethrow_python_exception();
+	}
+
+	if (!request->response_started) {
+		throw std::runtime_error("ASGI application returned without sending http.response.start");
+	}
+
+	// The application has sent http.response.start, but no body
+	if (!responder.HeadersSent()) {
+		auto &response = request->response;
+		if (!response.content_length) {
+			response.content_length = 0;
+		}
+		const Py::ReleaseGil release;
+		responder.SendHeaders(std::move(response));
+	}
+}
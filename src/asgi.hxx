@@ -0,0 +1,30 @@
+#pragma once
+
+#include "http.hxx"
+#include "python.hxx"
+
+#include <thread>
+
+// ASGI-Spec: https://asgi.readthedocs.io/en/latest/specs/www.html
+// All application coroutines run on a single asyncio event loop in a separate thread, so requests of concurrent WAS
+// connections (each calling Process from its own thread) are in flight at the same time.
+// Process can be called from any thread and acquires the GIL itself.
+class AsgiRequestHandler final : public RequestHandler {
+	Py::Object app;
+	Py::Object loop;
+	Py::Object run;
+	Py::Object run_coroutine_threadsafe;
+	std::thread loop_thread;
+
+public:
+	// Returns true, if `app` is a coroutine function or an object with a coroutine function `__call__`
+	static bool IsAsgiApp(PyObject *app);
+
+	// Must be called with the GIL held. Starts the event loop thread, so it must not be called before forking.
+	AsgiRequestHandler(Py::Object app);
+
+	// Must be called with the GIL held
+	~AsgiRequestHandler();
+
+	virtual void Process(HttpRequest &&req, HttpResponder &responder) override;
+};
@@ -0,0 +1,350 @@
+#include "bench.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+#include <util/NumberParser.hxx>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Calls a WSGI application the way a minimal server would, so it can be timed without python-was. The environ is
+// built once per kind of request and copied, because building it is the server's job.
+constexpr const char *direct_source = R"(
+import io
+import sys
+
+def file_wrapper(filelike, block_size=8192):
+    return iter(lambda: filelike.read(block_size), b"")
+
+def make_environ(method, path, query, headers, body):
+    environ = {
+        "REQUEST_METHOD": method,
+        "SCRIPT_NAME": "",
+        "PATH_INFO": path,
+        "QUERY_STRING": query,
+        "CONTENT_TYPE": "application/octet-stream" if body else "",
+        "CONTENT_LENGTH": str(len(body)) if body else "",
+        "SERVER_NAME": "localhost",
+        "SERVER_PORT": "80",
+        "SERVER_PROTOCOL": "HTTP/1.1",
+        "wsgi.version": (1, 0),
+        "wsgi.url_scheme": "http",
+        "wsgi.errors": sys.stderr,
+        "wsgi.multithread": False,
+        "wsgi.multiprocess": True,
+        "wsgi.run_once": False,
+        "wsgi.input_terminated": True,
+        "wsgi.file_wrapper": file_wrapper,
+    }
+    for name, value in headers:
+        environ["HTTP_" + name.upper().replace("-", "_")] = value
+    return environ
+
+def start_response(status, headers, exc_info=None):
+    pass
+
+def run(app, environ, body):
+    environ = dict(environ)
+    environ["wsgi.input"] = io.BytesIO(body)
+    result = app(environ, start_response)
+    try:
+        for _ in result:
+            pass
+    finally:
+        if hasattr(result, "close"):
+            result.close()
+)";
+
+// Like a WAS request, the query string is passed on without the '?'
+Uri
+split_uri(std::string_view uri)
+{
+	auto result = Uri::split(uri);
+	if (result.query.starts_with('?')) {
+		result.query.remove_prefix(1);
+	}
+	return result;
+}
+
+struct BenchResponder : public HttpResponder {
+	http_status_t status = static_cast<http_status_t>(0);
+	uint64_t body_bytes = 0;
+
+protected:
+	void SendHeadersImpl(HttpResponse &&response) override { status = response.status; }
+	void SendBodyImpl(std::string_view body_data) override { body_bytes += body_data.size(); }
+	void SendFileImpl(int, uint64_t, uint64_t length) override { body_bytes += length; }
+};
+
+// The data that the HttpRequest of a BenchRequest points to
+struct PreparedRequest {
+	const BenchRequest &spec;
+	std::vector<std::string> header_values;
+	std::string content_length;
+	std::string body;
+
+	explicit PreparedRequest(const BenchRequest &spec)
+	  : spec(spec)
+	  , content_length(std::to_string(spec.body_size))
+	  , body(spec.body_size, 'x')
+	{
+		for (unsigned i = 0; i < spec.header_count; ++i) {
+			header_values.push_back(fmt::format("X-Bench-{}", i));
+		}
+	}
+
+	HttpRequest Build(std::pmr::memory_resource *arena) const
+	{
+		HttpRequest request{
+			.remote_addr = "127.0.0.1",
+			.script_name = "",
+			.server_name = "localhost",
+			.server_port = "80",
+			.protocol = "HTTP/1.1",
+			.scheme = "http",
+			.method = spec.method,
+			.uri = split_uri(spec.uri),
+			.headers = std::pmr::vector<HttpRequest::Header>(arena),
+			.body = {},
+			.arena = arena,
+		};
+		request.headers.emplace_back("Host", "localhost");
+		for (const auto &name : header_values) {
+			request.headers.emplace_back(name, "benchmark");
+		}
+		if (!body.empty()) {
+			request.headers.emplace_back("Content-Type", "application/octet-stream");
+			request.headers.emplace_back("Content-Length", content_length);
+			request.body = std::make_unique<StringInputStream>(body);
+		}
+		return request;
+	}
+};
+
+class Latencies {
+	std::vector<Clock::duration> samples;
+
+public:
+	explicit Latencies(size_t n) { samples.reserve(n); }
+
+	void Add(Clock::duration d) { samples.push_back(d); }
+
+	double Mean() const
+	{
+		Clock::duration total{};
+		for (const auto d : samples) {
+			total += d;
+		}
+		if (samples.empty()) {
+			return 0.0;
+		}
+		return std::chrono::duration<double, std::micro>(total).count() / samples.size();
+	}
+
+	// Sorts the samples
+	void Print(std::string_view name, Clock::duration elapsed)
+	{
+		std::sort(samples.begin(), samples.end());
+		const auto percentile = [this](double p) {
+			const auto i = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+			return std::chrono::duration<double, std::micro>(samples[i]).count();
+		};
+		const auto seconds = std::chrono::duration<double>(elapsed).count();
+		fmt::print("{}: {} requests in {:.3f} s, {:.0f} req/s\n", name, samples.size(), seconds,
+			   samples.size() / seconds);
+		fmt::print("  latency [us]: mean {:.1f}, p50 {:.1f}, p99 {:.1f}, p99.9 {:.1f}, max {:.1f}\n", Mean(),
+			   percentile(0.5), percentile(0.99), percentile(0.999),
+			   std::chrono::duration<double, std::micro>(samples.back()).count());
+	}
+};
+
+// Adds the number of responses with an error status or an unexpected size to `failures`
+double
+bench_handler(RequestHandler &handler, const BenchConfig &config, const std::vector<PreparedRequest> &prepared,
+	      uint64_t &failures)
+{
+	RequestArena arena;
+	uint64_t errors = 0, size_mismatches = 0;
+	const auto process = [&](unsigned i) {
+		arena.Reset();
+		BenchResponder responder;
+		const auto &request = prepared[i % prepared.size()];
+		handler.Process(request.Build(arena.Get()), responder);
+		if (!(responder.status >= 200 && responder.status < 400)) {
+			++errors;
+		} else if (request.spec.response_size && responder.body_bytes != *request.spec.response_size) {
+			++size_mismatches;
+		}
+	};
+
+	for (unsigned i = 0; i < config.warmup; ++i) {
+		process(i);
+	}
+
+	Latencies latencies(config.requests);
+	const auto start = Clock::now();
+	for (unsigned i = 0; i < config.requests; ++i) {
+		const auto t = Clock::now();
+		process(i);
+		latencies.Add(Clock::now() - t);
+	}
+	latencies.Print("python-was", Clock::now() - start);
+	if (errors > 0) {
+		fmt::print("  {} responses with an error status\n", errors);
+	}
+	if (size_mismatches > 0) {
+		fmt::print("  {} responses with an unexpected body size\n", size_mismatches);
+	}
+	failures += errors + size_mismatches;
+	return latencies.Mean();
+}
+
+double
+bench_direct(PyObject *app, const BenchConfig &config, const std::vector<PreparedRequest> &prepared)
+{
+	auto code = Py::wrap(Py_CompileString(direct_source, "<python_was_bench>", Py_file_input));
+	if (!code) {
+		Py::rethrow_python_exception();
+	}
+	auto module = Py::wrap(PyImport_ExecCodeModule("python_was_bench", code));
+	if (!module) {
+		Py::rethrow_python_exception();
+	}
+	auto run = Py::wrap(PyObject_GetAttrString(module, "run"));
+	auto make_environ = Py::wrap(PyObject_GetAttrString(module, "make_environ"));
+	if (!run || !make_environ) {
+		Py::rethrow_python_exception();
+	}
+
+	std::vector<std::pair<Py::Object, Py::Object>> calls;
+	for (const auto &request : prepared) {
+		const auto uri = split_uri(request.spec.uri);
+		auto headers = Py::wrap(PyList_New(0));
+		if (!headers) {
+			Py::rethrow_python_exception();
+		}
+		for (const auto &name : request.header_values) {
+			auto header = Py::wrap(Py_BuildValue("(ss)", name.c_str(), "benchmark"));
+			if (!header || PyList_Append(headers, header) < 0) {
+				Py::rethrow_python_exception();
+			}
+		}
+		auto environ = Py::wrap(PyObject_CallFunction(
+		    make_environ, "ss#s#Oy#", http_method_to_string(request.spec.method), uri.path.data(),
+		    static_cast<Py_ssize_t>(uri.path.size()), uri.query.data(),
+		    static_cast<Py_ssize_t>(uri.query.size()), static_cast<PyObject *>(headers), request.body.data(),
+		    static_cast<Py_ssize_t>(request.body.size())));
+		if (!environ) {
+			Py::rethrow_python_exception();
+		}
+		calls.emplace_back(std::move(environ), Py::to_bytes(request.body));
+	}
+
+	const auto call = [&](unsigned i) {
+		const auto &[environ, body] = calls[i % calls.size()];
+		auto result = Py::wrap(PyObject_CallFunctionObjArgs(run, app, static_cast<PyObject *>(environ),
+								    static_cast<PyObject *>(body), nullptr));
+		if (!result) {
+			Py::rethrow_python_exception();
+		}
+	};
+
+	for (unsigned i = 0; i < config.warmup; ++i) {
+		call(i);
+	}
+
+	Latencies latencies(config.requests);
+	const auto start = Clock::now();
+	for (unsigned i = 0; i < config.requests; ++i) {
+		const auto t = Clock::now();
+		call(i);
+		latencies.Add(Clock::now() - t);
+	}
+	latencies.Print("application only", Clock::now() - start);
+	return latencies.Mean();
+}
+
+} // namespace
+
+BenchRequest
+BenchRequest::Parse(std::string_view spec)
+{
+	const auto next_word = [&spec]() {
+		while (spec.starts_with(' ')) {
+			spec.remove_prefix(1);
+		}
+		const auto word = spec.substr(0, spec.find(' '));
+		spec.remove_prefix(word.size());
+		return word;
+	};
+
+	BenchRequest request;
+	const auto method = next_word();
+	request.method = HTTP_METHOD_NULL;
+	for (int m = HTTP_METHOD_NULL + 1; m < HTTP_METHOD_INVALID; ++m) {
+		if (method == http_method_to_string(static_cast<http_method_t>(m))) {
+			request.method = static_cast<http_method_t>(m);
+		}
+	}
+	if (request.method == HTTP_METHOD_NULL) {
+		throw std::runtime_error(fmt::format("Invalid method in benchmark request '{}'", method));
+	}
+
+	request.uri = next_word();
+	if (!request.uri.starts_with('/')) {
+		throw std::runtime_error(fmt::format("Invalid URI in benchmark request '{}'", request.uri));
+	}
+
+	for (auto word = next_word(); !word.empty(); word = next_word()) {
+		if (word.starts_with("body=")) {
+			const auto n = ParseInteger<size_t>(word.substr(5));
+			if (!n) {
+				throw std::runtime_error("Could not parse body size of benchmark request");
+			}
+			request.body_size = *n;
+		} else if (word.starts_with("headers=")) {
+			const auto n = ParseInteger<unsigned>(word.substr(8));
+			if (!n) {
+				throw std::runtime_error("Could not parse header count of benchmark request");
+			}
+			request.header_count = *n;
+		} else if (word.starts_with("response=")) {
+			const auto n = ParseInteger<uint64_t>(word.substr(9));
+			if (!n) {
+				throw std::runtime_error("Could not parse response size of benchmark request");
+			}
+			request.response_size = *n;
+		} else {
+			throw std::runtime_error(fmt::format("Unknown option '{}' in benchmark request", word));
+		}
+	}
+	return request;
+}
+
+bool
+run_benchmark(RequestHandler &handler, const BenchConfig &config, PyObject *wsgi_app)
+{
+	static const BenchRequest default_request{ .uri = "/" };
+
+	std::vector<PreparedRequest> prepared;
+	for (const auto &request : config.mix) {
+		prepared.emplace_back(request);
+	}
+	if (prepared.empty()) {
+		prepared.emplace_back(default_request);
+	}
+
+	uint64_t failures = 0;
+	const auto total = bench_handler(handler, config, prepared, failures);
+	if (wsgi_app) {
+		const auto app = bench_direct(wsgi_app, config, prepared);
+		fmt::print("python-was overhead: {:.1f} us per request ({:.0f}% of the request)\n", total - app,
+			   total > 0 ? 100.0 * (total - app) / total : 0.0);
+	}
+	return failures == 0;
+}
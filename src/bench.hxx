@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http.hxx"
+#include "python.hxx"
+
+// One kind of request of the benchmark, parsed from "<METHOD> <URI> [body=<bytes>] [headers=<count>]
+// [response=<bytes>]"
+struct BenchRequest {
+	http_method_t method = HTTP_METHOD_GET;
+	std::string uri;
+	size_t body_size = 0;
+	// Number of additional X-Bench-<n> request headers
+	unsigned header_count = 0;
+	// If set, responses with a body of a different size are reported
+	std::optional<uint64_t> response_size;
+
+	static BenchRequest Parse(std::string_view spec);
+};
+
+struct BenchConfig {
+	unsigned requests = 0;
+	unsigned warmup = 1000;
+	// The requests are sent round-robin
+	std::vector<BenchRequest> mix;
+};
+
+// Sends the requests of `config` to `handler` in this thread and prints throughput and latency percentiles to stdout.
+// If `wsgi_app` is set, the same requests are then passed to the application directly, without python-was, to tell
+// how much of the time is spent in the application and how much in python-was.
+// Returns false if any response had an error status or an unexpected body size.
+bool
+run_benchmark(RequestHandler &handler, const BenchConfig &config, PyObject *wsgi_app);
@@ -0,0 +1,352 @@
+#include "cache.hxx"
+#include "python.hxx"
+
+#include <algorithm>
+#include <optional>
+
+#include <fmt/format.h>
+
+#include <util/NumberParser.hxx>
+
+namespace {
+// Calls `f` with every element of a comma separated list
+template <typename F>
+void
+for_each_list_item(std::string_view list, F &&f)
+{
+	while (!list.empty()) {
+		const auto comma = list.find(',');
+		const auto item = StripWhitespace(list.substr(0, comma));
+		list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+		if (!item.empty()) {
+			f(item);
+		}
+	}
+}
+
+std::string
+lower(std::string_view s)
+{
+	std::string result(s);
+	std::transform(result.begin(), result.end(), result.begin(),
+		       [](char c) { return c >= 'A' && c <= 'Z' ? static_cast<char>(c + ('a' - 'A')) : c; });
+	return result;
+}
+
+// How long a response may be cached according to its Cache-Control header
+std::optional<std::chrono::seconds>
+get_max_age(std::string_view cache_control) noexcept
+{
+	std::optional<std::chrono::seconds> max_age, s_maxage;
+	bool cacheable = true;
+	for_each_list_item(cache_control, [&](std::string_view directive) {
+		const auto eq = directive.find('=');
+		const auto name = StripWhitespace(directive.substr(0, eq));
+		auto value =
+		    eq == std::string_view::npos ? std::string_view() : StripWhitespace(directive.substr(eq + 1));
+		if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+			value = value.substr(1, value.size() - 2);
+		}
+		if (HeaderMatch(name, "no-store") || HeaderMatch(name, "no-cache") || HeaderMatch(name, "private")) {
+			cacheable = false;
+		} else if (HeaderMatch(name, "max-age")) {
+			if (const auto n = ParseInteger<unsigned>(value)) {
+				max_age = std::chrono::seconds(*n);
+			}
+		} else if (HeaderMatch(name, "s-maxage")) {
+			if (const auto n = ParseInteger<unsigned>(value)) {
+				s_maxage = std::chrono::seconds(*n);
+			}
+		}
+	});
+
+	// We are a shared cache, so s-maxage wins
+	const auto result = s_maxage ? s_maxage : max_age;
+	if (!cacheable || !result || result->count() == 0) {
+		return std::nullopt;
+	}
+	return result;
+}
+
+// Status codes that are cacheable by default (https://www.rfc-editor.org/rfc/rfc9110#section-15.1), but only those
+// that have a body we can store
+constexpr bool
+is_cacheable_status(http_status_t status) noexcept
+{
+	switch (status) {
+	case HTTP_STATUS_OK:
+	case HTTP_STATUS_NON_AUTHORITATIVE_INFORMATION:
+	case HTTP_STATUS_NO_CONTENT:
+	case HTTP_STATUS_MOVED_PERMANENTLY:
+	case HTTP_STATUS_NOT_FOUND:
+	case HTTP_STATUS_METHOD_NOT_ALLOWED:
+	case HTTP_STATUS_GONE:
+	case HTTP_STATUS_NOT_IMPLEMENTED: return true;
+	default: return false;
+	}
+}
+
+// Passes everything on and keeps a copy of a cacheable response
+class RecordingResponder final : public HttpResponder {
+	HttpResponder &next;
+	const CacheConfig &config;
+
+	std::shared_ptr<CachingRequestHandler::Response> response;
+	// The names of the request headers in Vary, lower case
+	std::vector<std::string> vary;
+
+	void Abandon() noexcept { response.reset(); }
+
+	void Record(http_status_t status, const HttpResponse &http_response)
+	{
+		std::optional<std::chrono::seconds> max_age;
+		for (const auto &[name, value] : http_response.headers) {
+			if (HeaderMatch(name, "Set-Cookie")) {
+				return;
+			} else if (HeaderMatch(name, "Cache-Control")) {
+				max_age = get_max_age(value);
+				if (!max_age) {
+					return;
+				}
+			} else if (HeaderMatch(name, "Vary")) {
+				bool any = false;
+				for_each_list_item(value, [&](std::string_view item) {
+					any = any || item == "*";
+					vary.push_back(lower(item));
+				});
+				if (any) {
+					return;
+				}
+			}
+		}
+		if (!max_age ||
+		    (http_response.content_length && *http_response.content_length > config.max_entry_size)) {
+			return;
+		}
+
+		response = std::make_shared<CachingRequestHandler::Response>();
+		response->status = status;
+		response->content_length = http_response.content_length;
+		for (const auto &[name, value] : http_response.headers) {
+			response->headers.emplace_back(name, value);
+		}
+		response->stored = CachingRequestHandler::Clock::now();
+		response->expires = response->stored + *max_age;
+	}
+
+protected:
+	void SendHeadersImpl(HttpResponse &&http_response) override
+	{
+		if (is_cacheable_status(http_response.status)) {
+			Record(http_response.status, http_response);
+		}
+		next.SendHeaders(std::move(http_response));
+	}
+
+	void SendBodyImpl(std::string_view body_data) override
+	{
+		if (response) {
+			if (response->body.size() + body_data.size() > config.max_entry_size) {
+				Abandon();
+			} else {
+				response->body.append(body_data);
+			}
+		}
+		next.SendBody(body_data);
+	}
+
+	void SendBodyChunksImpl(std::span<const std::string_view> chunks) override
+	{
+		for (const auto chunk : chunks) {
+			if (!response) {
+				break;
+			}
+			if (response->body.size() + chunk.size() > config.max_entry_size) {
+				Abandon();
+			} else {
+				response->body.append(chunk);
+			}
+		}
+		next.SendBodyChunks(chunks);
+	}
+
+	// Files are usually large and may change, they are cheap to send again anyway
+	void SendFileImpl(int fd, uint64_t offset, uint64_t length) override
+	{
+		Abandon();
+		next.SendFile(fd, offset, length);
+	}
+
+public:
+	RecordingResponder(HttpResponder &next, const CacheConfig &config) : next(next), config(config) {}
+
+	// Returns the recorded response, if it is complete and cacheable
+	std::shared_ptr<const CachingRequestHandler::Response> TakeResponse(bool head) noexcept
+	{
+		if (response && !head && response->content_length &&
+		    *response->content_length != response->body.size()) {
+			return nullptr;
+		}
+		return std::move(response);
+	}
+
+	const std::vector<std::string> &Vary() const noexcept { return vary; }
+};
+
+// The WAS parameters and SCRIPT_NAME are part of the key, because they are configured per location in the translation
+// server and may select a different application (e.g. with --pool) for the same URI
+std::string
+make_key(const HttpRequest &request)
+{
+	auto key = fmt::format("{} {} {} {}?{}", http_method_to_string(request.method),
+			       request.FindHeader("Host").value_or(""), request.script_name, request.uri.path,
+			       request.uri.query);
+	// Neither of them can contain a newline
+	for (const auto &[name, value] : request.parameters) {
+		key.append("\n").append(name).append("=").append(value);
+	}
+	return key;
+}
+
+bool
+vary_matches(const std::vector<std::pair<std::string, std::string>> &vary, const HttpRequest &request) noexcept
+{
+	return std::all_of(vary.begin(), vary.end(), [&](const auto &header) {
+		return request.FindHeader(header.first).value_or("") == header.second;
+	});
+}
+
+size_t
+response_size(const CachingRequestHandler::Response &response) noexcept
+{
+	size_t size = sizeof(response) + response.body.size();
+	for (const auto &[name, value] : response.headers) {
+		size += name.size() + value.size();
+	}
+	return size;
+}
+}
+
+std::shared_ptr<const CachingRequestHandler::Response>
+CachingRequestHandler::Lookup(const std::string &key, const HttpRequest &request)
+{
+	const auto now = Clock::now();
+	const std::lock_guard lock(mutex);
+	const auto [begin, end] = index.equal_range(key);
+	for (auto it = begin; it != end; ++it) {
+		const auto entry = it->second;
+		if (!vary_matches(entry->vary, request)) {
+			continue;
+		}
+		if (entry->response->expires <= now) {
+			Erase(entry);
+			return nullptr;
+		}
+		entries.splice(entries.begin(), entries, entry);
+		return entry->response;
+	}
+	return nullptr;
+}
+
+void
+CachingRequestHandler::Erase(std::list<Entry>::iterator entry) noexcept
+{
+	const auto [begin, end] = index.equal_range(entry->key);
+	for (auto it = begin; it != end; ++it) {
+		if (it->second == entry) {
+			index.erase(it);
+			break;
+		}
+	}
+	size -= entry->size;
+	entries.erase(entry);
+}
+
+void
+CachingRequestHandler::Store(std::string &&key, std::vector<std::pair<std::string, std::string>> &&vary,
+			     std::shared_ptr<const Response> response)
+{
+	const auto entry_size = key.size() + response_size(*response);
+	if (entry_size > config.max_size) {
+		return;
+	}
+
+	const std::lock_guard lock(mutex);
+
+	// Replace the variant for the same header values, a concurrent request may have stored it already
+	const auto [begin, end] = index.equal_range(key);
+	for (auto it = begin; it != end; ++it) {
+		if (it->second->vary == vary) {
+			Erase(it->second);
+			break;
+		}
+	}
+
+	while (size + entry_size > config.max_size && !entries.empty()) {
+		Erase(std::prev(entries.end()));
+	}
+
+	entries.push_front(Entry{ std::move(key), std::move(vary), std::move(response), entry_size });
+	index.emplace(entries.front().key, entries.begin());
+	size += entry_size;
+}
+
+void
+CachingRequestHandler::Process(HttpRequest &&request, HttpResponder &responder)
+{
+	const bool head = request.method == HTTP_METHOD_HEAD;
+	if ((request.method != HTTP_METHOD_GET && !head) || request.FindHeader("Authorization")) {
+		next->Process(std::move(request), responder);
+		return;
+	}
+
+	auto key = make_key(request);
+	{
+		// A hit doesn't need the interpreter, so other threads can use it meanwhile
+		const Py::ReleaseGilIfHeld release;
+		if (const auto cached = Lookup(key, request)) {
+			HttpResponse response{
+				.status = cached->status,
+				.headers = std::pmr::vector<HttpResponse::Header>(request.arena),
+				.content_length = cached->content_length,
+			};
+			response.headers.reserve(cached->headers.size() + 1);
+			for (const auto &[name, value] : cached->headers) {
+				// Replaced by our own below, e.g. if the application was behind another cache
+				if (!HeaderMatch(name, "Age")) {
+					response.headers.emplace_back(name, value);
+				}
+			}
+			const auto age =
+			    std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - cached->stored);
+			response.headers.emplace_back("Age", fmt::format("{}", age.count()));
+			responder.SendHeaders(std::move(response));
+			if (!head && !cached->body.empty()) {
+				responder.SendBody(cached->body);
+			}
+			return;
+		}
+	}
+
+	// The request is gone after Process, so the values for Vary are copied before
+	std::vector<std::pair<std::string, std::string>> request_headers;
+	for (const auto &[name, value] : request.headers) {
+		request_headers.emplace_back(lower(name), value);
+	}
+
+	RecordingResponder recording(responder, config);
+	next->Process(std::move(request), recording);
+
+	auto response = recording.TakeResponse(head);
+	if (!response) {
+		return;
+	}
+	std::vector<std::pair<std::string, std::string>> vary;
+	for (const auto &name : recording.Vary()) {
+		const auto it = std::find_if(request_headers.begin(), request_headers.end(),
+					     [&](const auto &header) { return header.first == name; });
+		vary.emplace_back(name, it != request_headers.end() ? it->second : std::string());
+	}
+	const Py::ReleaseGilIfHeld release;
+	Store(std::move(key), std::move(vary), std::move(response));
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "http.hxx"
+
+struct CacheConfig {
+	// The total size of all cached responses, 0 disables the cache
+	size_t max_size = 0;
+	// Larger responses are not cached
+	size_t max_entry_size = 1024 * 1024;
+};
+
+// Keeps responses to GET and HEAD requests in memory, for as long as the application allows with
+// "Cache-Control: s-maxage" or "max-age", and answers later requests for the same URI (and the same values of the
+// request headers listed in Vary) without calling the application. Responses with Set-Cookie, "Cache-Control:
+// private/no-store/no-cache" or a body sent as a file are not cached, nor are requests with Authorization.
+// The least recently used responses are removed, when the cache gets too big.
+class CachingRequestHandler final : public RequestHandler {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Response {
+		http_status_t status;
+		std::vector<std::pair<std::string, std::string>> headers;
+		std::optional<uint64_t> content_length;
+		std::string body;
+		Clock::time_point stored;
+		Clock::time_point expires;
+	};
+
+private:
+	struct Entry {
+		std::string key;
+		// The request headers named in Vary and their values in the request this was stored for
+		std::vector<std::pair<std::string, std::string>> vary;
+		std::shared_ptr<const Response> response;
+		size_t size;
+	};
+
+	std::unique_ptr<RequestHandler> next;
+	CacheConfig config;
+
+	std::mutex mutex;
+	// Most recently used first
+	std::list<Entry> entries;
+	// All variants of a key, the keys point into `entries`
+	std::unordered_multimap<std::string_view, std::list<Entry>::iterator> index;
+	size_t size = 0;
+
+	std::shared_ptr<const Response> Lookup(const std::string &key, const HttpRequest &request);
+	void Store(std::string &&key, std::vector<std::pair<std::string, std::string>> &&vary,
+		   std::shared_ptr<const Response> response);
+	void Erase(std::list<Entry>::iterator entry) noexcept;
+
+public:
+	CachingRequestHandler(std::unique_ptr<RequestHandler> next, CacheConfig config)
+	  : next(std::move(next))
+	  , config(config)
+	{
+	}
+
+	void Process(HttpRequest &&request, HttpResponder &responder) override;
+	void Prepare() noexcept override { next->Prepare(); }
+};
@@ -0,0 +1,80 @@
+#include "coalesce.hxx"
+
+#include <array>
+
+void
+CoalescingResponder::SendHeadersImpl(HttpResponse &&response)
+{
+	const auto content_type = response.FindHeader("Content-Type");
+	const auto buffering = response.FindHeader("X-Accel-Buffering");
+	bypass = (content_type && content_type->starts_with("text/event-stream")) ||
+		 (buffering && HeaderMatch(*buffering, "no"));
+	next.SendHeaders(std::move(response));
+}
+
+void
+CoalescingResponder::SendBodyImpl(std::string_view body_data)
+{
+	if (bypass) {
+		next.SendBody(body_data);
+		return;
+	}
+
+	if (body_data.empty()) {
+		Flush();
+		return;
+	}
+
+	if (body_data.size() >= config.max_size || buffer.size() + body_data.size() > config.max_size) {
+		if (buffer.empty()) {
+			next.SendBody(body_data);
+		} else {
+			const std::array<std::string_view, 2> chunks = { buffer, body_data };
+			next.SendBodyChunks(chunks);
+			buffer.clear();
+		}
+		return;
+	}
+
+	const auto now = Clock::now();
+	if (buffer.empty()) {
+		buffer.reserve(config.max_size);
+		first_chunk = now;
+	}
+	buffer.append(body_data);
+	if (now - first_chunk >= config.max_delay) {
+		Flush();
+	}
+}
+
+void
+CoalescingResponder::SendBodyChunksImpl(std::span<const std::string_view> chunks)
+{
+	// These are gathered already
+	Flush();
+	next.SendBodyChunks(chunks);
+}
+
+void
+CoalescingResponder::SendFileImpl(int fd, uint64_t offset, uint64_t length)
+{
+	Flush();
+	next.SendFile(fd, offset, length);
+}
+
+void
+CoalescingResponder::Flush()
+{
+	if (!buffer.empty()) {
+		next.SendBody(buffer);
+		buffer.clear();
+	}
+}
+
+void
+CoalescingRequestHandler::Process(HttpRequest &&request, HttpResponder &responder)
+{
+	CoalescingResponder coalescing(responder, config);
+	next->Process(std::move(request), coalescing);
+	coalescing.Flush();
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "http.hxx"
+
+struct CoalesceConfig {
+	// Body chunks are collected until they add up to this many bytes
+	size_t max_size = 0;
+	// ... or until the oldest collected chunk is this old, when the next one arrives (there is no timer)
+	std::chrono::milliseconds max_delay{ 50 };
+};
+
+// Collects small body chunks and passes them on together, so an application that yields lots of tiny strings does
+// not cause a write for each of them. Chunks of at least max_size bytes are passed on right away (together with the
+// collected ones) and an empty chunk flushes, which is how WSGI applications ask for a flush.
+// This delays data, which PEP 3333 does not allow, so it's only enabled on request. Responses that are streamed to
+// the client as events (text/event-stream or "X-Accel-Buffering: no") are never coalesced.
+class CoalescingResponder final : public HttpResponder {
+	using Clock = std::chrono::steady_clock;
+
+	HttpResponder &next;
+	const CoalesceConfig &config;
+	std::string buffer;
+	Clock::time_point first_chunk;
+	bool bypass = false;
+
+protected:
+	void SendHeadersImpl(HttpResponse &&response) override;
+	void SendBodyImpl(std::string_view body_data) override;
+	void SendBodyChunksImpl(std::span<const std::string_view> chunks) override;
+	void SendFileImpl(int fd, uint64_t offset, uint64_t length) override;
+
+public:
+	CoalescingResponder(HttpResponder &next, const CoalesceConfig &config) : next(next), config(config) {}
+
+	// Passes on the collected chunks
+	void Flush();
+};
+
+class CoalescingRequestHandler final : public RequestHandler {
+	std::unique_ptr<RequestHandler> next;
+	CoalesceConfig config;
+
+public:
+	CoalescingRequestHandler(std::unique_ptr<RequestHandler> next, CoalesceConfig config)
+	  : next(std::move(next))
+	  , config(config)
+	{
+	}
+
+	void Process(HttpRequest &&request, HttpResponder &responder) override;
+	void Prepare() noexcept override { next->Prepare(); }
+};
@@ -0,0 +1,595 @@
+#include "compress.hxx"
+#include "python.hxx"
+
+#include "config.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <util/NumberParser.hxx>
+
+namespace {
+
+class Encoder {
+public:
+	enum class Mode {
+		// Compress as much as is efficient, the rest stays in the encoder
+		PROCESS,
+		// Output everything that has been passed in so far
+		FLUSH,
+		// End the stream
+		FINISH,
+	};
+
+	virtual ~Encoder() = default;
+
+	// Appends the compressed output to `output`
+	virtual void Compress(std::string_view input, Mode mode, std::string &output) = 0;
+};
+
+constexpr size_t output_chunk_size = 16384;
+
+class GzipEncoder final : public Encoder {
+	z_stream stream = {};
+
+public:
+	explicit GzipEncoder(std::optional<int> level)
+	{
+		// 16 + 15: gzip header and the maximum window size
+		if (deflateInit2(&stream, std::clamp(level.value_or(6), 1, 9), Z_DEFLATED, 16 + 15, 8,
+				 Z_DEFAULT_STRATEGY) != Z_OK) {
+			throw std::runtime_error("deflateInit2 failed");
+		}
+	}
+
+	~GzipEncoder() override { deflateEnd(&stream); }
+
+	void Compress(std::string_view input, Mode mode, std::string &output) override
+	{
+		const int flush = mode == Mode::FINISH ? Z_FINISH : mode == Mode::FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+		stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+		stream.avail_in = static_cast<uInt>(input.size());
+		while (true) {
+			const auto old_size = output.size();
+			output.resize(old_size + output_chunk_size);
+			stream.next_out = reinterpret_cast<Bytef *>(output.data() + old_size);
+			stream.avail_out = output_chunk_size;
+			const auto ret = deflate(&stream, flush);
+			output.resize(old_size + output_chunk_size - stream.avail_out);
+			if (ret == Z_STREAM_ERROR) {
+				throw std::runtime_error("deflate failed");
+			}
+			if (ret == Z_STREAM_END ||
+			    (stream.avail_in == 0 && stream.avail_out > 0 && flush != Z_FINISH)) {
+				return;
+			}
+		}
+	}
+};
+
+#ifdef HAVE_BROTLI
+class BrotliEncoder final : public Encoder {
+	BrotliEncoderState *state;
+
+public:
+	explicit BrotliEncoder(std::optional<int> level)
+	  : state(BrotliEncoderCreateInstance(nullptr, nullptr, nullptr))
+	{
+		if (!state) {
+			throw std::bad_alloc();
+		}
+		// The default of 11 is meant for static content and far too slow for responses
+		BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY,
+					  std::clamp(level.value_or(5), BROTLI_MIN_QUALITY, BROTLI_MAX_QUALITY));
+	}
+
+	~BrotliEncoder() override { BrotliEncoderDestroyInstance(state); }
+
+	void Compress(std::string_view input, Mode mode, std::string &output) override
+	{
+		const auto op = mode == Mode::FINISH  ? BROTLI_OPERATION_FINISH
+				: mode == Mode::FLUSH ? BROTLI_OPERATION_FLUSH
+						      : BROTLI_OPERATION_PROCESS;
+		auto next_in = reinterpret_cast<const uint8_t *>(input.data());
+		size_t avail_in = input.size();
+		while (true) {
+			size_t avail_out = 0;
+			if (!BrotliEncoderCompressStream(state, op, &avail_in, &next_in, &avail_out, nullptr,
+							 nullptr)) {
+				throw std::runtime_error("BrotliEncoderCompressStream failed");
+			}
+			size_t size = 0;
+			const auto data = BrotliEncoderTakeOutput(state, &size);
+			output.append(reinterpret_cast<const char *>(data), size);
+			if (avail_in == 0 && !BrotliEncoderHasMoreOutput(state) &&
+			    (op != BROTLI_OPERATION_FINISH || BrotliEncoderIsFinished(state))) {
+				return;
+			}
+		}
+	}
+};
+#endif
+
+#ifdef HAVE_ZSTD
+class ZstdEncoder final : public Encoder {
+	ZSTD_CCtx *context;
+
+public:
+	explicit ZstdEncoder(std::optional<int> level) : context(ZSTD_createCCtx())
+	{
+		if (!context) {
+			throw std::bad_alloc();
+		}
+		ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel,
+				       std::clamp(level.value_or(ZSTD_CLEVEL_DEFAULT), 1, ZSTD_maxCLevel()));
+	}
+
+	~ZstdEncoder() override { ZSTD_freeCCtx(context); }
+
+	void Compress(std::string_view input, Mode mode, std::string &output) override
+	{
+		const auto op = mode == Mode::FINISH  ? ZSTD_e_end
+				: mode == Mode::FLUSH ? ZSTD_e_flush
+						      : ZSTD_e_continue;
+		ZSTD_inBuffer in = { input.data(), input.size(), 0 };
+		while (true) {
+			const auto old_size = output.size();
+			output.resize(old_size + output_chunk_size);
+			ZSTD_outBuffer out = { output.data() + old_size, output_chunk_size, 0 };
+			const auto remaining = ZSTD_compressStream2(context, &out, &in, op);
+			output.resize(old_size + out.pos);
+			if (ZSTD_isError(remaining)) {
+				throw std::runtime_error(ZSTD_getErrorName(remaining));
+			}
+			if (in.pos == in.size && (op == ZSTD_e_continue || remaining == 0)) {
+				return;
+			}
+		}
+	}
+};
+#endif
+
+std::unique_ptr<Encoder>
+create_encoder(ContentCoding coding, std::optional<int> level)
+{
+	switch (coding) {
+	case ContentCoding::IDENTITY: break;
+	case ContentCoding::GZIP: return std::make_unique<GzipEncoder>(level);
+#ifdef HAVE_BROTLI
+	case ContentCoding::BROTLI: return std::make_unique<BrotliEncoder>(level);
+#endif
+#ifdef HAVE_ZSTD
+	case ContentCoding::ZSTD: return std::make_unique<ZstdEncoder>(level);
+#endif
+	default: break;
+	}
+	return nullptr;
+}
+
+constexpr std::string_view
+coding_name(ContentCoding coding) noexcept
+{
+	switch (coding) {
+	case ContentCoding::IDENTITY: return "identity";
+	case ContentCoding::GZIP: return "gzip";
+	case ContentCoding::BROTLI: return "br";
+	case ContentCoding::ZSTD: return "zstd";
+	}
+	return "identity";
+}
+
+// Compresses the body of a response, unless it's not worth it or not possible
+class CompressingResponder : public HttpResponder {
+	HttpResponder &next;
+	const CompressConfig &config;
+	const ContentCoding coding;
+
+	std::unique_ptr<Encoder> encoder;
+	// The headers are held back until the first body data arrives. If that is the whole body, the compressed
+	// length is known.
+	std::optional<HttpResponse> pending;
+	uint64_t received = 0;
+	bool finished = false;
+	std::string output;
+
+	bool IsCompressible(const HttpResponse &response) const noexcept
+	{
+		const auto status = static_cast<unsigned>(response.status);
+		if (status < 200 || status == 204 || status == 206 || status == 304) {
+			return false;
+		}
+		if (response.content_length && *response.content_length < config.min_size) {
+			return false;
+		}
+		if (response.FindHeader("Content-Encoding")) {
+			return false;
+		}
+		if (const auto cache_control = response.FindHeader("Cache-Control");
+		    cache_control && cache_control->find("no-transform") != std::string_view::npos) {
+			return false;
+		}
+		const auto content_type = response.FindHeader("Content-Type");
+		return content_type &&
+		       std::any_of(config.content_types.begin(), config.content_types.end(),
+				   [&](const auto &prefix) { return content_type->starts_with(prefix); });
+	}
+
+	static void AddVary(HttpResponse &response)
+	{
+		for (auto &[name, value] : response.headers) {
+			if (HeaderMatch(name, "Vary")) {
+				if (value.find('*') == std::string::npos) {
+					value.append(", Accept-Encoding");
+				}
+				return;
+			}
+		}
+		response.headers.emplace_back("Vary", "Accept-Encoding");
+	}
+
+	// The compressed body is a different representation: byte ranges of the identity body don't apply to it,
+	// and a strong ETag must not be shared by both
+	static void AdjustForCoding(HttpResponse &response)
+	{
+		std::erase_if(response.headers,
+			      [](const auto &header) { return HeaderMatch(header.first, "Accept-Ranges"); });
+		for (auto &[name, value] : response.headers) {
+			if (HeaderMatch(name, "ETag") && !value.starts_with("W/")) {
+				value.insert(0, "W/");
+			}
+		}
+	}
+
+	void SendOutput(bool complete)
+	{
+		if (pending) {
+			pending->content_length = complete ? std::optional<uint64_t>(output.size()) : std::nullopt;
+			next.SendHeaders(std::move(*pending));
+			pending.reset();
+		}
+		if (!output.empty()) {
+			next.SendBody(output);
+		}
+		output.clear();
+	}
+
+protected:
+	void SendHeadersImpl(HttpResponse &&response) override
+	{
+		if (!IsCompressible(response)) {
+			next.SendHeaders(std::move(response));
+			return;
+		}
+
+		// The response depends on Accept-Encoding, even if this client does not get it compressed
+		AddVary(response);
+		encoder = create_encoder(coding, config.level);
+		if (!encoder) {
+			next.SendHeaders(std::move(response));
+			return;
+		}
+
+		AdjustForCoding(response);
+		response.headers.emplace_back("Content-Encoding", coding_name(coding));
+		pending = std::move(response);
+	}
+
+	void SendBodyImpl(std::string_view body_data) override { SendBodyChunksImpl({ &body_data, 1 }); }
+
+	void SendBodyChunksImpl(std::span<const std::string_view> chunks) override
+	{
+		if (!encoder) {
+			next.SendBodyChunks(chunks);
+			return;
+		}
+		uint64_t total = 0;
+		for (const auto chunk : chunks) {
+			total += chunk.size();
+		}
+		if (finished) {
+			// Applications often end the body with an empty chunk, there is nothing left to flush
+			if (total == 0) {
+				return;
+			}
+			throw std::runtime_error("Attempting to send more data than the Content-Length");
+		}
+		received += total;
+
+		// The application knows the length, so we know when we have everything
+		const bool complete = pending && pending->content_length && received >= *pending->content_length;
+		// An empty chunk is a flush in WSGI
+		const auto mode = complete ? Encoder::Mode::FINISH
+				  : total == 0 ? Encoder::Mode::FLUSH
+					       : Encoder::Mode::PROCESS;
+		for (size_t i = 0; i + 1 < chunks.size(); ++i) {
+			encoder->Compress(chunks[i], Encoder::Mode::PROCESS, output);
+		}
+		encoder->Compress(chunks.empty() ? std::string_view() : chunks.back(), mode, output);
+		finished = complete;
+		SendOutput(complete);
+	}
+
+	void SendFileImpl(int fd, uint64_t offset, uint64_t length) override
+	{
+		if (!encoder) {
+			next.SendFile(fd, offset, length);
+			return;
+		}
+		// Read into a buffer and pass it to SendBodyImpl
+		HttpResponder::SendFileImpl(fd, offset, length);
+	}
+
+public:
+	CompressingResponder(HttpResponder &next, const CompressConfig &config, ContentCoding coding)
+	  : next(next)
+	  , config(config)
+	  , coding(coding)
+	{
+	}
+
+	void Finish()
+	{
+		if (!encoder || finished) {
+			return;
+		}
+		encoder->Compress({}, Encoder::Mode::FINISH, output);
+		finished = true;
+		SendOutput(true);
+	}
+};
+
+// Runs functions in order on a separate thread, so the calling thread can go on while they run
+class WorkerThread {
+	static constexpr size_t max_queued_bytes = 1024 * 1024;
+
+	std::mutex mutex;
+	std::condition_variable work_cond;
+	std::condition_variable done_cond;
+	std::deque<std::pair<std::function<void()>, size_t>> queue;
+	size_t queued_bytes = 0;
+	bool busy = false;
+	bool stop = false;
+	std::exception_ptr error;
+	std::thread thread;
+
+	void Run() noexcept
+	{
+		std::unique_lock lock(mutex);
+		while (true) {
+			work_cond.wait(lock, [this]() { return stop || !queue.empty(); });
+			if (queue.empty()) {
+				return;
+			}
+			auto [function, size] = std::move(queue.front());
+			queue.pop_front();
+			busy = true;
+			lock.unlock();
+
+			std::exception_ptr function_error;
+			if (!error) {
+				try {
+					function();
+				} catch (...) {
+					function_error = std::current_exception();
+				}
+			}
+
+			lock.lock();
+			busy = false;
+			queued_bytes -= size;
+			if (function_error && !error) {
+				error = function_error;
+			}
+			done_cond.notify_all();
+		}
+	}
+
+public:
+	WorkerThread() : thread([this]() { Run(); }) {}
+
+	~WorkerThread()
+	{
+		{
+			const std::lock_guard lock(mutex);
+			stop = true;
+		}
+		work_cond.notify_one();
+		thread.join();
+	}
+
+	void Push(std::function<void()> function, size_t size)
+	{
+		// Released before locking the mutex, so it is never held while waiting for the GIL
+		const Py::ReleaseGilIfHeld release;
+		std::unique_lock lock(mutex);
+		done_cond.wait(lock,
+			       [&]() { return error || queue.empty() || queued_bytes + size <= max_queued_bytes; });
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		queue.emplace_back(std::move(function), size);
+		queued_bytes += size;
+		work_cond.notify_one();
+	}
+
+	// Waits until everything has been run and rethrows the first error. Afterwards the thread can be used for the
+	// next request.
+	void Finish()
+	{
+		const Py::ReleaseGilIfHeld release;
+		std::unique_lock lock(mutex);
+		done_cond.wait(lock, [this]() { return queue.empty() && !busy; });
+		if (auto e = std::exchange(error, nullptr)) {
+			std::rethrow_exception(e);
+		}
+	}
+
+	void Cancel() noexcept
+	{
+		const Py::ReleaseGilIfHeld release;
+		std::unique_lock lock(mutex);
+		for (const auto &[function, size] : queue) {
+			queued_bytes -= size;
+		}
+		queue.clear();
+		done_cond.wait(lock, [this]() { return !busy; });
+		error = nullptr;
+	}
+};
+
+// Passes everything on to `target` on a WorkerThread. The data is copied, because it belongs to the application.
+class ThreadedResponder : public HttpResponder {
+	WorkerThread &worker;
+	CompressingResponder &target;
+
+protected:
+	void SendHeadersImpl(HttpResponse &&response) override
+	{
+		worker.Push([&target = target, response = std::move(response)]() mutable {
+			target.SendHeaders(std::move(response));
+		}, 0);
+	}
+
+	void SendBodyImpl(std::string_view body_data) override
+	{
+		worker.Push([&target = target, data = std::string(body_data)]() { target.SendBody(data); },
+			    body_data.size());
+	}
+
+	void SendBodyChunksImpl(std::span<const std::string_view> chunks) override
+	{
+		std::string data;
+		for (const auto chunk : chunks) {
+			data.append(chunk);
+		}
+		const auto size = data.size();
+		worker.Push([&target = target, data = std::move(data)]() { target.SendBody(data); }, size);
+	}
+
+	// The application closes the file after we return, so the worker gets its own descriptor
+	void SendFileImpl(int fd, uint64_t offset, uint64_t length) override
+	{
+		const int dup_fd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (dup_fd < 0) {
+			throw std::system_error(errno, std::system_category(), "Could not duplicate file descriptor");
+		}
+		auto file = std::shared_ptr<int>(new int(dup_fd), [](int *p) {
+			::close(*p);
+			delete p;
+		});
+		worker.Push([&target = target, file, offset, length]() { target.SendFile(*file, offset, length); }, 0);
+	}
+
+public:
+	ThreadedResponder(WorkerThread &worker, CompressingResponder &target) : worker(worker), target(target) {}
+
+	void Finish()
+	{
+		worker.Push([&target = target]() { target.Finish(); }, 0);
+		worker.Finish();
+	}
+};
+
+} // namespace
+
+ContentCoding
+negotiate_content_coding(std::string_view accept_encoding) noexcept
+{
+	ContentCoding best = ContentCoding::IDENTITY;
+	unsigned best_q = 0;
+
+	while (!accept_encoding.empty()) {
+		const auto comma = accept_encoding.find(',');
+		auto item = accept_encoding.substr(0, comma);
+		accept_encoding.remove_prefix(comma == std::string_view::npos ? accept_encoding.size() : comma + 1);
+
+		// Quality values have at most 3 decimal places, so we compare them as integers in 1/1000
+		unsigned q = 1000;
+		if (const auto semicolon = item.find(';'); semicolon != std::string_view::npos) {
+			const auto param = StripWhitespace(item.substr(semicolon + 1));
+			item = item.substr(0, semicolon);
+			if (param.starts_with("q=") || param.starts_with("Q=")) {
+				const auto value = param.substr(2);
+				const auto dot = value.find('.');
+				const auto integer = ParseInteger<unsigned>(value.substr(0, dot));
+				q = integer.value_or(0) >= 1 ? 1000 : 0;
+				if (dot != std::string_view::npos && q == 0) {
+					auto fraction = std::string(value.substr(dot + 1, 3));
+					fraction.resize(3, '0');
+					q = ParseInteger<unsigned>(fraction).value_or(0);
+				}
+			}
+		}
+
+		item = StripWhitespace(item);
+		ContentCoding coding;
+		if (HeaderMatch(item, "gzip") || HeaderMatch(item, "x-gzip")) {
+			coding = ContentCoding::GZIP;
+#ifdef HAVE_BROTLI
+		} else if (HeaderMatch(item, "br")) {
+			coding = ContentCoding::BROTLI;
+#endif
+#ifdef HAVE_ZSTD
+		} else if (HeaderMatch(item, "zstd")) {
+			coding = ContentCoding::ZSTD;
+#endif
+		} else {
+			continue;
+		}
+
+		// With equal quality, the later enumerators compress better
+		if (q > 0 && (q > best_q || (q == best_q && coding > best))) {
+			best = coding;
+			best_q = q;
+		}
+	}
+
+	return best;
+}
+
+void
+CompressingRequestHandler::Process(HttpRequest &&request, HttpResponder &responder)
+{
+	auto coding = ContentCoding::IDENTITY;
+	if (request.method != HTTP_METHOD_HEAD) {
+		if (const auto accept_encoding = request.FindHeader("Accept-Encoding")) {
+			coding = negotiate_content_coding(*accept_encoding);
+		}
+	}
+
+	CompressingResponder compressing(responder, config, coding);
+	if (!config.thread) {
+		next->Process(std::move(request), compressing);
+		compressing.Finish();
+		return;
+	}
+
+	// One worker for each thread that processes requests
+	static thread_local WorkerThread worker;
+	ThreadedResponder threaded(worker, compressing);
+	try {
+		next->Process(std::move(request), threaded);
+	} catch (...) {
+		worker.Cancel();
+		throw;
+	}
+	threaded.Finish();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http.hxx"
+
+enum class ContentCoding {
+	IDENTITY,
+	GZIP,
+	BROTLI,
+	ZSTD,
+};
+
+struct CompressConfig {
+	// A level for all codings, clamped to the range of each; the default of the coding if not set
+	std::optional<int> level;
+	// Responses with a smaller Content-Length are not compressed
+	uint64_t min_size = 1024;
+	// Prefixes of the Content-Types to compress
+	std::vector<std::string> content_types = {
+		"text/", "application/json", "application/javascript", "application/xml", "image/svg+xml",
+	};
+	// Compress on a helper thread, while the application produces the next chunk
+	bool thread = false;
+};
+
+// Picks the best coding supported by python-was from the value of an Accept-Encoding header
+[[gnu::pure]] ContentCoding
+negotiate_content_coding(std::string_view accept_encoding) noexcept;
+
+// Compresses response bodies with the coding negotiated with the client
+class CompressingRequestHandler final : public RequestHandler {
+	std::unique_ptr<RequestHandler> next;
+	CompressConfig config;
+
+public:
+	CompressingRequestHandler(std::unique_ptr<RequestHandler> next, CompressConfig config)
+	  : next(std::move(next))
+	  , config(std::move(config))
+	{
+	}
+
+	void Process(HttpRequest &&request, HttpResponder &responder) override;
+	void Prepare() noexcept override { next->Prepare(); }
+};
@@ -0,0 +1,159 @@
+#include "file_wrapper.hxx"
+
+#include <algorithm>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+int
+FileWrapper::init(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = { "filelike", "blksize", nullptr };
+
+	PyObject *filelike = nullptr;
+	Py_ssize_t block_size = 8192;
+	if (!PyArg_ParseTupleAndKeywords(
+		args, kwargs, "O|n", const_cast<char **>(keywords), &filelike, &block_size)) {
+		return -1;
+	}
+	if (block_size <= 0) {
+		PyErr_SetString(PyExc_ValueError, "blksize must be positive");
+		return -1;
+	}
+
+	auto *obj = reinterpret_cast<FileWrapper *>(self);
+	Py_XSETREF(obj->filelike, Py_NewRef(filelike));
+	obj->block_size = block_size;
+	return 0;
+}
+
+PyObject *
+FileWrapper::iter(PyObject *self)
+{
+	return Py_NewRef(self);
+}
+
+PyObject *
+FileWrapper::next(PyObject *self)
+{
+	auto *obj = reinterpret_cast<FileWrapper *>(self);
+	if (!obj->filelike) {
+		return nullptr;
+	}
+
+	auto data = Py::wrap(PyObject_CallMethod(obj->filelike, "read", "n", obj->block_size));
+	if (!data) {
+		return nullptr;
+	}
+
+	const auto size = PyObject_Length(data);
+	if (size < 0) {
+		return nullptr;
+	}
+	if (size == 0) {
+		// StopIteration
+		return nullptr;
+	}
+	return data.Release();
+}
+
+PyObject *
+FileWrapper::close(PyObject *self, PyObject * /*args*/)
+{
+	auto *obj = reinterpret_cast<FileWrapper *>(self);
+	if (obj->filelike && PyObject_HasAttrString(obj->filelike, "close")) {
+		auto result = Py::wrap(PyObject_CallMethod(obj->filelike, "close", nullptr));
+		if (!result) {
+			return nullptr;
+		}
+	}
+	Py_RETURN_NONE;
+}
+
+void
+FileWrapper::dealloc(PyObject *self)
+{
+	auto *obj = reinterpret_cast<FileWrapper *>(self);
+	Py_XDECREF(obj->filelike);
+	auto *type = Py_TYPE(self);
+	type->tp_free(self);
+	Py_DECREF(type);
+}
+
+Py::Object
+FileWrapper::CreateType()
+{
+	static PyMethodDef methods[]{
+		{ "close", &FileWrapper::close, METH_NOARGS, "Close the wrapped file" },
+		{ nullptr, nullptr, 0, nullptr } // Sentinel
+	};
+
+	static PyType_Slot slots[] = {
+		{ Py_tp_new, reinterpret_cast<void *>(&PyType_GenericNew) },
+		{ Py_tp_init, reinterpret_cast<void *>(&FileWrapper::init) },
+		{ Py_tp_dealloc, reinterpret_cast<void *>(&FileWrapper::dealloc) },
+		{ Py_tp_doc, const_cast<char *>("wsgi.file_wrapper(filelike, blksize=8192)") },
+		{ Py_tp_iter, reinterpret_cast<void *>(&FileWrapper::iter) },
+		{ Py_tp_iternext, reinterpret_cast<void *>(&FileWrapper::next) },
+		{ Py_tp_methods, methods },
+		{ 0, nullptr }, // Sentinel
+	};
+
+	static PyType_Spec spec = {
+		.name = "python_was.FileWrapper",
+		.basicsize = sizeof(FileWrapper),
+		.itemsize = 0,
+		.flags = Py_TPFLAGS_DEFAULT,
+		.slots = slots,
+	};
+
+	auto type = Py::wrap(PyType_FromSpec(&spec));
+	if (!type) {
+		Py::rethrow_python_exception();
+	}
+	return type;
+}
+
+std::optional<FileWrapper::File>
+FileWrapper::GetFile(PyObject *type, PyObject *obj) noexcept
+{
+	if (Py_TYPE(obj) != reinterpret_cast<PyTypeObject *>(type)) {
+		return std::nullopt;
+	}
+
+	auto *wrapper = reinterpret_cast<FileWrapper *>(obj);
+	if (!wrapper->filelike) {
+		return std::nullopt;
+	}
+
+	auto fileno = Py::wrap(PyObject_CallMethod(wrapper->filelike, "fileno", nullptr));
+	const int fd = fileno ? PyLong_AsLong(fileno) : -1;
+	if (fd < 0) {
+		// Not an actual file (e.g. io.BytesIO raises UnsupportedOperation), iterate instead
+		PyErr_Clear();
+		return std::nullopt;
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		return std::nullopt;
+	}
+
+	// Buffered file objects may have read ahead, so tell() is more accurate than the position of the descriptor
+	off_t offset = -1;
+	auto tell = Py::wrap(PyObject_CallMethod(wrapper->filelike, "tell", nullptr));
+	if (tell) {
+		offset = PyLong_AsLongLong(tell);
+	}
+	if (offset < 0) {
+		PyErr_Clear();
+		offset = ::lseek(fd, 0, SEEK_CUR);
+		if (offset < 0) {
+			return std::nullopt;
+		}
+	}
+
+	const auto size = static_cast<uint64_t>(st.st_size);
+	const auto position = std::min(static_cast<uint64_t>(offset), size);
+	return File{ .fd = fd, .offset = position, .length = size - position };
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "python.hxx"
+
+#include <cstdint>
+#include <optional>
+
+// wsgi.file_wrapper: https://peps.python.org/pep-3333/#optional-platform-specific-file-handling
+// If the wrapped object refers to a regular file, the server sends it directly from the file descriptor. Otherwise it
+// is a plain iterable, which reads the file in blocks.
+struct FileWrapper {
+	PyObject ob_base;
+
+	PyObject *filelike;
+	Py_ssize_t block_size;
+
+	struct File {
+		int fd;
+		uint64_t offset;
+		uint64_t length;
+	};
+
+	static int init(PyObject *self, PyObject *args, PyObject *kwargs);
+	static PyObject *iter(PyObject *self);
+	static PyObject *next(PyObject *self);
+	static PyObject *close(PyObject *self, PyObject *args);
+	static void dealloc(PyObject *self);
+
+	static Py::Object CreateType();
+
+	// Returns the file descriptor, the current position and the number of bytes left, if `obj` is an instance of
+	// `type` (as returned by CreateType) that wraps a regular file with a file descriptor.
+	static std::optional<File> GetFile(PyObject *type, PyObject *obj) noexcept;
+};
@@ -0,0 +1,136 @@
+#include "header.hxx"
+#include "python.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "http.hxx"
+
+bool
+is_valid_header_name(std::string_view name) noexcept
+{
+	// https://datatracker.ietf.org/doc/html/rfc2616#section-2.2
+	static constexpr std::array<bool, 256> is_valid = []() {
+		std::array<bool, 256> v = {};
+
+		// "1*<any CHAR except CTLs or separators>", CHAR=(octets 0 - 127)
+		// Control Characters "<any US-ASCII control character (octets 0 - 31) and DEL (127)>"
+		std::fill(v.begin() + 32, v.begin() + 127, true);
+		assert(!v[0] && !v[31] && v[32] && v[126] && !v[127]);
+
+		// Separators
+		constexpr std::array separators = { '(', ')', '<', '>', '@', ',', ';', ':', '\\', '"',
+						    '/', '[', ']', '?', '=', '{', '}', ' ', '\t' };
+		for (const auto c : separators) {
+			v[c] = false;
+		}
+
+		return v;
+	}();
+
+	if (name.empty()) {
+		return false;
+	}
+
+	for (char c : name) {
+		if (!is_valid[static_cast<uint8_t>(c)]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+check_header_name(std::string_view name) noexcept
+{
+	if (!is_valid_header_name(name)) {
+		PyErr_SetString(PyExc_ValueError, fmt::format("Invalid header name '{}'", name).c_str());
+		return false;
+	}
+
+	if (is_hop_by_hop_header(name)) {
+		PyErr_SetString(PyExc_ValueError, fmt::format("Hop-by-hop header '{}' is not allowed", name).c_str());
+		return false;
+	}
+	return true;
+}
+
+bool
+is_valid_header_value(std::string_view value) noexcept
+{
+	// https://www.rfc-editor.org/rfc/rfc7230#section-3.2
+	// Exclude line folding (obs-fold)
+	/*
+	field-content = field-vchar [ 1*( SP / HTAB ) field-vchar ]
+	field-value = *( field-content )
+	field-vchar = VCHAR / obs-text
+	*/
+	static constexpr std::array<bool, 256> is_valid = []() {
+		std::array<bool, 256> v = {};
+
+		std::fill(v.begin() + 0x21, v.begin() + 0x7E + 1, true); // VCHAR (%x21-7E)
+		std::fill(v.begin() + 0x80, v.begin() + 0xFF + 1, true); // obs-text (%x80-FF)
+		v[0x20] = true;						 // SP
+		v[0x09] = true;						 // HTAB
+
+		return v;
+	}();
+
+#ifdef __SSE2__
+	// Values like Content-Security-Policy or Set-Cookie can be long, so check 16 bytes at once. As signed bytes,
+	// obs-text is negative, so the invalid bytes are 0 <= c < 0x20 except HTAB and DEL.
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i minus_one = _mm_set1_epi8(-1);
+	const __m128i htab = _mm_set1_epi8(0x09);
+	const __m128i del = _mm_set1_epi8(0x7F);
+	while (value.size() >= 16) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(value.data()));
+		const __m128i ctl = _mm_and_si128(_mm_cmplt_epi8(v, space), _mm_cmpgt_epi8(v, minus_one));
+		const __m128i invalid =
+		    _mm_or_si128(_mm_andnot_si128(_mm_cmpeq_epi8(v, htab), ctl), _mm_cmpeq_epi8(v, del));
+		if (_mm_movemask_epi8(invalid) != 0) {
+			return false;
+		}
+		value.remove_prefix(16);
+	}
+#endif
+
+	for (char c : value) {
+		if (!is_valid[static_cast<uint8_t>(c)]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+is_hop_by_hop_header(std::string_view name) noexcept
+{
+	// https://www.rfc-editor.org/rfc/rfc2616#section-13.5.1
+	static constexpr std::array<std::string_view, 8> hop_by_hop = {
+		"Connection", "Keep-Alive", "Proxy-Authenticate", "Proxy-Authorization",
+		"TE",	      "Trailer",    "Transfer-Encoding",  "Upgrade",
+	};
+
+	return std::any_of(hop_by_hop.begin(), hop_by_hop.end(), [name](std::string_view h) {
+		return HeaderMatch(h, name);
+	});
+}
+
+bool
+check_header_value(std::string_view value) noexcept
+{
+	if (!is_valid_header_value(value)) {
+		PyErr_SetString(PyExc_ValueError, fmt::format("Invalid header value '{}'", value).c_str());
+		return false;
+	}
+	return true;
+}
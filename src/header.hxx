@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string_view>
+
+// Validation of response headers received from the application
+
+[[gnu::pure]] bool
+is_valid_header_name(std::string_view name) noexcept;
+
+[[gnu::pure]] bool
+is_valid_header_value(std::string_view value) noexcept;
+
+// Case-insensitive, without Content-Length (which the WAS protocol transmits separately)
+[[gnu::pure]] bool
+is_hop_by_hop_header(std::string_view name) noexcept;
+
+// Also rejects hop-by-hop headers.
+// Sets a Python ValueError and returns false, if the name is invalid.
+bool
+check_header_name(std::string_view name) noexcept;
+
+// Sets a Python ValueError and returns false, if the value is invalid.
+bool
+check_header_value(std::string_view value) noexcept;
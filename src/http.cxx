@@ -2,6 +2,13 @@
 
 #include <util/CharUtil.hxx>
 
+#include <array>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+#include <unistd.h>
+
 size_t
 StringInputStream::Read(std::span<char> dest)
 {
@@ -12,6 +19,51 @@ StringInputStream::Read(std::span<char> dest)
 	return to_read;
 }
 
+uint64_t
+InputStream::CopyTo(int fd)
+{
+	std::array<char, 65536> buffer;
+	uint64_t total = 0;
+	while (true) {
+		const auto n = Read(buffer);
+		if (n == 0) {
+			return total;
+		}
+		for (size_t written = 0; written < n;) {
+			const auto w = ::write(fd, buffer.data() + written, n - written);
+			if (w < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw std::system_error(errno, std::system_category(), "Error writing request body");
+			}
+			written += w;
+		}
+		total += n;
+	}
+}
+
+void
+HttpResponder::SendFileImpl(int fd, uint64_t offset, uint64_t length)
+{
+	std::array<char, 65536> buffer;
+	while (length > 0) {
+		const auto n = ::pread(fd, buffer.data(), std::min<uint64_t>(buffer.size(), length), offset);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::system_error(errno, std::system_category(), "Error reading file");
+		}
+		if (n == 0) {
+			throw std::runtime_error("File is shorter than expected");
+		}
+		SendBodyImpl(std::string_view(buffer.data(), n));
+		offset += n;
+		length -= n;
+	}
+}
+
 [[gnu::pure]] Uri
 Uri::split(std::string_view uri) noexcept
 {
@@ -35,6 +87,18 @@ HeaderMatch(std::string_view a, std::string_view b) noexcept
 	return true;
 }
 
+std::string_view
+StripWhitespace(std::string_view s) noexcept
+{
+	while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+		s.remove_prefix(1);
+	}
+	while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+		s.remove_suffix(1);
+	}
+	return s;
+}
+
 std::optional<std::string_view>
 HttpRequest::FindHeader(std::string_view header_name) const noexcept
 {
@@ -45,3 +109,25 @@ HttpRequest::FindHeader(std::string_view header_name) const noexcept
 	}
 	return std::nullopt;
 }
+
+std::optional<std::string_view>
+HttpResponse::FindHeader(std::string_view header_name) const noexcept
+{
+	for (const auto &[name, value] : headers) {
+		if (HeaderMatch(name, header_name)) {
+			return value;
+		}
+	}
+	return std::nullopt;
+}
+
+std::optional<std::string_view>
+HttpRequest::FindParameter(std::string_view parameter_name) const noexcept
+{
+	for (const auto &[name, value] : parameters) {
+		if (name == parameter_name) {
+			return value;
+		}
+	}
+	return std::nullopt;
+}
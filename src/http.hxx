@@ -1,6 +1,9 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <memory>
+#include <memory_resource>
 #include <optional>
 #include <span>
 #include <string>
@@ -23,6 +26,14 @@ public:
 	// Throws on error
 	virtual size_t Read(std::span<char> dest) = 0;
 
+	// Writes the rest of the stream to the file `fd` and returns the number of bytes written
+	// Throws on error
+	virtual uint64_t CopyTo(int fd);
+
+	// May be called from another thread: makes a Read that is blocking right now return 0 soon, and all later
+	// ones right away. By default it does nothing, which is fine for streams that never block.
+	virtual void Cancel() noexcept {}
+
 	std::optional<uint64_t> ContentLength() const { return content_length; }
 };
 
@@ -51,25 +62,58 @@ struct Uri {
 [[gnu::pure]] bool
 HeaderMatch(std::string_view a, std::string_view b) noexcept;
 
+// Removes the optional whitespace (spaces and tabs) around a header value or an element of a list
+[[gnu::pure]] std::string_view
+StripWhitespace(std::string_view s) noexcept;
+
+// Memory for everything that lives exactly as long as one request, so it can be released all at once instead of
+// freeing every string on its own. Reset must only be called when the request is done.
+class RequestArena {
+	std::array<std::byte, 8192> initial_buffer;
+	std::pmr::monotonic_buffer_resource resource{ initial_buffer.data(), initial_buffer.size() };
+
+public:
+	RequestArena() = default;
+	RequestArena(const RequestArena &) = delete;
+	RequestArena &operator=(const RequestArena &) = delete;
+
+	std::pmr::memory_resource *Get() noexcept { return &resource; }
+	void Reset() noexcept { resource.release(); }
+};
+
+// The strings point into memory owned by the server (usually the was_simple object), they are valid until Process
+// returns.
 struct HttpRequest {
-	std::string remote_addr;
-	std::string script_name;
-	std::string server_name;
-	std::string server_port;
-	std::string protocol; // e.g. HTTP/1.1
-	std::string scheme;
+	using Header = std::pair<std::string_view, std::string_view>;
+
+	std::string_view remote_addr;
+	std::string_view script_name;
+	std::string_view server_name;
+	std::string_view server_port;
+	std::string_view protocol; // e.g. HTTP/1.1
+	std::string_view scheme;
 	http_method_t method;
 	Uri uri;
-	std::vector<std::pair<std::string, std::string>> headers;
+	std::pmr::vector<Header> headers;
+	// WAS request parameters, configured in the translation server
+	std::pmr::vector<Header> parameters;
 	std::unique_ptr<InputStream> body;
+	// For allocations that are needed until the response is complete, e.g. the response headers
+	std::pmr::memory_resource *arena = std::pmr::get_default_resource();
 
 	std::optional<std::string_view> FindHeader(std::string_view header_name) const noexcept;
+	// Parameter names are case-sensitive
+	std::optional<std::string_view> FindParameter(std::string_view name) const noexcept;
 };
 
 struct HttpResponse {
+	using Header = std::pair<std::pmr::string, std::pmr::string>;
+
 	http_status_t status = static_cast<http_status_t>(0);
-	std::vector<std::pair<std::string, std::string>> headers;
+	std::pmr::vector<Header> headers;
 	std::optional<uint64_t> content_length;
+
+	std::optional<std::string_view> FindHeader(std::string_view header_name) const noexcept;
 };
 
 class HttpResponder {
@@ -79,6 +123,18 @@ protected:
 	virtual void SendHeadersImpl(HttpResponse &&response) = 0;
 	virtual void SendBodyImpl(std::string_view body_data) = 0;
 
+	// Sends multiple chunks at once, ideally with a single system call. By default they are sent one by one.
+	virtual void SendBodyChunksImpl(std::span<const std::string_view> chunks)
+	{
+		for (const auto chunk : chunks) {
+			SendBodyImpl(chunk);
+		}
+	}
+
+	// Sends `length` bytes of the file `fd` starting at `offset`, without changing the file position.
+	// By default the file is read into a buffer and sent with SendBodyImpl.
+	virtual void SendFileImpl(int fd, uint64_t offset, uint64_t length);
+
 public:
 	void SendHeaders(HttpResponse &&response)
 	{
@@ -93,9 +149,28 @@ public:
 		SendBodyImpl(body_data);
 	}
 
+	void SendBodyChunks(std::span<const std::string_view> chunks)
+	{
+		assert(headers_sent);
+		SendBodyChunksImpl(chunks);
+	}
+
+	// Does not touch any Python objects, so it can be called without the GIL
+	void SendFile(int fd, uint64_t offset, uint64_t length)
+	{
+		assert(headers_sent);
+		SendFileImpl(fd, offset, length);
+	}
+
 	bool HeadersSent() const { return headers_sent; }
 };
 
 struct RequestHandler {
+	virtual ~RequestHandler() = default;
+
 	virtual void Process(HttpRequest &&request, HttpResponder &responder) = 0;
+
+	// Called between requests, after the previous response has been ended and before the next request has been
+	// received, so work for the next request can be done while the client has its turn
+	virtual void Prepare() noexcept {}
 };
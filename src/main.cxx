@@ -1,11 +1,32 @@
+#include <chrono>
+#include <future>
+#include <memory>
 #include <optional>
 #include <span>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#include "asgi.hxx"
+#include "bench.hxx"
+#include "cache.hxx"
+#include "coalesce.hxx"
+#include "compress.hxx"
 #include "http.hxx"
+#include "memory.hxx"
+#include "metrics.hxx"
+#include "module.hxx"
+#include "multi.hxx"
+#include "offload.hxx"
+#include "pool.hxx"
+#include "prefork.hxx"
 #include "python.hxx"
+#include "reload.hxx"
+#include "spool.hxx"
+#include "static_files.hxx"
 #include "was.hxx"
+#include "was_async.hxx"
+#include "watchdog.hxx"
 #include "wsgi.hxx"
 
 #include <fmt/format.h>
@@ -19,8 +40,44 @@ struct CommandLine {
 	std::optional<std::string_view> app;
 	std::optional<std::string_view> host;
 	std::optional<uint16_t> port;
+	unsigned workers = 0;
+	unsigned threads = 0;
+	bool gc_freeze = false;
+	bool async_was = false;
+	OffloadConfig offload;
+	CoalesceConfig coalesce;
+	CacheConfig cache;
+	SpoolConfig spool;
+	StaticConfig static_files;
+	bool compress = false;
+	CompressConfig compress_config;
+	BenchConfig bench;
+	std::optional<std::string_view> metrics_path;
+	bool log_timing = false;
+	WatchdogConfig watchdog;
+	MemoryConfig memory;
+	bool reload = false;
+	Py::PythonConfig python;
+	unsigned pool = 0;
 
-	void usage() { fmt::print("python-was [--host <ip>] [--port <port>] [--module <module>] [--app <app>]\n"); }
+	void usage()
+	{
+		fmt::print("python-was [--host <ip>] [--port <port>] [--module <module>] [--app <app>] "
+			   "[--workers <n>] [--threads <n>] [--gc-freeze] [--async-was] [--reload] [--pool <n>] "
+			   "[--isolated] [--no-site] [--trust-pyc] [--import-profile] "
+			   "[--sendfile-header <header>] [--sendfile-root <dir>] [--metrics-path <path>] "
+			   "[--log-timing] "
+			   "[--slow-request <ms>] [--profile <file> [--profile-hz <n>]] "
+			   "[--gc-between-requests] [--malloc-trim <seconds>] [--max-requests <n>] [--max-rss <bytes>] "
+			   "[--coalesce <bytes> [--coalesce-delay <ms>]] "
+			   "[--compress [--compress-level <n>] [--compress-min-size <bytes>] "
+			   "[--compress-type <prefix>] [--compress-thread]] "
+			   "[--cache <bytes> [--cache-max-entry <bytes>]] "
+			   "[--spool-threshold <bytes> [--spool-dir <dir> | --spool-memfd]] "
+			   "[--static <prefix>=<dir> [--static-open-files <n>]] "
+			   "[--bench <requests> [--bench-warmup <requests>] "
+			   "[--bench-request '<METHOD> <URI> [body=<bytes>] [headers=<count>] [response=<bytes>]']]\n");
+	}
 
 	std::string_view get_arg(std::span<const std::string_view> args, size_t &i)
 	{
@@ -36,6 +93,7 @@ struct CommandLine {
 	CommandLine(int argc, char **argv)
 	{
 		std::vector<std::string_view> args(argv + 1, argv + argc);
+		bool compress_types_given = false;
 		for (size_t i = 0; i < args.size(); ++i) {
 			if (args[i] == "--module") {
 				module = get_arg(args, i);
@@ -49,6 +107,159 @@ struct CommandLine {
 					throw std::runtime_error("Could not parse port");
 				}
 				port = *p;
+			} else if (args[i] == "--workers") {
+				const auto n = ParseInteger<unsigned>(get_arg(args, i));
+				if (!n) {
+					throw std::runtime_error("Could not parse number of workers");
+				}
+				workers = *n;
+			} else if (args[i] == "--threads") {
+				const auto n = ParseInteger<unsigned>(get_arg(args, i));
+				if (!n) {
+					throw std::runtime_error("Could not parse number of threads");
+				}
+				threads = *n;
+			} else if (args[i] == "--gc-freeze") {
+				gc_freeze = true;
+			} else if (args[i] == "--async-was") {
+				async_was = true;
+			} else if (args[i] == "--reload") {
+				reload = true;
+			} else if (args[i] == "--isolated") {
+				python.isolated = true;
+			} else if (args[i] == "--no-site") {
+				python.site = false;
+			} else if (args[i] == "--trust-pyc") {
+				python.trust_pyc = true;
+			} else if (args[i] == "--import-profile") {
+				python.import_time = true;
+			} else if (args[i] == "--pool") {
+				const auto n = ParseInteger<unsigned>(get_arg(args, i));
+				if (!n || *n == 0) {
+					throw std::runtime_error("Could not parse number of pooled interpreters");
+				}
+				pool = *n;
+			} else if (args[i] == "--sendfile-header") {
+				offload.header = get_arg(args, i);
+			} else if (args[i] == "--sendfile-root") {
+				offload.AddRoot(std::string(get_arg(args, i)));
+			} else if (args[i] == "--coalesce") {
+				const auto n = ParseInteger<size_t>(get_arg(args, i));
+				if (!n) {
+					throw std::runtime_error("Could not parse coalesce buffer size");
+				}
+				coalesce.max_size = *n;
+			} else if (args[i] == "--coalesce-delay") {
+				const auto n = ParseInteger<unsigned>(get_arg(args, i));
+				if (!n) {
+					throw std::runtime_error("Could not parse coalesce delay");
+				}
+				coalesce.max_delay = std::chrono::milliseconds(*n);
+			} else if (args[i] == "--compress") {
+				compress = true;
+			} else if (args[i] == "--compress-level") {
+				const auto n = ParseInteger<int>(get_arg(args, i));
+				if (!n) {
+					throw std::runtime_error("Could not parse compression level");
+				}
+				compress_config.level = *n;
+			} else if (args[i] == "--compress-min-size") {
+				const auto n = ParseInteger<uint64_t>(get_arg(args, i));
+				if (!n) {
+					throw std::runtime_error("Could not parse minimum compression size");
+				}
+				compress_config.min_size = *n;
+			} else if (args[i] == "--compress-type") {
+				// The first one replaces the default list
+				if (!compress_types_given) {
+					compress_config.content_types.clear();
+					compress_types_given = true;
+				}
+				compress_config.content_types.emplace_back(get_arg(args, i));
+			} else if (args[i] == "--compress-thread") {
+				compress_config.thread = true;
+			} else if (args[i] == "--cache") {
+				const auto n = ParseInteger<size_t>(get_arg(args, i));
+				if (!n) {
+					throw std::runtime_error("Could not parse cache size");
+				}
+				cache.max_size = *n;
+			} else if (args[i] == "--cache-max-entry") {
+				const auto n = ParseInteger<size_t>(get_arg(args, i));
+				if (!n) {
+					throw std::runtime_error("Could not parse maximum cache entry size");
+				}
+				cache.max_entry_size = *n;
+			} else if (args[i] == "--spool-threshold") {
+				const auto n = ParseInteger<uint64_t>(get_arg(args, i));
+				if (!n) {
+					throw std::runtime_error("Could not parse spool threshold");
+				}
+				spool.threshold = *n;
+			} else if (args[i] == "--spool-dir") {
+				spool.directory = get_arg(args, i);
+			} else if (args[i] == "--spool-memfd") {
+				spool.directory.clear();
+			} else if (args[i] == "--static") {
+				static_files.AddMount(get_arg(args, i));
+			} else if (args[i] == "--static-open-files") {
+				const auto n = ParseInteger<size_t>(get_arg(args, i));
+				if (!n) {
+					throw std::runtime_error("Could not parse number of open static files");
+				}
+				static_files.max_open_files = *n;
+			} else if (args[i] == "--metrics-path") {
+				metrics_path = get_arg(args, i);
+			} else if (args[i] == "--log-timing") {
+				log_timing = true;
+			} else if (args[i] == "--slow-request") {
+				const auto n = ParseInteger<unsigned>(get_arg(args, i));
+				if (!n || *n == 0) {
+					throw std::runtime_error("Could not parse slow request threshold");
+				}
+				watchdog.slow_threshold = std::chrono::milliseconds(*n);
+			} else if (args[i] == "--profile") {
+				watchdog.profile_path = get_arg(args, i);
+			} else if (args[i] == "--profile-hz") {
+				const auto n = ParseInteger<unsigned>(get_arg(args, i));
+				if (!n || *n == 0 || *n > 1000) {
+					throw std::runtime_error("Could not parse profile frequency");
+				}
+				watchdog.profile_hz = *n;
+			} else if (args[i] == "--gc-between-requests") {
+				memory.gc_between_requests = true;
+			} else if (args[i] == "--malloc-trim") {
+				const auto n = ParseInteger<unsigned>(get_arg(args, i));
+				if (!n || *n == 0) {
+					throw std::runtime_error("Could not parse malloc_trim interval");
+				}
+				memory.trim_interval = std::chrono::seconds(*n);
+			} else if (args[i] == "--max-requests") {
+				const auto n = ParseInteger<uint64_t>(get_arg(args, i));
+				if (!n || *n == 0) {
+					throw std::runtime_error("Could not parse maximum number of requests");
+				}
+				memory.max_requests = *n;
+			} else if (args[i] == "--max-rss") {
+				const auto n = ParseInteger<uint64_t>(get_arg(args, i));
+				if (!n || *n == 0) {
+					throw std::runtime_error("Could not parse maximum resident set size");
+				}
+				memory.max_rss = *n;
+			} else if (args[i] == "--bench") {
+				const auto n = ParseInteger<unsigned>(get_arg(args, i));
+				if (!n || *n == 0) {
+					throw std::runtime_error("Could not parse number of benchmark requests");
+				}
+				bench.requests = *n;
+			} else if (args[i] == "--bench-warmup") {
+				const auto n = ParseInteger<unsigned>(get_arg(args, i));
+				if (!n) {
+					throw std::runtime_error("Could not parse number of warmup requests");
+				}
+				bench.warmup = *n;
+			} else if (args[i] == "--bench-request") {
+				bench.mix.push_back(BenchRequest::Parse(get_arg(args, i)));
 			} else if (args[i] == "--sys-path") {
 				sys_path.push_back(get_arg(args, i));
 			} else {
@@ -57,6 +268,19 @@ struct CommandLine {
 				throw std::runtime_error("Could not parse command line arguments");
 			}
 		}
+
+		if (!offload.header.empty() && offload.roots.empty()) {
+			throw std::runtime_error("--sendfile-header requires at least one --sendfile-root");
+		}
+		if (pool > 0 && (reload || threads > 0)) {
+			throw std::runtime_error("--pool cannot be combined with --reload or --threads");
+		}
+		if (Py::free_threaded && !watchdog.profile_path.empty()) {
+			throw std::runtime_error("--profile is not supported with free-threaded Python");
+		}
+		if (reload && get_application_roots(sys_path).empty()) {
+			throw std::runtime_error("--reload requires a --sys-path with the application");
+		}
 	}
 };
 
@@ -76,6 +300,9 @@ request(RequestHandler &handler,
 	std::string_view content_type,
 	std::string request_body)
 {
+	// Must outlive the request, like all the strings it refers to
+	std::string content_length;
+
 	HttpRequest request{
 		.script_name = "",
 		.protocol = "HTTP/1.1",
@@ -87,10 +314,10 @@ request(RequestHandler &handler,
 	};
 
 	if (!request_body.empty()) {
-		const auto content_length = request_body.size();
+		content_length = std::to_string(request_body.size());
 		request.body = std::make_unique<StringInputStream>(std::move(request_body));
 		request.headers.emplace_back("Content-Type", content_type);
-		request.headers.emplace_back("Content-Length", std::to_string(content_length));
+		request.headers.emplace_back("Content-Length", content_length);
 	}
 
 	struct PrintResponder : public HttpResponder {
@@ -103,38 +330,422 @@ request(RequestHandler &handler,
 	fmt::print("\n");
 }
 
+// Imports the application, after the sys.path has been set up by load_app
+Py::Object
+find_app(const CommandLine &args)
+{
+	const auto module_name = args.module ? std::optional<std::string>(*args.module) : std::nullopt;
+	const auto app_name = args.app ? std::optional<std::string>(*args.app) : std::nullopt;
+	return WsgiRequestHandler::FindApp(module_name, app_name);
+}
+
+// Must be called once in every interpreter
+Py::Object
+load_app(const CommandLine &args)
+{
+	// If you are in a virtual environment, <venv>/bin should be in PATH.
+	// Python will try to find python3 in PATH and if it finds ../pyvenv.cfg next to python3, it will add
+	// the corresponding site-packages of the venv to the sys.path.
+	// So simply activating a venv should make it available for python-was.
+	// If it does not, just pass `--sys-path <venv>/lib/pythonX.YY/site-packages`
+
+	for (const auto path : args.sys_path) {
+		Py::add_sys_path(path);
+	}
+
+	// With a pool the applications are usually selected by the request parameters only
+	if (args.pool > 0 && !args.module) {
+		return {};
+	}
+	return find_app(args);
+}
+
+// Reloads the application in a pre-fork master, so replacement workers do not start with outdated code. `pending`
+// stays set until a reload has succeeded, so a failed one is tried again next time.
+void
+reload_master(SourceWatcher &watcher, bool &pending, Py::Object &app, const CommandLine &args) noexcept
+{
+	try {
+		pending = watcher.CheckChanged() || pending;
+		if (!pending) {
+			return;
+		}
+		Py::Object new_app;
+		reload_application(watcher.Roots(), [&]() { new_app = find_app(args); });
+		app = std::move(new_app);
+		pending = false;
+		if (args.gc_freeze) {
+			Py::gc_freeze();
+		}
+		fmt::print(stderr, "Reloaded the application in the master process\n");
+	} catch (const std::exception &exc) {
+		fmt::print(stderr, "Could not reload the application, keeping the old one: {}\n", exc.what());
+	}
+}
+
+// Wraps the handler in the handlers for the features enabled on the command line
+std::unique_ptr<RequestHandler>
+wrap_handler(std::unique_ptr<RequestHandler> handler, const CommandLine &args)
+{
+	if (args.spool.threshold > 0) {
+		handler = std::make_unique<SpoolingRequestHandler>(std::move(handler), args.spool);
+	}
+	if (args.coalesce.max_size > 0) {
+		handler = std::make_unique<CoalescingRequestHandler>(std::move(handler), args.coalesce);
+	}
+	if (!args.offload.header.empty()) {
+		handler = std::make_unique<OffloadRequestHandler>(std::move(handler), args.offload);
+	}
+	if (args.compress) {
+		handler = std::make_unique<CompressingRequestHandler>(std::move(handler), args.compress_config);
+	}
+	// Outside of compression, so hits don't have to be compressed again
+	if (args.cache.max_size > 0) {
+		handler = std::make_unique<CachingRequestHandler>(std::move(handler), args.cache);
+	}
+	if (!args.static_files.mounts.empty()) {
+		handler = std::make_unique<StaticFileRequestHandler>(std::move(handler), args.static_files);
+	}
+	if (args.metrics_path) {
+		handler = std::make_unique<MetricsRequestHandler>(std::move(handler), std::string(*args.metrics_path));
+	}
+	if (args.memory.Enabled()) {
+		handler = std::make_unique<MemoryRequestHandler>(std::move(handler), args.memory);
+	}
+	return handler;
+}
+
+// Imports the application selected by the request parameters into a pooled interpreter
+std::unique_ptr<RequestHandler>
+create_pooled_handler(const AppSelector &selector, const CommandLine &args)
+{
+	// The --sys-path options are for shared dependencies, e.g. a common venv
+	for (const auto path : args.sys_path) {
+		Py::add_sys_path(path);
+	}
+	for (const auto &path : selector.sys_path) {
+		Py::add_sys_path(path);
+	}
+
+	auto app_name = selector.app.empty() ? std::nullopt : std::optional<std::string>(selector.app);
+	auto app = WsgiRequestHandler::FindApp(selector.module, std::move(app_name));
+	// AsgiRequestHandler's event loop thread uses the PyGILState API, which only supports the main interpreter
+	if (AsgiRequestHandler::IsAsgiApp(app)) {
+		throw std::runtime_error("ASGI applications are not supported in the interpreter pool");
+	}
+	std::unique_ptr<RequestHandler> handler = std::make_unique<WsgiRequestHandler>(std::move(app));
+	// Every interpreter has its own garbage collector, the one of the main interpreter is handled in wrap_handler
+	if (args.memory.gc_between_requests) {
+		handler = std::make_unique<MemoryRequestHandler>(std::move(handler),
+								 MemoryConfig{ .gc_between_requests = true });
+	}
+	Module::RunWarmupHooks();
+	return handler;
+}
+
+// The handler for the application including the handlers for the features, but without reloading
+std::unique_ptr<RequestHandler>
+create_app_handler(Py::Object app, bool asgi, const CommandLine &args)
+{
+	std::unique_ptr<RequestHandler> handler;
+	if (app && asgi) {
+		handler = std::make_unique<AsgiRequestHandler>(std::move(app));
+	} else if (app) {
+		handler = std::make_unique<WsgiRequestHandler>(std::move(app));
+	}
+
+	if (args.pool > 0) {
+		// The application from the command line is used for requests without parameters
+		auto factory = [&args](const AppSelector &selector) { return create_pooled_handler(selector, args); };
+		handler = std::make_unique<InterpreterPoolRequestHandler>(args.pool, std::move(factory),
+									  std::move(handler));
+	}
+	handler = wrap_handler(std::move(handler), args);
+	Module::RunWarmupHooks();
+	return handler;
+}
+
+std::unique_ptr<RequestHandler>
+create_handler(Py::Object app, bool asgi, const CommandLine &args)
+{
+	auto handler = create_app_handler(std::move(app), asgi, args);
+	if (!args.reload) {
+		return handler;
+	}
+
+	// All handlers are replaced, so the response cache does not return responses of the old code
+	auto factory = [&args]() {
+		auto new_app = find_app(args);
+		const bool new_asgi = AsgiRequestHandler::IsAsgiApp(new_app);
+		return create_app_handler(std::move(new_app), new_asgi, args);
+	};
+	return std::make_unique<ReloadingRequestHandler>(std::move(handler), get_application_roots(args.sys_path),
+							 std::move(factory));
+}
+
+// Runs `args.threads` threads, each with its own sub-interpreter (and GIL), that all receive connections from `multi`.
+// The application is not imported into the main interpreter. The first thread tells whether it is an ASGI application,
+// which has to run in the main interpreter; then no thread is started and false is returned. Errors importing the
+// application in the first thread are thrown.
+bool
+run_threads(MultiWas &multi, const CommandLine &args)
+{
+	std::vector<std::thread> threads;
+
+	// The main interpreter's GIL has to be released for the threads to create their sub-interpreters
+	const Py::ReleaseGil release;
+
+	std::promise<bool> first_asgi;
+	threads.emplace_back([&multi, &args, &first_asgi]() {
+		bool imported = false;
+		try {
+			Py::SubInterpreter interpreter;
+			auto app = load_app(args);
+			const bool asgi = app && AsgiRequestHandler::IsAsgiApp(app);
+			imported = true;
+			first_asgi.set_value(asgi);
+			if (asgi) {
+				return;
+			}
+			const auto handler = create_handler(std::move(app), false, args);
+			multi.Run(*handler, args.async_was);
+		} catch (const std::exception &exc) {
+			if (!imported) {
+				first_asgi.set_exception(std::current_exception());
+				return;
+			}
+			fmt::print(stderr, "Error in worker thread: {}\n", exc.what());
+		}
+	});
+
+	try {
+		if (first_asgi.get_future().get()) {
+			threads.front().join();
+			return false;
+		}
+	} catch (...) {
+		threads.front().join();
+		throw;
+	}
+
+	for (unsigned i = 1; i < args.threads; ++i) {
+		threads.emplace_back([&multi, &args]() {
+			try {
+				Py::SubInterpreter interpreter;
+				const auto handler = create_handler(load_app(args), false, args);
+				multi.Run(*handler, args.async_was);
+			} catch (const std::exception &exc) {
+				fmt::print(stderr, "Error in worker thread: {}\n", exc.what());
+			}
+		});
+	}
+
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	return true;
+}
+
+// Runs `args.threads` threads in the main interpreter of a free-threaded Python, which all receive connections from
+// `multi`. Each has its own handler (and WAS connection with its own arena), but they share the application.
+void
+run_free_threads(MultiWas &multi, const CommandLine &args, const Py::Object &app)
+{
+	// Once for the interpreter, like in the other modes
+	Module::RunWarmupHooks();
+
+	std::vector<std::thread> threads;
+
+	// Detached from the interpreter while it waits, so it doesn't hold up the garbage collector of the others
+	const Py::ReleaseGil release;
+
+	for (unsigned i = 0; i < args.threads; ++i) {
+		threads.emplace_back([&multi, &args, &app]() {
+			try {
+				const Py::EnsureGil gil;
+				const auto handler = wrap_handler(
+				    std::make_unique<WsgiRequestHandler>(Py::wrap(Py_NewRef(app)), true), args);
+				multi.Run(*handler, args.async_was);
+			} catch (const std::exception &exc) {
+				fmt::print(stderr, "Error in worker thread: {}\n", exc.what());
+			}
+		});
+	}
+
+	for (auto &thread : threads) {
+		thread.join();
+	}
+}
+
+// Runs `args.threads` threads in the main interpreter, which all pass the requests of the connections they receive
+// from `multi` to the same handler. Only useful for handlers that can process requests concurrently (ASGI).
+void
+run_connection_threads(MultiWas &multi, const CommandLine &args, RequestHandler &handler)
+{
+	std::vector<std::thread> threads;
+
+	const Py::ReleaseGil release;
+
+	for (unsigned i = 0; i < args.threads; ++i) {
+		threads.emplace_back([&multi, &args, &handler]() {
+			try {
+				multi.Run(handler, args.async_was);
+			} catch (const std::exception &exc) {
+				fmt::print(stderr, "Error in connection thread: {}\n", exc.what());
+			}
+		});
+	}
+
+	for (auto &thread : threads) {
+		thread.join();
+	}
+}
+
 int
 main(int argc, char **argv)
 {
 	try {
 		CommandLine args(argc, argv);
-		Py::Python python;
+		const auto start = std::chrono::steady_clock::now();
+		Py::Python python(args.python);
+		const auto initialized = std::chrono::steady_clock::now();
+
+		// Before forking, so the workers share the metrics
+		if (args.metrics_path || args.log_timing) {
+			Metrics::Enable(args.log_timing);
+		}
+		Watchdog::Enable(args.watchdog);
+		if (args.memory.Recycles()) {
+			Recycle::Enable();
+		}
 
-		// If you are in a virtual environment, <venv>/bin should be in PATH.
-		// Python will try to find python3 in PATH and if it finds ../pyvenv.cfg next to python3, it will add
-		// the corresponding site-packages of the venv to the sys.path.
-		// So simply activating a venv should make it available for python-was.
-		// If it does not, just pass `--sys-path <venv>/lib/pythonX.YY/site-packages`
+		// With sub-interpreters, every thread imports its own copy of the application, so the main interpreter
+		// only needs one if run_threads finds out that it is an ASGI application
+		const bool sub_interpreter_threads = args.threads > 0 && !Py::free_threaded &&
+						     Py::SubInterpreter::supported && args.bench.requests == 0 &&
+						     !::isatty(0) && MultiWas::IsMultiWasSocket(0);
 
-		for (const auto path : args.sys_path) {
-			Py::add_sys_path(path);
+		Py::Object app;
+		if (!sub_interpreter_threads) {
+			app = load_app(args);
 		}
+		bool asgi = app && AsgiRequestHandler::IsAsgiApp(app);
 
-		const auto module_name = args.module ? std::optional<std::string>(*args.module) : std::nullopt;
-		const auto app_name = args.app ? std::optional<std::string>(*args.app) : std::nullopt;
-		auto app = WsgiRequestHandler::FindApp(module_name, app_name);
+		if (args.python.import_time) {
+			using std::chrono::duration;
+			const auto imported = std::chrono::steady_clock::now();
+			if (sub_interpreter_threads) {
+				fmt::print(stderr, "Initialized Python in {:.1f} ms\n",
+					   duration<double, std::milli>(initialized - start).count());
+			} else {
+				fmt::print(stderr,
+					   "Initialized Python in {:.1f} ms, imported the application in {:.1f} ms\n",
+					   duration<double, std::milli>(initialized - start).count(),
+					   duration<double, std::milli>(imported - initialized).count());
+			}
+		}
 
-		WsgiRequestHandler wsgi(std::move(app));
+		// ASGI applications run concurrently on the threads of the main interpreter
+		if (args.threads > 0 && !asgi && !Py::SubInterpreter::supported) {
+			throw std::runtime_error("--threads requires Python 3.12 or later");
+		}
+		if (args.pool > 0 && !Py::SubInterpreter::supported) {
+			throw std::runtime_error("--pool requires Python 3.12 or later");
+		}
+
+		if (args.bench.requests > 0) {
+			auto handler = create_app_handler(Py::wrap(Py_XNewRef(app)), asgi, args);
+			const bool ok =
+			    run_benchmark(*handler, args.bench, asgi ? nullptr : static_cast<PyObject *>(app));
+			return ok ? 0 : 1;
+		}
 
 		if (::isatty(0)) {
-			request(wsgi, HTTP_METHOD_GET, "/", "", "");
-			request(wsgi, HTTP_METHOD_PUT, "/", "application/json", R"({"key": "value"})");
+			auto handler = create_handler(std::move(app), asgi, args);
+			request(*handler, HTTP_METHOD_GET, "/", "", "");
+			request(*handler, HTTP_METHOD_PUT, "/", "application/json", R"({"key": "value"})");
 			return 0;
 		}
 
+		if (MultiWas::IsMultiWasSocket(0)) {
+			MultiWas multi(0);
+			if (args.workers > 0) {
+				fmt::print(stderr, "Starting in Multi-WAS mode with {} workers\n", args.workers);
+				if (args.gc_freeze) {
+					Py::gc_freeze();
+				}
+				// Watches from the start, so changes made while the workers run are not missed
+				std::optional<SourceWatcher> watcher;
+				bool reload_pending = false;
+				// Without an application in the master, every worker imports the current code anyway
+				if (args.reload && !sub_interpreter_threads) {
+					watcher.emplace(get_application_roots(args.sys_path));
+				}
+				Prefork prefork(args.workers, [&]() {
+					if (watcher) {
+						reload_master(*watcher, reload_pending, app, args);
+						asgi = AsgiRequestHandler::IsAsgiApp(app);
+					}
+				});
+				if (!prefork.Run()) {
+					return 0;
+				}
+				Module::RunPostForkHooks();
+				// Every worker watches on its own
+				watcher.reset();
+			} else {
+				fmt::print(stderr, "Starting in Multi-WAS mode\n");
+			}
+
+			// The master replaces a recycled worker
+			const auto exit_status = [&args]() {
+				return args.workers > 0 && Recycle::Requested() ? Prefork::exit_status_recycle : 0;
+			};
+
+			if (sub_interpreter_threads) {
+				if (run_threads(multi, args)) {
+					return exit_status();
+				}
+				// An ASGI application, which runs on the connection threads of the main interpreter
+				app = load_app(args);
+				asgi = true;
+			}
+
+			// The handler is created after forking, because AsgiRequestHandler starts a thread
+			if (args.threads > 0 && asgi) {
+				if (args.reload) {
+					fmt::print(stderr, "Ignoring --reload, because all connection threads share "
+							   "the application\n");
+				}
+				auto handler = create_app_handler(std::move(app), asgi, args);
+				run_connection_threads(multi, args, *handler);
+			} else if (args.threads > 0 && Py::free_threaded) {
+				if (args.reload) {
+					fmt::print(stderr,
+						   "Ignoring --reload, because all threads share the application\n");
+				}
+				run_free_threads(multi, args, app);
+			} else {
+				auto handler = create_handler(std::move(app), asgi, args);
+				multi.Run(*handler, args.async_was);
+			}
+			return exit_status();
+		}
+
+		if (args.workers > 0 || args.threads > 0) {
+			fmt::print(stderr,
+				   "Ignoring --workers and --threads, because there is only a single WAS connection\n");
+		}
+
 		fmt::print(stderr, "Starting in WAS mode\n");
-		Was was;
-		was.Run(wsgi);
+		auto handler = create_handler(std::move(app), asgi, args);
+		if (args.async_was) {
+			AsyncWas was;
+			was.Run(*handler);
+		} else {
+			Was was;
+			was.Run(*handler);
+		}
 
 		return 0;
 	} catch (const Py::Error &exc) {
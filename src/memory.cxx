@@ -0,0 +1,179 @@
+#include "memory.hxx"
+
+#include <fmt/format.h>
+
+#include <array>
+#include <cstdio>
+#include <optional>
+
+#include <malloc.h>
+#include <unistd.h>
+
+bool Recycle::enabled = false;
+std::atomic<bool> Recycle::requested = false;
+std::atomic<uint64_t> MemoryRequestHandler::requests = 0;
+
+namespace {
+// /proc/self/statm is read at most this often
+constexpr std::chrono::seconds rss_check_interval{ 1 };
+
+std::optional<uint64_t>
+get_rss() noexcept
+{
+	FILE *file = std::fopen("/proc/self/statm", "r");
+	if (!file) {
+		return std::nullopt;
+	}
+	unsigned long long size = 0, resident = 0;
+	const bool ok = std::fscanf(file, "%llu %llu", &size, &resident) == 2;
+	std::fclose(file);
+	if (!ok) {
+		return std::nullopt;
+	}
+	return static_cast<uint64_t>(resident) * static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+}
+
+// The GIL is not held between requests by the connection threads of ASGI applications
+class GilForPrepare {
+	std::optional<Py::EnsureGil> gil;
+
+public:
+	GilForPrepare()
+	{
+		if (!Py::current_thread_state()) {
+			gil.emplace();
+		}
+	}
+};
+
+// Returns true if `interval` has passed since `last` and sets it to now, only for one of several concurrent callers
+bool
+interval_passed(std::atomic<std::chrono::steady_clock::rep> &last,
+		std::chrono::steady_clock::duration interval) noexcept
+{
+	const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+	auto previous = last.load(std::memory_order_relaxed);
+	return now - previous >= interval.count() &&
+	       last.compare_exchange_strong(previous, now, std::memory_order_relaxed);
+}
+
+// Returns the element `i` of a tuple of ints returned by gc.get_count() or gc.get_threshold()
+long
+get_item(PyObject *tuple, Py_ssize_t i) noexcept
+{
+	PyObject *item = PyTuple_Check(tuple) && PyTuple_Size(tuple) > i ? PyTuple_GetItem(tuple, i) : nullptr;
+	return item ? PyLong_AsLong(item) : 0;
+}
+}
+
+void
+Recycle::Request(std::string_view reason) noexcept
+{
+	if (!requested.exchange(true)) {
+		fmt::print(stderr, "Recycling process {}: {}\n", ::getpid(), reason);
+	}
+}
+
+MemoryRequestHandler::MemoryRequestHandler(std::unique_ptr<RequestHandler> next, MemoryConfig _config)
+  : next(std::move(next))
+  , config(_config)
+  , last_trim(Clock::now().time_since_epoch().count())
+  , last_rss_check(Clock::now().time_since_epoch().count())
+{
+	if (!config.gc_between_requests) {
+		return;
+	}
+
+	auto gc = Py::import("gc");
+	if (!gc) {
+		Py::rethrow_python_exception();
+	}
+	gc_collect = Py::wrap(PyObject_GetAttrString(gc, "collect"));
+	gc_get_count = Py::wrap(PyObject_GetAttrString(gc, "get_count"));
+	gc_get_threshold = Py::wrap(PyObject_GetAttrString(gc, "get_threshold"));
+	if (!gc_collect || !gc_get_count || !gc_get_threshold) {
+		Py::rethrow_python_exception();
+	}
+	// The counts keep going up while it's disabled, which is how CollectGarbage knows when a collection is due
+	PyGC_Disable();
+}
+
+// Does what the automatic garbage collection would have done during the last requests: Collects the oldest generation
+// whose count has reached its threshold, if all younger ones have reached theirs, too.
+void
+MemoryRequestHandler::CollectGarbage()
+{
+	auto count = Py::wrap(PyObject_CallNoArgs(gc_get_count));
+	auto threshold = Py::wrap(PyObject_CallNoArgs(gc_get_threshold));
+	if (!count || !threshold) {
+		Py::rethrow_python_exception();
+	}
+
+	int generation = -1;
+	for (Py_ssize_t i = 0; i < 3; ++i) {
+		const auto t = get_item(threshold, i);
+		if (t <= 0 || get_item(count, i) < t) {
+			break;
+		}
+		generation = static_cast<int>(i);
+	}
+	if (PyErr_Occurred()) {
+		Py::rethrow_python_exception();
+	}
+	if (generation < 0) {
+		return;
+	}
+
+	auto result = Py::wrap(PyObject_CallFunction(gc_collect, "i", generation));
+	if (!result) {
+		Py::rethrow_python_exception();
+	}
+}
+
+void
+MemoryRequestHandler::CheckLimits() noexcept
+{
+	if (config.max_requests > 0 && requests.load(std::memory_order_relaxed) >= config.max_requests) {
+		Recycle::Request(fmt::format("it has processed {} requests", config.max_requests));
+		return;
+	}
+
+	if (config.max_rss > 0 && interval_passed(last_rss_check, rss_check_interval)) {
+		if (const auto rss = get_rss(); rss && *rss > config.max_rss) {
+			Recycle::Request(fmt::format("its resident set size is {} bytes", *rss));
+		}
+	}
+}
+
+void
+MemoryRequestHandler::Process(HttpRequest &&request, HttpResponder &responder)
+{
+	// Not for the handlers of pooled interpreters, which only collect garbage
+	if (config.max_requests > 0) {
+		requests.fetch_add(1, std::memory_order_relaxed);
+	}
+	next->Process(std::move(request), responder);
+}
+
+void
+MemoryRequestHandler::Prepare() noexcept
+{
+	if (config.gc_between_requests) {
+		const GilForPrepare gil;
+		try {
+			CollectGarbage();
+		} catch (const std::exception &exc) {
+			fmt::print(stderr, "Error collecting garbage: {}\n", exc.what());
+		}
+	}
+
+	if (config.trim_interval.count() > 0 && interval_passed(last_trim, config.trim_interval)) {
+		// Returns the free memory at the top of the heap and in the middle of it (since glibc 2.8) to the
+		// kernel. Python's own small object arenas are unmapped by Python when they are empty.
+		const Py::ReleaseGilIfHeld release;
+		::malloc_trim(0);
+	}
+
+	CheckLimits();
+	next->Prepare();
+}
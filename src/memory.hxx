@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+#include "http.hxx"
+#include "python.hxx"
+
+struct MemoryConfig {
+	// Disables the automatic garbage collection, which would otherwise run in the middle of requests, and runs it
+	// between requests instead, when it is due
+	bool gc_between_requests = false;
+	// Calls malloc_trim() between requests at most this often, 0 disables it
+	std::chrono::seconds trim_interval{ 0 };
+	// The process is recycled after this many requests, 0 disables it
+	uint64_t max_requests = 0;
+	// ... or once its resident set is larger than this many bytes, 0 disables it
+	uint64_t max_rss = 0;
+
+	bool Enabled() const noexcept { return gc_between_requests || trim_interval.count() > 0 || Recycles(); }
+	bool Recycles() const noexcept { return max_requests > 0 || max_rss > 0; }
+};
+
+// Recycling a process means that it stops accepting new requests and connections and exits, once the current
+// requests are done. Pre-forked workers then exit with Prefork::exit_status_recycle to be replaced.
+class Recycle {
+	static bool enabled;
+	static std::atomic<bool> requested;
+
+public:
+	// Must be called before the first connection is accepted
+	static void Enable() noexcept { enabled = true; }
+	static bool Enabled() noexcept { return enabled; }
+
+	static void Request(std::string_view reason) noexcept;
+	static bool Requested() noexcept { return requested.load(std::memory_order_relaxed); }
+};
+
+// Does the housekeeping of MemoryConfig in the gap between two requests (RequestHandler::Prepare), after the
+// response is complete and before the next request is accepted
+class MemoryRequestHandler final : public RequestHandler {
+	using Clock = std::chrono::steady_clock;
+
+	// Counted for the whole process, because every thread has its own handler
+	static std::atomic<uint64_t> requests;
+
+	std::unique_ptr<RequestHandler> next;
+	MemoryConfig config;
+
+	Py::Object gc_collect;
+	Py::Object gc_get_count;
+	Py::Object gc_get_threshold;
+
+	// Clock::time_point::time_since_epoch().count(), because the ASGI connection threads share a handler
+	std::atomic<Clock::rep> last_trim;
+	std::atomic<Clock::rep> last_rss_check;
+
+	void CollectGarbage();
+	void CheckLimits() noexcept;
+
+public:
+	// Must be called with the GIL held. The automatic garbage collection stays disabled when it is destroyed,
+	// because --reload creates the new handler first.
+	MemoryRequestHandler(std::unique_ptr<RequestHandler> next, MemoryConfig config);
+
+	void Process(HttpRequest &&request, HttpResponder &responder) override;
+	void Prepare() noexcept override;
+};
@@ -0,0 +1,174 @@
+#include "metrics.hxx"
+
+#include <bit>
+#include <new>
+#include <system_error>
+
+#include <fmt/format.h>
+#include <sys/mman.h>
+
+Metrics *Metrics::instance = nullptr;
+bool Metrics::log_timing = false;
+
+namespace {
+
+thread_local RequestTimer *current_request = nullptr;
+
+constexpr std::array<std::string_view, num_phases> phase_names = {
+	"read_request", "environ", "app_call", "iterate", "send", "total",
+};
+
+}
+
+void
+Metrics::Histogram::Record(Clock::duration duration) noexcept
+{
+	const auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+	// Bucket i counts durations up to 2^i µs
+	const auto us = (ns + 999) / 1000;
+	const auto bucket = us <= 1 ? 0 : std::min<size_t>(std::bit_width(us - 1), num_buckets - 1);
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	sum_ns.fetch_add(ns, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+Metrics::Enable(bool _log_timing)
+{
+	if (instance) {
+		return;
+	}
+
+	// Anonymous shared memory is inherited by forked workers, the atomics are lock-free and work across processes.
+	void *p = ::mmap(nullptr, sizeof(Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		throw std::system_error(errno, std::system_category(), "Could not allocate memory for metrics");
+	}
+	// mmap returns zeroed memory and the members have no initializers, so this initializes everything to 0
+	instance = new (p) Metrics;
+	log_timing = _log_timing;
+}
+
+void
+Metrics::Add(Phase phase, Clock::duration duration) noexcept
+{
+	if (current_request) {
+		current_request->phases[static_cast<size_t>(phase)] += duration;
+	} else {
+		instance->phases[static_cast<size_t>(phase)].Record(duration);
+	}
+}
+
+void
+Metrics::CountAbortedRequest() noexcept
+{
+	if (instance) {
+		instance->aborted_requests.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+std::string
+Metrics::Format()
+{
+	std::string out;
+	auto it = std::back_inserter(out);
+
+	fmt::format_to(it, "# HELP python_was_requests_total Requests processed\n"
+			   "# TYPE python_was_requests_total counter\n"
+			   "python_was_requests_total {}\n",
+		       instance->requests.load(std::memory_order_relaxed));
+	fmt::format_to(it, "# HELP python_was_aborted_requests_total Requests aborted because of an error\n"
+			   "# TYPE python_was_aborted_requests_total counter\n"
+			   "python_was_aborted_requests_total {}\n",
+		       instance->aborted_requests.load(std::memory_order_relaxed));
+
+	fmt::format_to(it, "# HELP python_was_phase_seconds Time spent in the phases of a request\n"
+			   "# TYPE python_was_phase_seconds histogram\n");
+	for (size_t p = 0; p < num_phases; ++p) {
+		const auto &histogram = instance->phases[p];
+		uint64_t cumulative = 0;
+		for (size_t b = 0; b < num_buckets; ++b) {
+			cumulative += histogram.buckets[b].load(std::memory_order_relaxed);
+			if (b + 1 < num_buckets) {
+				const auto le = static_cast<double>(uint64_t(1) << b) * 1e-6;
+				fmt::format_to(it, "python_was_phase_seconds_bucket{{phase=\"{}\",le=\"{}\"}} {}\n",
+					       phase_names[p], le, cumulative);
+			} else {
+				fmt::format_to(it, "python_was_phase_seconds_bucket{{phase=\"{}\",le=\"+Inf\"}} {}\n",
+					       phase_names[p], cumulative);
+			}
+		}
+		fmt::format_to(it, "python_was_phase_seconds_sum{{phase=\"{}\"}} {}\n", phase_names[p],
+			       static_cast<double>(histogram.sum_ns.load(std::memory_order_relaxed)) * 1e-9);
+		fmt::format_to(it, "python_was_phase_seconds_count{{phase=\"{}\"}} {}\n", phase_names[p],
+			       histogram.count.load(std::memory_order_relaxed));
+	}
+	return out;
+}
+
+RequestTimer::RequestTimer(std::string_view _uri) noexcept : uri(_uri), active(Metrics::Enabled())
+{
+	if (active) {
+		start = Metrics::Clock::now();
+		current_request = this;
+	}
+}
+
+RequestTimer::~RequestTimer()
+{
+	if (!active) {
+		return;
+	}
+
+	current_request = nullptr;
+	phases[static_cast<size_t>(Phase::TOTAL)] = Metrics::Clock::now() - start;
+
+	auto &metrics = *Metrics::instance;
+	metrics.requests.fetch_add(1, std::memory_order_relaxed);
+	for (size_t p = 0; p < num_phases; ++p) {
+		// Phases that did not happen for this request (e.g. environ for ASGI) are not counted
+		if (phases[p].count() > 0) {
+			metrics.phases[p].Record(phases[p]);
+		}
+	}
+
+	if (Metrics::log_timing) {
+		// stderr ends up in the log of beng-proxy
+		std::string line = fmt::format("python-was timing {}", uri);
+		for (size_t p = 0; p < num_phases; ++p) {
+			fmt::format_to(std::back_inserter(line), " {}={}us", phase_names[p],
+				       std::chrono::duration_cast<std::chrono::microseconds>(phases[p]).count());
+		}
+		line.push_back('\n');
+		fmt::print(stderr, "{}", line);
+	}
+}
+
+AttachRequestTimer::AttachRequestTimer(RequestTimer &timer) noexcept : previous(current_request)
+{
+	if (timer.active) {
+		current_request = &timer;
+	}
+}
+
+AttachRequestTimer::~AttachRequestTimer()
+{
+	current_request = previous;
+}
+
+void
+MetricsRequestHandler::Process(HttpRequest &&request, HttpResponder &responder)
+{
+	if (request.uri.path != path) {
+		next->Process(std::move(request), responder);
+		return;
+	}
+
+	const auto body = Metrics::Format();
+	HttpResponse response;
+	response.status = HTTP_STATUS_OK;
+	response.headers.emplace_back("Content-Type", "text/plain; version=0.0.4");
+	response.content_length = body.size();
+	responder.SendHeaders(std::move(response));
+	responder.SendBody(body);
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+
+#include "http.hxx"
+
+// The stages of a request, which are timed, if metrics are enabled
+enum class Phase : unsigned {
+	// Was::ReadRequest: parameters and headers of the request
+	READ_REQUEST,
+	// WsgiRequestHandler: building environ
+	ENVIRON,
+	// WsgiRequestHandler: calling the application
+	APP_CALL,
+	// WsgiRequestHandler: iterating the result, including SEND
+	ITERATE,
+	// WasResponder: blocked writing the response to the WAS connection
+	SEND,
+	// From reading the request until the response is complete
+	TOTAL,
+};
+
+constexpr size_t num_phases = static_cast<size_t>(Phase::TOTAL) + 1;
+
+// Histograms of the phase durations with buckets of 1 µs, 2 µs, 4 µs, ... (like an HDR histogram with a single
+// significant bit). They live in shared memory, so they are shared by all pre-forked workers, and are only updated with
+// relaxed atomic operations.
+class Metrics {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr size_t num_buckets = 28;
+
+	struct Histogram {
+		std::array<std::atomic<uint64_t>, num_buckets> buckets;
+		std::atomic<uint64_t> sum_ns;
+		std::atomic<uint64_t> count;
+
+		void Record(Clock::duration duration) noexcept;
+	};
+
+private:
+	static Metrics *instance;
+	static bool log_timing;
+
+	std::array<Histogram, num_phases> phases;
+	std::atomic<uint64_t> requests;
+	std::atomic<uint64_t> aborted_requests;
+
+public:
+	// Must be called before forking
+	static void Enable(bool log_timing);
+
+	static bool Enabled() noexcept { return instance != nullptr; }
+
+	// Adds the duration to the request that is being processed by this thread or directly to the histogram
+	static void Add(Phase phase, Clock::duration duration) noexcept;
+
+	static void CountAbortedRequest() noexcept;
+
+	// Prometheus text exposition format
+	static std::string Format();
+
+	friend class RequestTimer;
+};
+
+// Times a phase of the current request, from construction to destruction
+class PhaseTimer {
+	Phase phase;
+	bool active;
+	Metrics::Clock::time_point start;
+
+public:
+	explicit PhaseTimer(Phase phase) noexcept : phase(phase), active(Metrics::Enabled())
+	{
+		if (active) {
+			start = Metrics::Clock::now();
+		}
+	}
+
+	~PhaseTimer()
+	{
+		if (active) {
+			Metrics::Add(phase, Metrics::Clock::now() - start);
+		}
+	}
+
+	PhaseTimer(const PhaseTimer &) = delete;
+	PhaseTimer &operator=(const PhaseTimer &) = delete;
+};
+
+// Collects the phases of one request processed by this thread and records them, when the request is done
+class RequestTimer {
+	std::string_view uri;
+	bool active;
+	Metrics::Clock::time_point start;
+	std::array<Metrics::Clock::duration, num_phases> phases{};
+
+public:
+	explicit RequestTimer(std::string_view uri) noexcept;
+	~RequestTimer();
+
+	RequestTimer(const RequestTimer &) = delete;
+	RequestTimer &operator=(const RequestTimer &) = delete;
+
+	friend class Metrics;
+	friend class AttachRequestTimer;
+};
+
+// Makes the phases timed by this thread count for `timer` of another thread, e.g. on a thread that does the I/O for
+// it. The threads must not time the same phase at once, and `timer` must outlive this object.
+class AttachRequestTimer {
+	RequestTimer *previous;
+
+public:
+	explicit AttachRequestTimer(RequestTimer &timer) noexcept;
+	~AttachRequestTimer();
+
+	AttachRequestTimer(const AttachRequestTimer &) = delete;
+	AttachRequestTimer &operator=(const AttachRequestTimer &) = delete;
+};
+
+// Answers requests for `path` with the metrics and passes everything else on
+class MetricsRequestHandler final : public RequestHandler {
+	std::unique_ptr<RequestHandler> next;
+	std::string path;
+
+public:
+	MetricsRequestHandler(std::unique_ptr<RequestHandler> next, std::string path)
+	  : next(std::move(next))
+	  , path(std::move(path))
+	{
+	}
+
+	void Process(HttpRequest &&request, HttpResponder &responder) override;
+	void Prepare() noexcept override { next->Prepare(); }
+};
@@ -0,0 +1,257 @@
+#include "module.hxx"
+
+namespace {
+struct State {
+	PyObject *app;
+	// 0 if set_app did not get "asgi", otherwise 1 + asgi
+	int asgi;
+	PyObject *post_fork;
+	PyObject *warmup;
+};
+
+State *
+get_state(PyObject *module) noexcept
+{
+	return static_cast<State *>(PyModule_GetState(module));
+}
+
+int
+module_exec(PyObject *module)
+{
+	auto *state = get_state(module);
+	state->post_fork = PyList_New(0);
+	state->warmup = PyList_New(0);
+	return state->post_fork && state->warmup ? 0 : -1;
+}
+
+int
+module_traverse(PyObject *module, visitproc visit, void *arg)
+{
+	auto *state = get_state(module);
+	Py_VISIT(state->app);
+	Py_VISIT(state->post_fork);
+	Py_VISIT(state->warmup);
+	return 0;
+}
+
+int
+module_clear(PyObject *module)
+{
+	auto *state = get_state(module);
+	Py_CLEAR(state->app);
+	Py_CLEAR(state->post_fork);
+	Py_CLEAR(state->warmup);
+	return 0;
+}
+
+void
+module_free(void *module)
+{
+	module_clear(static_cast<PyObject *>(module));
+}
+
+PyObject *
+set_app(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+	PyObject *app = nullptr;
+	if (!PyArg_ParseTuple(args, "O:set_app", &app)) {
+		return nullptr;
+	}
+
+	int asgi = 0;
+	if (kwargs) {
+		PyObject *key = nullptr;
+		PyObject *value = nullptr;
+		Py_ssize_t pos = 0;
+		while (PyDict_Next(kwargs, &pos, &key, &value)) {
+			if (PyUnicode_CompareWithASCIIString(key, "asgi") != 0) {
+				PyErr_Format(PyExc_TypeError, "set_app() got an unexpected keyword argument '%U'", key);
+				return nullptr;
+			}
+			const int is_true = PyObject_IsTrue(value);
+			if (is_true < 0) {
+				return nullptr;
+			}
+			asgi = 1 + is_true;
+		}
+	}
+
+	auto *state = get_state(module);
+	Py_XSETREF(state->app, Py_NewRef(app));
+	state->asgi = asgi;
+	Py_RETURN_NONE;
+}
+
+// Registers a hook and returns it, so it can be used as a decorator
+PyObject *
+add_hook(PyObject *list, PyObject *function)
+{
+	if (!PyCallable_Check(function)) {
+		PyErr_SetString(PyExc_TypeError, "hook must be callable");
+		return nullptr;
+	}
+	if (PyList_Append(list, function) < 0) {
+		return nullptr;
+	}
+	return Py_NewRef(function);
+}
+
+PyObject *
+post_fork(PyObject *module, PyObject *function)
+{
+	return add_hook(get_state(module)->post_fork, function);
+}
+
+PyObject *
+warmup(PyObject *module, PyObject *function)
+{
+	return add_hook(get_state(module)->warmup, function);
+}
+
+PyMethodDef methods[] = {
+	{ "set_app", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(&set_app)),
+	  METH_VARARGS | METH_KEYWORDS,
+	  "set_app(app, *, asgi=None)\n--\n\nSets the application, instead of searching the module for it. "
+	  "asgi overrides the detection of ASGI applications." },
+	{ "post_fork", &post_fork, METH_O,
+	  "post_fork(function)\n--\n\nRegisters a function that is called in every worker process after forking." },
+	{ "warmup", &warmup, METH_O,
+	  "warmup(function)\n--\n\nRegisters a function that is called before the first request." },
+	{ nullptr, nullptr, 0, nullptr } // Sentinel
+};
+
+PyModuleDef_Slot slots[] = {
+	{ Py_mod_exec, reinterpret_cast<void *>(&module_exec) },
+#if PY_VERSION_HEX >= 0x030C0000
+	{ Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+	{ 0, nullptr }, // Sentinel
+};
+
+PyModuleDef definition = {
+	.m_base = PyModuleDef_HEAD_INIT,
+	.m_name = Module::name,
+	.m_doc = "Interface to python-was",
+	.m_size = sizeof(State),
+	.m_methods = methods,
+	.m_slots = slots,
+	.m_traverse = module_traverse,
+	.m_clear = module_clear,
+	.m_free = module_free,
+};
+
+// The state of the module in the current interpreter, nullptr if it has not been imported
+State *
+find_state(Py::Object &module)
+{
+	auto py_name = Py::intern(Module::name);
+	module = Py::wrap(PyImport_GetModule(py_name));
+	if (!module) {
+		if (PyErr_Occurred()) {
+			Py::rethrow_python_exception();
+		}
+		return nullptr;
+	}
+	return get_state(module);
+}
+
+void
+run_hooks(PyObject *list)
+{
+	// A copy, in case a hook registers another one
+	auto hooks = Py::wrap(PyList_GetSlice(list, 0, PyList_Size(list)));
+	if (!hooks) {
+		Py::rethrow_python_exception();
+	}
+	for (Py_ssize_t i = 0; i < PyList_Size(hooks); ++i) {
+		auto result = Py::wrap(PyObject_CallNoArgs(PyList_GetItem(hooks, i)));
+		if (!result) {
+			Py::rethrow_python_exception();
+		}
+	}
+}
+}
+
+namespace Module {
+
+PyObject *
+Init() noexcept
+{
+	return PyModuleDef_Init(&definition);
+}
+
+Py::Object
+GetApp()
+{
+	Py::Object module;
+	const auto *state = find_state(module);
+	if (!state || !state->app) {
+		return {};
+	}
+	return Py::wrap(Py_NewRef(state->app));
+}
+
+std::optional<bool>
+IsAsgi(PyObject *app)
+{
+	Py::Object module;
+	const auto *state = find_state(module);
+	if (!state || state->app != app || state->asgi == 0) {
+		return std::nullopt;
+	}
+	return state->asgi == 2;
+}
+
+void
+RunPostForkHooks()
+{
+	Py::Object module;
+	if (const auto *state = find_state(module)) {
+		run_hooks(state->post_fork);
+	}
+}
+
+void
+RunWarmupHooks()
+{
+	Py::Object module;
+	if (const auto *state = find_state(module)) {
+		run_hooks(state->warmup);
+	}
+}
+
+SavedState
+Reset()
+{
+	SavedState saved;
+	Py::Object module;
+	if (auto *state = find_state(module)) {
+		saved.app = Py::wrap(std::exchange(state->app, nullptr));
+		saved.asgi = std::exchange(state->asgi, 0);
+		saved.post_fork = Py::wrap(PyList_GetSlice(state->post_fork, 0, PyList_Size(state->post_fork)));
+		saved.warmup = Py::wrap(PyList_GetSlice(state->warmup, 0, PyList_Size(state->warmup)));
+		if (!saved.post_fork || !saved.warmup ||
+		    PyList_SetSlice(state->post_fork, 0, PyList_Size(state->post_fork), nullptr) < 0 ||
+		    PyList_SetSlice(state->warmup, 0, PyList_Size(state->warmup), nullptr) < 0) {
+			Py::rethrow_python_exception();
+		}
+	}
+	return saved;
+}
+
+void
+Restore(SavedState &&saved)
+{
+	Py::Object module;
+	if (auto *state = find_state(module)) {
+		Py_XSETREF(state->app, saved.app.Release());
+		state->asgi = saved.asgi;
+		if ((saved.post_fork &&
+		     PyList_SetSlice(state->post_fork, 0, PyList_Size(state->post_fork), saved.post_fork) < 0) ||
+		    (saved.warmup && PyList_SetSlice(state->warmup, 0, PyList_Size(state->warmup), saved.warmup) < 0)) {
+			Py::rethrow_python_exception();
+		}
+	}
+}
+
+} // namespace Module
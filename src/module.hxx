@@ -0,0 +1,59 @@
+#pragma once
+
+#include "python.hxx"
+
+#include <optional>
+
+// The built-in module cm4all_python_was, which lets applications talk to python-was:
+//
+//   import cm4all_python_was
+//   cm4all_python_was.set_app(app, asgi=False)
+//
+//   @cm4all_python_was.post_fork
+//   def reconnect(): ...
+//
+//   @cm4all_python_was.warmup
+//   def preload(): ...
+//
+// Every interpreter has its own instance, all functions refer to the current one.
+namespace Module {
+
+constexpr const char *name = "cm4all_python_was";
+
+// To be passed to PyImport_AppendInittab before Py_Initialize
+PyObject *
+Init() noexcept;
+
+// The application passed to set_app, if the module has been imported and set_app has been called
+Py::Object
+GetApp();
+
+// Whether set_app was told that `app` is an ASGI application
+std::optional<bool>
+IsAsgi(PyObject *app);
+
+// Runs the functions registered with post_fork, in a worker process right after it has been forked
+void
+RunPostForkHooks();
+
+// Runs the functions registered with warmup, once the application has been imported and before the first request
+void
+RunWarmupHooks();
+
+// The application and the hooks, as they were before Reset
+struct SavedState {
+	Py::Object app;
+	int asgi = 0;
+	Py::Object post_fork;
+	Py::Object warmup;
+};
+
+// Forgets the application and the hooks, before it is imported again. Returns them for Restore.
+SavedState
+Reset();
+
+// Brings back what Reset forgot, if importing the application again failed
+void
+Restore(SavedState &&saved);
+
+} // namespace Module
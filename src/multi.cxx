@@ -0,0 +1,141 @@
+#include "multi.hxx"
+#include "memory.hxx"
+#include "python.hxx"
+#include "was.hxx"
+#include "was_async.hxx"
+
+#include <was/protocol.h>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <span>
+#include <system_error>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+// How often a process that waits for a connection checks whether it is being recycled
+constexpr int recycle_poll_ms = 1000;
+
+void
+close_all(std::span<const int> fds) noexcept
+{
+	for (const auto fd : fds) {
+		::close(fd);
+	}
+}
+}
+
+bool
+MultiWas::IsMultiWasSocket(int fd) noexcept
+{
+	int type = 0;
+	socklen_t length = sizeof(type);
+	return ::getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) == 0 && type == SOCK_SEQPACKET;
+}
+
+bool
+MultiWas::WaitForConnection()
+{
+	const Py::ReleaseGilIfHeld release;
+	while (!Recycle::Requested()) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+		const int n = ::poll(&pfd, 1, recycle_poll_ms);
+		if (n > 0) {
+			return true;
+		}
+		if (n < 0 && errno != EINTR) {
+			throw std::system_error(errno, std::system_category(), "Error polling Multi-WAS socket");
+		}
+	}
+	return false;
+}
+
+std::optional<MultiWas::Connection>
+MultiWas::Accept()
+{
+	while (true) {
+		struct multi_was_header header = {};
+		struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+
+		alignas(struct cmsghdr) std::array<char, CMSG_SPACE(3 * sizeof(int))> control;
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.data(),
+			.msg_controllen = control.size(),
+		};
+
+		// Other threads of a process that is being recycled must not block in recvmsg, so they wait in poll and
+		// don't block, if another process (or thread) has taken the connection in the meantime
+		int flags = MSG_CMSG_CLOEXEC;
+		if (Recycle::Enabled()) {
+			if (!WaitForConnection()) {
+				return std::nullopt;
+			}
+			flags |= MSG_DONTWAIT;
+		}
+
+		ssize_t n;
+		{
+			const Py::ReleaseGilIfHeld release;
+			n = ::recvmsg(fd, &msg, flags);
+		}
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			throw std::system_error(errno, std::system_category(), "Error receiving Multi-WAS datagram");
+		}
+		if (n == 0) {
+			return std::nullopt;
+		}
+
+		std::array<int, 3> fds;
+		size_t num_fds = 0;
+		for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+				num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				std::memcpy(fds.data(), CMSG_DATA(cmsg), std::min(num_fds, fds.size()) * sizeof(int));
+			}
+		}
+
+		if ((msg.msg_flags & MSG_CTRUNC) || num_fds != fds.size()) {
+			close_all(std::span(fds).first(std::min(num_fds, fds.size())));
+			fmt::print(stderr, "Ignoring Multi-WAS datagram with {} file descriptors\n", num_fds);
+			continue;
+		}
+
+		if (static_cast<size_t>(n) < sizeof(header) || header.command != MULTI_WAS_COMMAND_NEW) {
+			close_all(fds);
+			fmt::print(stderr, "Ignoring unknown Multi-WAS command {}\n", header.command);
+			continue;
+		}
+
+		return Connection{ .control_fd = fds[0], .input_fd = fds[1], .output_fd = fds[2] };
+	}
+}
+
+void
+MultiWas::Run(RequestHandler &handler, bool async)
+{
+	while (!Recycle::Requested()) {
+		const auto connection = Accept();
+		if (!connection) {
+			break;
+		}
+		if (async) {
+			AsyncWas was(connection->control_fd, connection->input_fd, connection->output_fd);
+			was.Run(handler);
+		} else {
+			Was was(connection->control_fd, connection->input_fd, connection->output_fd);
+			was.Run(handler);
+		}
+	}
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <optional>
+
+#include "http.hxx"
+
+// Multi-WAS: Instead of a single WAS connection on fd 0, 1 and 3, beng-proxy passes a SOCK_SEQPACKET socket as stdin.
+// Every datagram on that socket announces a new WAS connection and carries its control socket and its input and
+// output pipes as SCM_RIGHTS.
+// Multiple processes may receive from the same socket (e.g. after fork), in which case every connection is handed to
+// exactly one of them.
+class MultiWas {
+	int fd;
+
+	// Returns false, if the process is recycled before a connection arrives
+	bool WaitForConnection();
+
+public:
+	struct Connection {
+		int control_fd;
+		int input_fd;
+		int output_fd;
+	};
+
+	explicit MultiWas(int fd) : fd(fd) {}
+
+	static bool IsMultiWasSocket(int fd) noexcept;
+
+	// Blocks until a new connection has been received.
+	// Returns nullopt if the socket has been closed by the WAS client or the process is recycled.
+	// Throws on error.
+	std::optional<Connection> Accept();
+
+	// Serves one connection after the other until the socket has been closed or the process is recycled.
+	// If `async` is set, they are served by AsyncWas instead of Was.
+	void Run(RequestHandler &handler, bool async);
+};
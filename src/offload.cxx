@@ -0,0 +1,250 @@
+#include "offload.hxx"
+#include "range.hxx"
+
+#include <cerrno>
+#include <cstdlib>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+std::optional<std::string>
+real_path(const std::string &path)
+{
+	char *real = ::realpath(path.c_str(), nullptr);
+	if (!real) {
+		return std::nullopt;
+	}
+	std::string result(real);
+	std::free(real);
+	return result;
+}
+
+bool
+is_below(std::string_view path, std::string_view root) noexcept
+{
+	if (root == "/") {
+		return true;
+	}
+	return path.starts_with(root) && path.size() > root.size() && path[root.size()] == '/';
+}
+
+void
+OffloadConfig::AddRoot(const std::string &path)
+{
+	auto real = real_path(path);
+	if (!real) {
+		throw std::system_error(errno, std::system_category(), fmt::format("Invalid sendfile root '{}'", path));
+	}
+	roots.push_back(std::move(*real));
+}
+
+namespace {
+
+int
+hex_digit(char c) noexcept
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+// X-Accel-Redirect names a URI: Strips the query and percent-decodes the path. Returns nullopt for invalid escapes and
+// for a null byte.
+std::optional<std::string>
+uri_to_path(std::string_view uri)
+{
+	uri = uri.substr(0, uri.find('?'));
+	std::string path;
+	path.reserve(uri.size());
+	for (size_t i = 0; i < uri.size(); ++i) {
+		if (uri[i] != '%') {
+			path.push_back(uri[i]);
+			continue;
+		}
+		const int high = i + 2 < uri.size() ? hex_digit(uri[i + 1]) : -1;
+		const int low = high >= 0 ? hex_digit(uri[i + 2]) : -1;
+		if (low < 0 || (high == 0 && low == 0)) {
+			return std::nullopt;
+		}
+		path.push_back(static_cast<char>(high * 16 + low));
+		i += 2;
+	}
+	return path;
+}
+
+// Returns the real path of the file named by the header value. An absolute path below one of the roots is used as is
+// (X-Sendfile), anything else is looked up relative to the roots (X-Accel-Redirect).
+std::optional<std::string>
+resolve(const OffloadConfig &config, std::string_view value)
+{
+	std::vector<std::string> candidates;
+	if (value.starts_with('/')) {
+		candidates.emplace_back(value);
+	}
+	while (value.starts_with('/')) {
+		value.remove_prefix(1);
+	}
+	for (const auto &root : config.roots) {
+		candidates.push_back(root + "/" + std::string(value));
+	}
+
+	for (const auto &candidate : candidates) {
+		const auto path = real_path(candidate);
+		if (!path) {
+			continue;
+		}
+		for (const auto &root : config.roots) {
+			if (is_below(*path, root)) {
+				return path;
+			}
+		}
+	}
+	return std::nullopt;
+}
+
+class OffloadResponder : public HttpResponder {
+	const OffloadConfig &config;
+	HttpResponder &next;
+	const bool head;
+	std::optional<std::string> range_header;
+	std::optional<std::string> if_range_header;
+
+	bool offloaded = false;
+	int fd = -1;
+	uint64_t offset = 0;
+	uint64_t length = 0;
+
+	// Opens the file and turns `response` into the response for it
+	void OpenFile(std::string_view value, HttpResponse &response)
+	{
+		std::optional<std::string> path;
+		if (HeaderMatch(config.header, "X-Accel-Redirect")) {
+			if (const auto decoded = uri_to_path(value)) {
+				path = resolve(config, *decoded);
+			}
+		} else {
+			path = resolve(config, value);
+		}
+		if (path) {
+			fd = ::open(path->c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY);
+		}
+
+		struct stat st;
+		if (fd < 0 || ::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+			fmt::print(stderr, "{}: Can't send '{}'\n", config.header, value);
+			response.status = HTTP_STATUS_NOT_FOUND;
+			response.headers.clear();
+			response.content_length = 0;
+			return;
+		}
+
+		const auto size = static_cast<uint64_t>(st.st_size);
+		const auto range = apply_range(response, size, range_header, if_range_header);
+		offset = range.start;
+		length = range.type == RangeRequest::Type::UNSATISFIABLE ? 0 : range.Size();
+	}
+
+protected:
+	void SendHeadersImpl(HttpResponse &&response) override
+	{
+		for (auto it = response.headers.begin(); it != response.headers.end(); ++it) {
+			if (HeaderMatch(it->first, config.header)) {
+				const auto value = std::move(it->second);
+				response.headers.erase(it);
+				// Other responses, e.g. 304 or errors, keep the body of the application
+				const auto status = static_cast<unsigned>(response.status);
+				if (status >= 200 && status < 300 && status != 204) {
+					offloaded = true;
+					OpenFile(value, response);
+				}
+				break;
+			}
+		}
+		next.SendHeaders(std::move(response));
+	}
+
+	// The body of the application is discarded, if the response is offloaded
+	void SendBodyImpl(std::string_view body_data) override
+	{
+		if (!offloaded) {
+			next.SendBody(body_data);
+		}
+	}
+
+	void SendBodyChunksImpl(std::span<const std::string_view> chunks) override
+	{
+		if (!offloaded) {
+			next.SendBodyChunks(chunks);
+		}
+	}
+
+	void SendFileImpl(int file_fd, uint64_t file_offset, uint64_t file_length) override
+	{
+		if (!offloaded) {
+			next.SendFile(file_fd, file_offset, file_length);
+		}
+	}
+
+public:
+	OffloadResponder(const OffloadConfig &config, HttpResponder &next, bool head,
+			 std::optional<std::string> range_header, std::optional<std::string> if_range_header)
+	  : config(config)
+	  , next(next)
+	  , head(head)
+	  , range_header(std::move(range_header))
+	  , if_range_header(std::move(if_range_header))
+	{
+	}
+
+	~OffloadResponder()
+	{
+		if (fd >= 0) {
+			::close(fd);
+		}
+	}
+
+	OffloadResponder(const OffloadResponder &) = delete;
+	OffloadResponder &operator=(const OffloadResponder &) = delete;
+
+	void Finish()
+	{
+		// A HEAD response gets the headers of the file, but no body
+		if (fd >= 0 && length > 0 && !head) {
+			next.SendFile(fd, offset, length);
+		}
+	}
+};
+}
+
+void
+OffloadRequestHandler::Process(HttpRequest &&request, HttpResponder &responder)
+{
+	// The request is gone by the time the application sends its headers
+	std::optional<std::string> range_header, if_range_header;
+	if (request.method == HTTP_METHOD_GET) {
+		if (const auto range = request.FindHeader("Range")) {
+			range_header.emplace(*range);
+		}
+		if (const auto if_range = request.FindHeader("If-Range")) {
+			if_range_header.emplace(*if_range);
+		}
+	}
+
+	OffloadResponder offload(config, responder, request.method == HTTP_METHOD_HEAD, std::move(range_header),
+				 std::move(if_range_header));
+	next->Process(std::move(request), offload);
+	offload.Finish();
+}
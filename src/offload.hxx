@@ -0,0 +1,46 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http.hxx"
+
+struct OffloadConfig {
+	// The response header that names the file to send, e.g. X-Sendfile or X-Accel-Redirect
+	std::string header;
+	// Only files below these directories are sent. Absolute and without symlinks.
+	std::vector<std::string> roots;
+
+	void AddRoot(const std::string &path);
+};
+
+// Returns the absolute path of `path` without symlinks, nullopt if it does not exist
+std::optional<std::string>
+real_path(const std::string &path);
+
+// Whether `path` is below the directory `root`, both as returned by real_path
+[[gnu::pure]] bool
+is_below(std::string_view path, std::string_view root) noexcept;
+
+// Lets the application delegate sending a file to python-was: If a response contains the configured header, its value
+// is resolved against the allowed roots, the header is removed and the body of the application is replaced with the
+// file, which is sent with HttpResponder::SendFile after the application is done. Single byte ranges are supported.
+// Only 2xx responses with a body are replaced, other ones just lose the header. X-Accel-Redirect values are
+// percent-decoded URIs.
+class OffloadRequestHandler final : public RequestHandler {
+	std::unique_ptr<RequestHandler> next;
+	OffloadConfig config;
+
+public:
+	OffloadRequestHandler(std::unique_ptr<RequestHandler> next, OffloadConfig config)
+	  : next(std::move(next))
+	  , config(std::move(config))
+	{
+	}
+
+	void Process(HttpRequest &&request, HttpResponder &responder) override;
+	void Prepare() noexcept override { next->Prepare(); }
+};
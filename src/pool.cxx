@@ -0,0 +1,121 @@
+#include "pool.hxx"
+
+#include <stdexcept>
+
+#include <fmt/format.h>
+
+std::optional<AppSelector>
+AppSelector::FromRequest(const HttpRequest &request)
+{
+	const auto module = request.FindParameter("module");
+	if (!module) {
+		return std::nullopt;
+	}
+
+	AppSelector selector{ .module = std::string(*module), .app = {}, .sys_path = {} };
+	if (const auto app = request.FindParameter("app")) {
+		selector.app = *app;
+	}
+	if (auto sys_path = request.FindParameter("sys_path")) {
+		while (!sys_path->empty()) {
+			const auto colon = sys_path->find(':');
+			const auto path = sys_path->substr(0, colon);
+			sys_path->remove_prefix(colon == std::string_view::npos ? sys_path->size() : colon + 1);
+			if (!path.empty()) {
+				selector.sys_path.emplace_back(path);
+			}
+		}
+	}
+	return selector;
+}
+
+std::string
+AppSelector::Key() const
+{
+	std::string key = module;
+	key.push_back('\0');
+	key.append(app);
+	for (const auto &path : sys_path) {
+		key.push_back('\0');
+		key.append(path);
+	}
+	return key;
+}
+
+InterpreterPoolRequestHandler::~InterpreterPoolRequestHandler()
+{
+	while (!entries.empty()) {
+		Evict();
+	}
+}
+
+void
+InterpreterPoolRequestHandler::Evict() noexcept
+{
+	auto &entry = entries.back();
+	index.erase(entry.key);
+	{
+		const Py::PooledInterpreter::Enter enter(*entry.interpreter);
+		entry.handler.reset();
+	}
+	entries.pop_back();
+}
+
+InterpreterPoolRequestHandler::Entry &
+InterpreterPoolRequestHandler::Get(const AppSelector &selector)
+{
+	auto key = selector.Key();
+	if (const auto it = index.find(key); it != index.end()) {
+		entries.splice(entries.begin(), entries, it->second);
+		return *it->second;
+	}
+
+	if (entries.size() >= max_interpreters) {
+		Evict();
+	}
+
+	auto interpreter = std::make_unique<Py::PooledInterpreter>();
+	std::unique_ptr<RequestHandler> handler;
+	try {
+		const Py::PooledInterpreter::Enter enter(*interpreter);
+		handler = factory(selector);
+	} catch (const std::exception &exc) {
+		// The interpreter may hold half of the imported application, so it is not reused
+		throw std::runtime_error(fmt::format("Could not load '{}': {}", selector.module, exc.what()));
+	}
+	fmt::print(stderr, "Loaded '{}' into a new interpreter\n", selector.module);
+
+	entries.push_front(Entry{ std::move(key), std::move(interpreter), std::move(handler) });
+	index.emplace(entries.front().key, entries.begin());
+	return entries.front();
+}
+
+void
+InterpreterPoolRequestHandler::Process(HttpRequest &&request, HttpResponder &responder)
+{
+	const auto selector = AppSelector::FromRequest(request);
+	if (!selector) {
+		if (!fallback) {
+			throw std::runtime_error("Request has no 'module' parameter");
+		}
+		fallback->Process(std::move(request), responder);
+		return;
+	}
+
+	auto &entry = Get(*selector);
+	const Py::PooledInterpreter::Enter enter(*entry.interpreter);
+	entry.handler->Process(std::move(request), responder);
+}
+
+void
+InterpreterPoolRequestHandler::Prepare() noexcept
+{
+	if (fallback) {
+		fallback->Prepare();
+	}
+	if (!entries.empty()) {
+		auto &entry = entries.front();
+		const Py::PooledInterpreter::Enter enter(*entry.interpreter);
+		entry.handler->Prepare();
+	}
+}
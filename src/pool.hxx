@@ -0,0 +1,69 @@
+#pragma once
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "http.hxx"
+#include "python.hxx"
+
+// Which application a request is for, from the WAS parameters "module", "app" and "sys_path" (separated by ':')
+struct AppSelector {
+	std::string module;
+	std::string app;
+	std::vector<std::string> sys_path;
+
+	// Returns nullopt if the request has no "module" parameter
+	static std::optional<AppSelector> FromRequest(const HttpRequest &request);
+
+	std::string Key() const;
+};
+
+// Passes each request to the application selected by its WAS parameters. Every application is imported into a
+// sub-interpreter of its own, which is kept for the following requests. If there are more than `max_interpreters`,
+// the least recently used one is destroyed. Requests without parameters go to `fallback`, if any.
+// Not thread-safe, and the calling thread must hold the GIL of the main interpreter.
+class InterpreterPoolRequestHandler final : public RequestHandler {
+public:
+	// Imports the application and creates its handler, called in the new sub-interpreter
+	using Factory = std::function<std::unique_ptr<RequestHandler>(const AppSelector &selector)>;
+
+private:
+	struct Entry {
+		std::string key;
+		// Destroyed after the handler, which owns objects of the interpreter
+		std::unique_ptr<Py::PooledInterpreter> interpreter;
+		std::unique_ptr<RequestHandler> handler;
+	};
+
+	size_t max_interpreters;
+	Factory factory;
+	std::unique_ptr<RequestHandler> fallback;
+
+	// Most recently used first
+	std::list<Entry> entries;
+	std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+
+	Entry &Get(const AppSelector &selector);
+	void Evict() noexcept;
+
+public:
+	InterpreterPoolRequestHandler(size_t max_interpreters, Factory factory,
+				      std::unique_ptr<RequestHandler> fallback)
+	  : max_interpreters(max_interpreters)
+	  , factory(std::move(factory))
+	  , fallback(std::move(fallback))
+	{
+	}
+
+	~InterpreterPoolRequestHandler();
+
+	void Process(HttpRequest &&request, HttpResponder &responder) override;
+
+	// For the application of the last request, which is the most likely one for the next request
+	void Prepare() noexcept override;
+};
@@ -0,0 +1,133 @@
+#include "prefork.hxx"
+#include "python.hxx"
+
+#include <fmt/format.h>
+
+#include <cerrno>
+#include <csignal>
+#include <system_error>
+#include <thread>
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+namespace {
+volatile std::sig_atomic_t shutdown_requested = 0;
+
+void
+OnShutdownSignal(int) noexcept
+{
+	shutdown_requested = 1;
+}
+
+void
+SetSignalHandler(void (*handler)(int)) noexcept
+{
+	struct sigaction sa = {};
+	sa.sa_handler = handler;
+	sigemptyset(&sa.sa_mask);
+	// No SA_RESTART, so waitpid will be interrupted
+	sa.sa_flags = 0;
+	sigaction(SIGTERM, &sa, nullptr);
+	sigaction(SIGINT, &sa, nullptr);
+}
+
+// If a worker dies sooner than this after it has been spawned, wait a bit before spawning a new one
+constexpr auto min_worker_lifetime = std::chrono::seconds(1);
+}
+
+bool
+Prefork::Spawn()
+{
+	const auto pid = Py::fork();
+	if (pid < 0) {
+		throw std::system_error(errno, std::system_category(), "fork failed");
+	}
+
+	if (pid == 0) {
+		SetSignalHandler(SIG_DFL);
+		// The master process does not hold a reference to the WAS connections, so there is nobody left to
+		// talk to if it goes away.
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		workers.clear();
+		return true;
+	}
+
+	workers.emplace(pid, std::chrono::steady_clock::now());
+	return false;
+}
+
+void
+Prefork::KillAll(int signal) noexcept
+{
+	for (const auto &[pid, started] : workers) {
+		::kill(pid, signal);
+	}
+}
+
+bool
+Prefork::Run()
+{
+	SetSignalHandler(&OnShutdownSignal);
+
+	for (unsigned i = 0; i < num_workers; ++i) {
+		if (Spawn()) {
+			return true;
+		}
+	}
+
+	fmt::print(stderr, "Started {} workers\n", num_workers);
+
+	bool killed = false;
+	while (!workers.empty()) {
+		if (shutdown_requested && !killed) {
+			KillAll(SIGTERM);
+			killed = true;
+		}
+
+		int status = 0;
+		const auto pid = ::waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::system_error(errno, std::system_category(), "waitpid failed");
+		}
+
+		const auto it = workers.find(pid);
+		if (it == workers.end()) {
+			continue;
+		}
+		const auto lifetime = std::chrono::steady_clock::now() - it->second;
+		workers.erase(it);
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			continue;
+		}
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) == exit_status_recycle) {
+			fmt::print(stderr, "Replacing recycled worker {}\n", pid);
+		} else if (WIFSIGNALED(status)) {
+			fmt::print(stderr, "Worker {} was killed by signal {}\n", pid, WTERMSIG(status));
+		} else {
+			fmt::print(stderr, "Worker {} exited with status {}\n", pid, WEXITSTATUS(status));
+		}
+
+		if (shutdown_requested) {
+			continue;
+		}
+
+		if (lifetime < min_worker_lifetime) {
+			std::this_thread::sleep_for(min_worker_lifetime - lifetime);
+		}
+
+		if (before_respawn) {
+			before_respawn();
+		}
+		if (Spawn()) {
+			return true;
+		}
+	}
+
+	return false;
+}
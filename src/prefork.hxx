@@ -0,0 +1,37 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+
+#include <sys/types.h>
+
+// Pre-fork master: The application is imported once in the master process, which then forks worker processes that
+// share all pages of the imported modules copy-on-write.
+// Workers that crash are replaced by new forks of the (still warm) master. A worker that exits with status 0 is not
+// replaced, because that only happens if the WAS client has closed the connection, unless it is exit_status_recycle.
+class Prefork {
+	unsigned num_workers;
+	// Called in the master process before it replaces a worker
+	std::function<void()> before_respawn;
+	std::map<pid_t, std::chrono::steady_clock::time_point> workers;
+
+	// Returns true in the child
+	bool Spawn();
+	void KillAll(int signal) noexcept;
+
+public:
+	// A worker that exits with this status is replaced without complaint, see Recycle
+	static constexpr int exit_status_recycle = 3;
+
+	explicit Prefork(unsigned num_workers, std::function<void()> before_respawn = {})
+	  : num_workers(num_workers)
+	  , before_respawn(std::move(before_respawn))
+	{
+	}
+
+	// Like fork(): Returns true in every worker process, which should then go on serving requests.
+	// Returns false in the master process once all workers have exited.
+	// Must be called while the GIL is held and no other threads exist.
+	bool Run();
+};
@@ -1,9 +1,115 @@
 #include "python.hxx"
+#include "module.hxx"
 
 #include <stdexcept>
 
+#include <unistd.h>
+
 namespace Py {
 
+Python::Python(const PythonConfig &config)
+{
+	PyImport_AppendInittab(Module::name, &Module::Init);
+
+	PyConfig py_config;
+	PyConfig_InitPythonConfig(&py_config);
+	py_config.isolated = config.isolated;
+	py_config.site_import = config.site;
+	py_config.import_time = config.import_time;
+#if PY_VERSION_HEX >= 0x030B0000
+	// The standard library modules needed for startup are compiled into the interpreter
+	py_config.use_frozen_modules = 1;
+#endif
+
+	PyStatus status = PyStatus_Ok();
+	if (config.trust_pyc) {
+		status = PyConfig_SetString(&py_config, &py_config.check_hash_pycs_mode, L"never");
+	}
+	if (!PyStatus_Exception(status)) {
+		status = Py_InitializeFromConfig(&py_config);
+	}
+	PyConfig_Clear(&py_config);
+	if (PyStatus_Exception(status)) {
+		throw Error(status.err_msg ? status.err_msg : "Could not initialize Python");
+	}
+}
+
+SubInterpreter::SubInterpreter()
+{
+#if PY_VERSION_HEX >= 0x030C0000
+	// Py_NewInterpreterFromConfig needs a current thread state of the main interpreter. It releases its GIL and
+	// returns with the new interpreter's own GIL held.
+	main_gil_state = PyGILState_Ensure();
+	main_thread_state = PyThreadState_Get();
+
+	const PyInterpreterConfig config = {
+		.use_main_obmalloc = 0,
+		.allow_fork = 0,
+		.allow_exec = 0,
+		.allow_threads = 1,
+		.allow_daemon_threads = 0,
+		.check_multi_interp_extensions = 1,
+		.gil = PyInterpreterConfig_OWN_GIL,
+	};
+	const auto status = Py_NewInterpreterFromConfig(&thread_state, &config);
+	if (PyStatus_Exception(status)) {
+		PyGILState_Release(main_gil_state);
+		throw Error(status.err_msg ? status.err_msg : "Could not create sub-interpreter");
+	}
+#else
+	throw Error("Sub-interpreters with their own GIL require Python 3.12 or later");
+#endif
+}
+
+SubInterpreter::~SubInterpreter()
+{
+#if PY_VERSION_HEX >= 0x030C0000
+	Py_EndInterpreter(thread_state);
+	// Py_EndInterpreter leaves us without any thread state, so we have to restore the one from PyGILState_Ensure
+	// to release it properly.
+	PyEval_RestoreThread(main_thread_state);
+	PyGILState_Release(main_gil_state);
+#endif
+}
+
+PooledInterpreter::PooledInterpreter()
+{
+#if PY_VERSION_HEX >= 0x030C0000
+	PyThreadState *const main_thread_state = PyThreadState_Get();
+
+	const PyInterpreterConfig config = {
+		.use_main_obmalloc = 0,
+		.allow_fork = 0,
+		.allow_exec = 0,
+		.allow_threads = 1,
+		.allow_daemon_threads = 0,
+		.check_multi_interp_extensions = 1,
+		.gil = PyInterpreterConfig_OWN_GIL,
+	};
+	// Restores the main thread state if it fails
+	const auto status = Py_NewInterpreterFromConfig(&thread_state, &config);
+	if (PyStatus_Exception(status)) {
+		throw Error(status.err_msg ? status.err_msg : "Could not create sub-interpreter");
+	}
+
+	// Created with its GIL held, which we give back until it is entered
+	PyEval_SaveThread();
+	PyEval_RestoreThread(main_thread_state);
+#else
+	throw Error("Sub-interpreters with their own GIL require Python 3.12 or later");
+#endif
+}
+
+PooledInterpreter::~PooledInterpreter()
+{
+#if PY_VERSION_HEX >= 0x030C0000
+	PyThreadState *const main_thread_state = PyEval_SaveThread();
+	PyEval_RestoreThread(thread_state);
+	Py_EndInterpreter(thread_state);
+	PyEval_RestoreThread(main_thread_state);
+#endif
+}
+
 Object
 wrap(PyObject *obj) noexcept
 {
@@ -32,6 +138,17 @@ uc_from_latin1(std::string_view str)
 	return obj;
 }
 
+Object
+intern(std::string_view str)
+{
+	PyObject *obj = PyUnicode_FromStringAndSize(str.data(), str.size());
+	if (!obj) {
+		Py::rethrow_python_exception();
+	}
+	PyUnicode_InternInPlace(&obj);
+	return wrap(obj);
+}
+
 Object
 to_bytes(std::string_view str) noexcept
 {
@@ -116,4 +233,34 @@ import(std::string_view module_name) noexcept
 	return wrap(PyImport_Import(py_name));
 }
 
+pid_t
+fork() noexcept
+{
+	PyOS_BeforeFork();
+	const auto pid = ::fork();
+	if (pid == 0) {
+		PyOS_AfterFork_Child();
+	} else {
+		PyOS_AfterFork_Parent();
+	}
+	return pid;
+}
+
+void
+gc_freeze()
+{
+	auto gc = import("gc");
+	if (!gc) {
+		rethrow_python_exception();
+	}
+
+	// Collect first, so garbage is not kept alive forever in the permanent generation
+	PyGC_Collect();
+
+	auto result = wrap(PyObject_CallMethod(gc, "freeze", nullptr));
+	if (!result) {
+		rethrow_python_exception();
+	}
+}
+
 }
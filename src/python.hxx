@@ -9,15 +9,141 @@
 
 namespace Py {
 
+// Python was built without the GIL (PEP 703, e.g. 3.13t), so threads of one interpreter run Python code in parallel
+#ifdef Py_GIL_DISABLED
+constexpr bool free_threaded = true;
+#else
+constexpr bool free_threaded = false;
+#endif
+
 struct Error : std::runtime_error {
 	Error(std::string str) : std::runtime_error(std::move(str)) {}
 };
 
+struct PythonConfig {
+	// Ignore the PYTHON* environment variables and the user's site-packages
+	bool isolated = false;
+	// Import the site module, which adds the site-packages of the installation or venv to sys.path
+	bool site = true;
+	// Don't compare hash-based .pyc files with their sources (see compileall --invalidation-mode)
+	bool trust_pyc = false;
+	// Print the time every import takes to stderr, like -X importtime
+	bool import_time = false;
+};
+
 struct Python {
-	Python() { Py_Initialize(); }
+	// Also makes the built-in modules of python-was available
+	explicit Python(const PythonConfig &config = {});
 	~Python() { Py_Finalize(); }
 };
 
+// Acquires the GIL for the calling thread (creating a thread state if necessary), if it does not hold it already
+class EnsureGil {
+	PyGILState_STATE state;
+
+public:
+	EnsureGil() : state(PyGILState_Ensure()) {}
+	~EnsureGil() { PyGILState_Release(state); }
+
+	EnsureGil(const EnsureGil &) = delete;
+	EnsureGil &operator=(const EnsureGil &) = delete;
+};
+
+// Releases the GIL held by the calling thread for the lifetime of this object (Py_BEGIN_ALLOW_THREADS).
+// No Python objects must be touched while it exists.
+class ReleaseGil {
+	PyThreadState *state;
+
+public:
+	ReleaseGil() : state(PyEval_SaveThread()) {}
+	~ReleaseGil() { PyEval_RestoreThread(state); }
+
+	ReleaseGil(const ReleaseGil &) = delete;
+	ReleaseGil &operator=(const ReleaseGil &) = delete;
+};
+
+// The thread state of the calling thread, if it holds the GIL (of its interpreter), nullptr otherwise
+inline PyThreadState *
+current_thread_state() noexcept
+{
+#if PY_VERSION_HEX >= 0x030D0000
+	return PyThreadState_GetUnchecked();
+#else
+	return _PyThreadState_UncheckedGet();
+#endif
+}
+
+// Like ReleaseGil, but does nothing if the calling thread does not hold the GIL. For blocking I/O in code that is
+// called from Python as well as from threads that never run Python code.
+class ReleaseGilIfHeld {
+	PyThreadState *state;
+
+public:
+	ReleaseGilIfHeld() noexcept : state(current_thread_state() ? PyEval_SaveThread() : nullptr) {}
+	~ReleaseGilIfHeld()
+	{
+		if (state) {
+			PyEval_RestoreThread(state);
+		}
+	}
+
+	ReleaseGilIfHeld(const ReleaseGilIfHeld &) = delete;
+	ReleaseGilIfHeld &operator=(const ReleaseGilIfHeld &) = delete;
+};
+
+// A sub-interpreter with its own GIL, which is held by the creating thread for the lifetime of this object.
+// Must be created in a thread that does not have a Python thread state yet, while the main interpreter has been
+// initialized. Only available with Python 3.12 or later.
+class SubInterpreter {
+	PyGILState_STATE main_gil_state;
+	PyThreadState *main_thread_state = nullptr;
+	PyThreadState *thread_state = nullptr;
+
+public:
+	static constexpr bool supported = PY_VERSION_HEX >= 0x030C0000;
+
+	SubInterpreter();
+	~SubInterpreter();
+
+	SubInterpreter(const SubInterpreter &) = delete;
+	SubInterpreter &operator=(const SubInterpreter &) = delete;
+};
+
+// A sub-interpreter with its own GIL, which the creating thread can enter and leave again, e.g. to keep several of them
+// in one thread. Must be created, entered and destroyed while the thread holds the GIL of the main interpreter.
+// Only available with Python 3.12 or later.
+class PooledInterpreter {
+	PyThreadState *thread_state = nullptr;
+
+public:
+	PooledInterpreter();
+	~PooledInterpreter();
+
+	PooledInterpreter(const PooledInterpreter &) = delete;
+	PooledInterpreter &operator=(const PooledInterpreter &) = delete;
+
+	// Switches from the main interpreter to this one for its lifetime, holding only this one's GIL
+	class Enter {
+		PyThreadState *main_thread_state;
+
+	public:
+		explicit Enter(PooledInterpreter &interpreter)
+		  : main_thread_state(PyEval_SaveThread())
+		{
+			PyEval_RestoreThread(interpreter.thread_state);
+		}
+
+		~Enter()
+		{
+			PyEval_SaveThread();
+			PyEval_RestoreThread(main_thread_state);
+		}
+
+		Enter(const Enter &) = delete;
+		Enter &operator=(const Enter &) = delete;
+	};
+};
+
 class Object {
 public:
 	Object() = default;
@@ -52,6 +178,41 @@ private:
 	PyObject *object = nullptr;
 };
 
+// A read-only view of the memory of an object that supports the buffer protocol (bytes, bytearray, memoryview, ...)
+class Buffer {
+	Py_buffer view = {};
+	bool valid = false;
+
+public:
+	Buffer() = default;
+
+	// Check for validity afterwards, a Python exception is set if it failed
+	explicit Buffer(PyObject *obj) : valid(PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) == 0) {}
+
+	~Buffer()
+	{
+		if (valid) {
+			PyBuffer_Release(&view);
+		}
+	}
+
+	Buffer(Buffer &&other) noexcept : view(other.view), valid(std::exchange(other.valid, false)) {}
+
+	Buffer &operator=(Buffer &&other) noexcept
+	{
+		std::swap(view, other.view);
+		std::swap(valid, other.valid);
+		return *this;
+	}
+
+	explicit operator bool() const { return valid; }
+
+	std::string_view View() const noexcept
+	{
+		return valid ? std::string_view(static_cast<const char *>(view.buf), view.len) : std::string_view();
+	}
+};
+
 Object
 wrap(PyObject *obj) noexcept;
 
@@ -61,6 +222,10 @@ uc_from_utf8(std::string_view str);
 Object
 uc_from_latin1(std::string_view str);
 
+// An interned str from ASCII, for dict keys that are used over and over again
+Object
+intern(std::string_view str);
+
 Object
 to_bytes(std::string_view str) noexcept;
 
@@ -79,4 +244,13 @@ add_sys_path(std::string_view path);
 Object
 import(std::string_view module_name) noexcept;
 
+// fork() with the interpreter's before/after fork hooks (os.register_at_fork), must be called with the GIL held
+pid_t
+fork() noexcept;
+
+// Runs a full collection and moves all surviving objects to the permanent generation, so the GC never touches (and
+// therefore never un-shares) pages inherited from a parent process.
+void
+gc_freeze();
+
 } // namespace Py
@@ -0,0 +1,117 @@
+#include "range.hxx"
+
+#include <algorithm>
+
+#include <fmt/format.h>
+
+#include <util/NumberParser.hxx>
+
+RangeRequest
+RangeRequest::Parse(std::string_view value, uint64_t size) noexcept
+{
+	constexpr std::string_view prefix = "bytes=";
+	if (!value.starts_with(prefix)) {
+		return {};
+	}
+	value.remove_prefix(prefix.size());
+
+	if (value.find(',') != std::string_view::npos) {
+		return {};
+	}
+
+	const auto dash = value.find('-');
+	if (dash == std::string_view::npos) {
+		return {};
+	}
+	const auto first = value.substr(0, dash);
+	const auto last = value.substr(dash + 1);
+
+	RangeRequest range;
+	if (first.empty()) {
+		// Suffix range: "bytes=-<length>"
+		const auto length = ParseInteger<uint64_t>(last);
+		if (!length) {
+			return {};
+		}
+		if (*length == 0 || size == 0) {
+			range.type = Type::UNSATISFIABLE;
+			return range;
+		}
+		range.start = size - std::min(*length, size);
+		range.end = size;
+	} else {
+		const auto start = ParseInteger<uint64_t>(first);
+		const auto end = last.empty() ? std::optional<uint64_t>(UINT64_MAX - 1) : ParseInteger<uint64_t>(last);
+		if (!start || !end || *end < *start) {
+			return {};
+		}
+		if (*start >= size) {
+			range.type = Type::UNSATISFIABLE;
+			return range;
+		}
+		range.start = *start;
+		// *end + 1 would overflow for a last-byte-pos of UINT64_MAX
+		range.end = *end >= size ? size : *end + 1;
+	}
+
+	range.type = Type::SATISFIABLE;
+	return range;
+}
+
+std::string
+RangeRequest::ContentRange(uint64_t size) const
+{
+	if (type == Type::SATISFIABLE) {
+		return fmt::format("bytes {}-{}/{}", start, end - 1, size);
+	}
+	return fmt::format("bytes */{}", size);
+}
+
+namespace {
+// If-Range requires a strong comparison (https://www.rfc-editor.org/rfc/rfc9110#section-13.1.5), so weak entity tags
+// and anything but an exact match of Last-Modified mean the representation may have changed.
+bool
+if_range_matches(const HttpResponse &response, std::string_view if_range) noexcept
+{
+	if (if_range.starts_with('"')) {
+		const auto etag = response.FindHeader("ETag");
+		return etag && *etag == if_range;
+	}
+	const auto last_modified = response.FindHeader("Last-Modified");
+	return last_modified && *last_modified == if_range;
+}
+}
+
+RangeRequest
+apply_range(HttpResponse &response, uint64_t size, std::optional<std::string_view> range,
+	    std::optional<std::string_view> if_range)
+{
+	RangeRequest result;
+	result.end = size;
+	response.content_length = size;
+
+	if (response.status != HTTP_STATUS_OK) {
+		return result;
+	}
+	if (!response.FindHeader("Accept-Ranges")) {
+		response.headers.emplace_back("Accept-Ranges", "bytes");
+	}
+	if (!range || (if_range && !if_range_matches(response, *if_range))) {
+		return result;
+	}
+
+	const auto parsed = RangeRequest::Parse(*range, size);
+	if (parsed.type == RangeRequest::Type::NONE) {
+		return result;
+	}
+
+	response.headers.emplace_back("Content-Range", parsed.ContentRange(size));
+	if (parsed.type == RangeRequest::Type::SATISFIABLE) {
+		response.status = HTTP_STATUS_PARTIAL_CONTENT;
+		response.content_length = parsed.Size();
+	} else {
+		response.status = HTTP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE;
+		response.content_length = 0;
+	}
+	return parsed;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "http.hxx"
+
+// Byte ranges (https://www.rfc-editor.org/rfc/rfc9110#section-14). Only single ranges are supported, requests for
+// multiple ranges are answered with the full response.
+struct RangeRequest {
+	enum class Type {
+		// No Range header, a syntax error or multiple ranges; send the full response
+		NONE,
+		SATISFIABLE,
+		// 416 Range Not Satisfiable
+		UNSATISFIABLE,
+	};
+
+	Type type = Type::NONE;
+	uint64_t start = 0;
+	// exclusive
+	uint64_t end = 0;
+
+	uint64_t Size() const noexcept { return end - start; }
+
+	// Parses the value of a Range header for a representation of `size` bytes
+	[[gnu::pure]] static RangeRequest Parse(std::string_view value, uint64_t size) noexcept;
+
+	// The value of the Content-Range header for a 206 or 416 response
+	std::string ContentRange(uint64_t size) const;
+};
+
+// Turns a 200 response for a representation of `size` bytes into a 206 or 416 response, as requested by the Range
+// header of a GET request, and announces range support with Accept-Ranges. A Range that does not match `if_range`
+// (the value of the If-Range header) is ignored. Returns the part of the representation to send.
+RangeRequest
+apply_range(HttpResponse &response, uint64_t size, std::optional<std::string_view> range,
+	    std::optional<std::string_view> if_range);
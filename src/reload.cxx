@@ -0,0 +1,262 @@
+#include "reload.hxx"
+#include "module.hxx"
+#include "python.hxx"
+
+#include <array>
+#include <cerrno>
+#include <cstdlib>
+#include <system_error>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+namespace {
+// IN_DONT_FOLLOW: a symlink may point to a directory above it, watching it would walk the tree forever
+constexpr uint32_t watch_mask =
+    IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+constexpr const char *unload_source = R"(
+import importlib
+import os
+import sys
+
+def unload(roots):
+    roots = tuple(os.path.join(root, "") for root in roots)
+    removed = {}
+    for name, module in list(sys.modules.items()):
+        path = getattr(module, "__file__", None)
+        if path and path.endswith(".py") and os.path.realpath(path).startswith(roots):
+            removed[name] = sys.modules.pop(name)
+    importlib.invalidate_caches()
+    return removed
+
+def restore(roots, removed):
+    # Drops what the failed import left behind
+    unload(roots)
+    sys.modules.update(removed)
+)";
+
+// Directories that never contain application code
+bool
+is_ignored_directory(std::string_view name) noexcept
+{
+	return name.starts_with('.') || name == "__pycache__" || name == "site-packages" || name == "dist-packages" ||
+	       name == "node_modules";
+}
+
+bool
+is_installed_packages(std::string_view path) noexcept
+{
+	return path.find("/site-packages") != std::string_view::npos ||
+	       path.find("/dist-packages") != std::string_view::npos;
+}
+
+// Some file systems don't report the type in the directory entry
+bool
+is_directory(DIR *dir, const struct dirent &entry) noexcept
+{
+	if (entry.d_type != DT_UNKNOWN) {
+		return entry.d_type == DT_DIR;
+	}
+	struct stat st;
+	return ::fstatat(::dirfd(dir), entry.d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+}
+
+SourceWatcher::SourceWatcher(std::vector<std::string> _roots) : roots(std::move(_roots))
+{
+	fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		throw std::system_error(errno, std::system_category(), "inotify_init1 failed");
+	}
+
+	try {
+		for (const auto &root : roots) {
+			AddTree(root);
+		}
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+}
+
+SourceWatcher::~SourceWatcher()
+{
+	::close(fd);
+}
+
+void
+SourceWatcher::AddTree(const std::string &path)
+{
+	const int wd = ::inotify_add_watch(fd, path.c_str(), watch_mask);
+	if (wd < 0) {
+		// Directories may disappear while we walk the tree
+		if (errno == ENOENT || errno == ENOTDIR || errno == EACCES) {
+			return;
+		}
+		throw std::system_error(errno, std::system_category(), fmt::format("Could not watch '{}'", path));
+	}
+	directories[wd] = path;
+
+	DIR *dir = ::opendir(path.c_str());
+	if (!dir) {
+		return;
+	}
+	while (const auto *entry = ::readdir(dir)) {
+		const std::string_view name = entry->d_name;
+		// Not following symlinks, so there are no loops
+		if (!is_ignored_directory(name) && is_directory(dir, *entry)) {
+			AddTree(path + "/" + entry->d_name);
+		}
+	}
+	::closedir(dir);
+}
+
+bool
+SourceWatcher::CheckChanged()
+{
+	bool changed = false;
+	alignas(struct inotify_event) std::array<char, 4096> buffer;
+	while (true) {
+		const auto n = ::read(fd, buffer.data(), buffer.size());
+		if (n < 0) {
+			if (errno == EAGAIN) {
+				return changed;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::system_error(errno, std::system_category(), "Could not read inotify events");
+		}
+
+		for (ssize_t i = 0; i < n;) {
+			const auto *event = reinterpret_cast<const struct inotify_event *>(buffer.data() + i);
+			i += sizeof(*event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				// We don't know what we missed
+				changed = true;
+				continue;
+			}
+			if (event->mask & IN_IGNORED) {
+				directories.erase(event->wd);
+				continue;
+			}
+
+			const std::string_view name = event->len > 0 ? event->name : "";
+			if (event->mask & IN_ISDIR) {
+				// A new directory may be a new package, but there is nothing to reload until it is
+				// imported
+				if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && !is_ignored_directory(name)) {
+					if (const auto it = directories.find(event->wd); it != directories.end()) {
+						AddTree(it->second + "/" + std::string(name));
+					}
+				}
+			} else if (name.ends_with(".py")) {
+				changed = true;
+			}
+		}
+	}
+}
+
+std::vector<std::string>
+get_application_roots(const std::vector<std::string_view> &sys_path)
+{
+	std::vector<std::string> roots;
+	for (const auto path : sys_path) {
+		char *real = ::realpath(std::string(path).c_str(), nullptr);
+		if (!real) {
+			continue;
+		}
+		std::string root(real);
+		std::free(real);
+		if (!is_installed_packages(root)) {
+			roots.push_back(std::move(root));
+		}
+	}
+	return roots;
+}
+
+void
+reload_application(const std::vector<std::string> &roots, const std::function<void()> &import)
+{
+	auto code = Py::wrap(Py_CompileString(unload_source, "<python_was_reload>", Py_file_input));
+	if (!code) {
+		Py::rethrow_python_exception();
+	}
+	auto module = Py::wrap(PyImport_ExecCodeModule("python_was_reload", code));
+	if (!module) {
+		Py::rethrow_python_exception();
+	}
+	auto unload = Py::wrap(PyObject_GetAttrString(module, "unload"));
+	auto restore = Py::wrap(PyObject_GetAttrString(module, "restore"));
+	auto py_roots = Py::wrap(PyList_New(0));
+	if (!unload || !restore || !py_roots) {
+		Py::rethrow_python_exception();
+	}
+	for (const auto &root : roots) {
+		auto py_root = Py::uc_from_utf8(root);
+		if (!py_root || PyList_Append(py_roots, py_root) < 0) {
+			Py::rethrow_python_exception();
+		}
+	}
+
+	// The application registers itself and its hooks again when it is imported
+	auto saved = Module::Reset();
+	auto removed = Py::wrap(PyObject_CallOneArg(unload, py_roots));
+	if (!removed) {
+		Module::Restore(std::move(saved));
+		Py::rethrow_python_exception();
+	}
+
+	try {
+		import();
+	} catch (...) {
+		PyObject *const args[] = { py_roots, removed };
+		auto result = Py::wrap(PyObject_Vectorcall(restore, args, 2, nullptr));
+		if (!result) {
+			PyErr_Clear();
+		}
+		Module::Restore(std::move(saved));
+		throw;
+	}
+}
+
+void
+ReloadingRequestHandler::Process(HttpRequest &&request, HttpResponder &responder)
+{
+	next->Process(std::move(request), responder);
+}
+
+void
+ReloadingRequestHandler::Prepare() noexcept
+{
+	try {
+		if (watcher.CheckChanged()) {
+			reload_pending = true;
+			last_attempt = {};
+		}
+	} catch (const std::exception &exc) {
+		fmt::print(stderr, "Could not check for modified source files: {}\n", exc.what());
+	}
+
+	if (reload_pending && Clock::now() - last_attempt >= retry_interval) {
+		last_attempt = Clock::now();
+		try {
+			std::unique_ptr<RequestHandler> new_next;
+			reload_application(watcher.Roots(), [&]() { new_next = factory(); });
+			next = std::move(new_next);
+			reload_pending = false;
+			fmt::print(stderr, "Reloaded the application\n");
+		} catch (const std::exception &exc) {
+			fmt::print(stderr, "Could not reload the application, keeping the old one: {}\n", exc.what());
+		}
+	}
+
+	next->Prepare();
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "http.hxx"
+
+// Watches the Python source files below some directories with inotify
+class SourceWatcher {
+	int fd = -1;
+	std::vector<std::string> roots;
+	// Watch descriptor -> directory
+	std::unordered_map<int, std::string> directories;
+
+	void AddTree(const std::string &path);
+
+public:
+	// The roots must be absolute and without symlinks
+	explicit SourceWatcher(std::vector<std::string> roots);
+	~SourceWatcher();
+
+	SourceWatcher(const SourceWatcher &) = delete;
+	SourceWatcher &operator=(const SourceWatcher &) = delete;
+
+	const std::vector<std::string> &Roots() const noexcept { return roots; }
+
+	// Reads all pending events without blocking. Returns true if a .py file has been written, created, moved or
+	// deleted since the last call.
+	bool CheckChanged();
+};
+
+// The directories of `sys_path` that contain application code, i.e. not site-packages: absolute and without symlinks
+std::vector<std::string>
+get_application_roots(const std::vector<std::string_view> &sys_path);
+
+// Removes all modules that were imported from .py files below `roots` from sys.modules and calls `import`, which
+// imports the application again. Modules imported from elsewhere (the standard library, site-packages, extension
+// modules) are kept. If `import` throws, the old modules and the registrations with cm4all_python_was are restored, so
+// the old application keeps working, and the exception is rethrown.
+void
+reload_application(const std::vector<std::string> &roots, const std::function<void()> &import);
+
+// Checks for modified source files between requests, in Prepare(), so the time to import the application again is not
+// part of any request. If there are any, the application is reloaded and the handler is replaced with a new one from
+// the factory. If that fails, the old handler is kept and the reload is tried again before later requests, at most
+// once per retry_interval, until it succeeds.
+// Not thread-safe, every thread needs its own instance.
+class ReloadingRequestHandler final : public RequestHandler {
+public:
+	using Factory = std::function<std::unique_ptr<RequestHandler>()>;
+
+private:
+	using Clock = std::chrono::steady_clock;
+	static constexpr Clock::duration retry_interval = std::chrono::seconds(1);
+
+	std::unique_ptr<RequestHandler> next;
+	SourceWatcher watcher;
+	Factory factory;
+	// Set from a change until a reload has succeeded
+	bool reload_pending = false;
+	Clock::time_point last_attempt;
+
+public:
+	ReloadingRequestHandler(std::unique_ptr<RequestHandler> next, std::vector<std::string> roots, Factory factory)
+	  : next(std::move(next))
+	  , watcher(std::move(roots))
+	  , factory(std::move(factory))
+	{
+	}
+
+	void Process(HttpRequest &&request, HttpResponder &responder) override;
+	void Prepare() noexcept override;
+};
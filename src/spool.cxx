@@ -0,0 +1,108 @@
+#include "spool.hxx"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+// Read pages are unmapped in steps of this size
+constexpr uint64_t release_step = 1024 * 1024;
+}
+
+SpooledInputStream::SpooledInputStream(int fd, uint64_t size) : InputStream(size), fd(fd), size(size)
+{
+	if (size == 0) {
+		return;
+	}
+	void *p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		const int e = errno;
+		::close(fd);
+		throw std::system_error(e, std::system_category(), "Could not map spooled request body");
+	}
+	map = static_cast<char *>(p);
+	::madvise(map, size, MADV_SEQUENTIAL);
+}
+
+SpooledInputStream::~SpooledInputStream()
+{
+	if (map) {
+		::munmap(map, size);
+	}
+	::close(fd);
+}
+
+size_t
+SpooledInputStream::Read(std::span<char> dest)
+{
+	const auto n = static_cast<size_t>(std::min<uint64_t>(dest.size(), size - position));
+	if (n == 0) {
+		return 0;
+	}
+	std::memcpy(dest.data(), map + position, n);
+	position += n;
+
+	// Offsets in the mapping are page aligned as long as release_step is a multiple of the page size
+	if (position - released >= release_step) {
+		const auto length = (position - released) / release_step * release_step;
+		::madvise(map + released, length, MADV_DONTNEED);
+		released += length;
+	}
+	return n;
+}
+
+int
+SpoolingRequestHandler::CreateFile() const
+{
+	if (config.directory.empty()) {
+		const int fd = ::memfd_create("python-was-body", MFD_CLOEXEC);
+		if (fd < 0) {
+			throw std::system_error(errno, std::system_category(),
+						"Could not create memfd for request body");
+		}
+		return fd;
+	}
+
+	const int fd = ::open(config.directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0) {
+		return fd;
+	}
+	if (errno != EOPNOTSUPP && errno != EISDIR) {
+		throw std::system_error(errno, std::system_category(), "Could not create file for request body");
+	}
+
+	// The file system does not support O_TMPFILE
+	std::string path = config.directory + "/python-was-body-XXXXXX";
+	const int tmp_fd = ::mkostemp(path.data(), O_CLOEXEC);
+	if (tmp_fd < 0) {
+		throw std::system_error(errno, std::system_category(), "Could not create file for request body");
+	}
+	::unlink(path.c_str());
+	return tmp_fd;
+}
+
+void
+SpoolingRequestHandler::Process(HttpRequest &&request, HttpResponder &responder)
+{
+	if (request.body) {
+		const auto content_length = request.body->ContentLength();
+		if (!content_length || *content_length > config.threshold) {
+			const int fd = CreateFile();
+			uint64_t size;
+			try {
+				size = request.body->CopyTo(fd);
+			} catch (...) {
+				::close(fd);
+				throw;
+			}
+			request.body = std::make_unique<SpooledInputStream>(fd, size);
+		}
+	}
+	next->Process(std::move(request), responder);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "http.hxx"
+
+struct SpoolConfig {
+	// Request bodies larger than this many bytes (and all bodies of unknown length) are spooled, 0 disables it
+	uint64_t threshold = 0;
+	// Where the files are created. If empty they are memfds, which don't bound the memory a process needs: Their
+	// pages are only written out to swap.
+	std::string directory = "/var/tmp";
+};
+
+// Reads a spooled request body from a memory mapping of its file. Pages that have been read are unmapped again,
+// so they don't add up in the RSS of the process.
+class SpooledInputStream final : public InputStream {
+	int fd;
+	char *map = nullptr;
+	uint64_t size;
+	uint64_t position = 0;
+	// Everything before this offset has been unmapped with MADV_DONTNEED
+	uint64_t released = 0;
+
+public:
+	// Takes ownership of the file descriptor
+	SpooledInputStream(int fd, uint64_t size);
+	~SpooledInputStream() override;
+
+	SpooledInputStream(const SpooledInputStream &) = delete;
+	SpooledInputStream &operator=(const SpooledInputStream &) = delete;
+
+	size_t Read(std::span<char> dest) override;
+};
+
+// Copies large request bodies into an unlinked file before the application is called, so the size of a request
+// (e.g. an upload) doesn't determine how much memory the process needs. The application then also gets a
+// Content-Length for bodies that were sent without one.
+class SpoolingRequestHandler final : public RequestHandler {
+	std::unique_ptr<RequestHandler> next;
+	SpoolConfig config;
+
+	int CreateFile() const;
+
+public:
+	SpoolingRequestHandler(std::unique_ptr<RequestHandler> next, SpoolConfig config)
+	  : next(std::move(next))
+	  , config(std::move(config))
+	{
+	}
+
+	void Process(HttpRequest &&request, HttpResponder &responder) override;
+	void Prepare() noexcept override { next->Prepare(); }
+};
@@ -0,0 +1,263 @@
+#include "static_files.hxx"
+#include "offload.hxx"
+#include "python.hxx"
+#include "range.hxx"
+
+#include <util/CharUtil.hxx>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+void
+StaticConfig::AddMount(std::string_view spec)
+{
+	const auto eq = spec.find('=');
+	if (eq == std::string_view::npos || !spec.starts_with('/')) {
+		throw std::runtime_error(fmt::format("Invalid static mount '{}', expected <prefix>=<dir>", spec));
+	}
+
+	std::string prefix(spec.substr(0, eq));
+	if (!prefix.ends_with('/')) {
+		prefix.push_back('/');
+	}
+	const std::string dir(spec.substr(eq + 1));
+	auto root = real_path(dir);
+	if (!root) {
+		throw std::system_error(errno, std::system_category(), fmt::format("Invalid static root '{}'", dir));
+	}
+	mounts.push_back(Mount{ std::move(prefix), std::move(*root) });
+}
+
+namespace {
+constexpr std::array<std::pair<std::string_view, std::string_view>, 28> content_types{ {
+	{ "avif", "image/avif" },
+	{ "css", "text/css; charset=utf-8" },
+	{ "csv", "text/csv; charset=utf-8" },
+	{ "gif", "image/gif" },
+	{ "htm", "text/html; charset=utf-8" },
+	{ "html", "text/html; charset=utf-8" },
+	{ "ico", "image/vnd.microsoft.icon" },
+	{ "jpeg", "image/jpeg" },
+	{ "jpg", "image/jpeg" },
+	{ "js", "text/javascript; charset=utf-8" },
+	{ "json", "application/json" },
+	{ "map", "application/json" },
+	{ "mjs", "text/javascript; charset=utf-8" },
+	{ "mp3", "audio/mpeg" },
+	{ "mp4", "video/mp4" },
+	{ "otf", "font/otf" },
+	{ "pdf", "application/pdf" },
+	{ "png", "image/png" },
+	{ "svg", "image/svg+xml" },
+	{ "ttf", "font/ttf" },
+	{ "txt", "text/plain; charset=utf-8" },
+	{ "wasm", "application/wasm" },
+	{ "webm", "video/webm" },
+	{ "webmanifest", "application/manifest+json" },
+	{ "webp", "image/webp" },
+	{ "woff", "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "xml", "application/xml" },
+} };
+
+std::string_view
+content_type_for(std::string_view name) noexcept
+{
+	const auto dot = name.rfind('.');
+	const auto slash = name.rfind('/');
+	if (dot == std::string_view::npos || (slash != std::string_view::npos && dot < slash)) {
+		return "application/octet-stream";
+	}
+
+	std::string extension(name.substr(dot + 1));
+	for (auto &ch : extension) {
+		ch = ToLowerASCII(ch);
+	}
+	for (const auto &[ext, type] : content_types) {
+		if (ext == extension) {
+			return type;
+		}
+	}
+	return "application/octet-stream";
+}
+
+// The IMF-fixdate of https://www.rfc-editor.org/rfc/rfc9110#section-5.6.7, independent of the locale
+std::string
+http_date(time_t t)
+{
+	static constexpr std::array<std::string_view, 7> days{ "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	static constexpr std::array<std::string_view, 12> months{ "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+								 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	struct tm tm;
+	::gmtime_r(&t, &tm);
+	return fmt::format("{}, {:02} {} {} {:02}:{:02}:{:02} GMT", days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon],
+			   tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+// If-None-Match uses the weak comparison (https://www.rfc-editor.org/rfc/rfc9110#section-13.1.2)
+bool
+etag_list_matches(std::string_view list, std::string_view etag) noexcept
+{
+	while (!list.empty()) {
+		const auto comma = list.find(',');
+		auto tag = StripWhitespace(list.substr(0, comma));
+		list = comma == std::string_view::npos ? std::string_view{} : list.substr(comma + 1);
+		if (tag == "*") {
+			return true;
+		}
+		if (tag.starts_with("W/")) {
+			tag.remove_prefix(2);
+		}
+		if (tag == etag) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool
+same_file(const struct stat &st, dev_t dev, ino_t ino, uint64_t size, const struct timespec &mtime) noexcept
+{
+	return S_ISREG(st.st_mode) && st.st_dev == dev && st.st_ino == ino &&
+	       static_cast<uint64_t>(st.st_size) == size && st.st_mtim.tv_sec == mtime.tv_sec &&
+	       st.st_mtim.tv_nsec == mtime.tv_nsec;
+}
+}
+
+StaticFileRequestHandler::File::~File()
+{
+	::close(fd);
+}
+
+std::shared_ptr<const StaticFileRequestHandler::File>
+StaticFileRequestHandler::OpenFile(const StaticConfig::Mount &mount, std::string_view relative)
+{
+	const auto path = real_path(mount.root + "/" + std::string(relative));
+	if (!path || !is_below(*path, mount.root)) {
+		return nullptr;
+	}
+
+	const int fd = ::open(path->c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd < 0) {
+		return nullptr;
+	}
+	auto file = std::make_shared<File>(fd);
+
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		return nullptr;
+	}
+
+	file->path = std::move(*path);
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+	file->size = static_cast<uint64_t>(st.st_size);
+	file->mtime = st.st_mtim;
+	file->etag = fmt::format("\"{:x}-{:x}-{:x}{:08x}\"", st.st_ino, st.st_size, st.st_mtim.tv_sec,
+				 st.st_mtim.tv_nsec);
+	file->last_modified = http_date(st.st_mtim.tv_sec);
+	file->content_type = content_type_for(relative);
+	return file;
+}
+
+std::shared_ptr<const StaticFileRequestHandler::File>
+StaticFileRequestHandler::Lookup(const StaticConfig::Mount &mount, std::string_view request_path)
+{
+	std::shared_ptr<const File> cached;
+	{
+		const std::lock_guard lock(mutex);
+		if (const auto it = index.find(request_path); it != index.end()) {
+			entries.splice(entries.begin(), entries, it->second);
+			cached = it->second->file;
+		}
+	}
+
+	// Much cheaper than resolving and opening the file again
+	struct stat st;
+	if (cached && ::stat(cached->path.c_str(), &st) == 0 &&
+	    same_file(st, cached->dev, cached->ino, cached->size, cached->mtime)) {
+		return cached;
+	}
+
+	auto file = OpenFile(mount, request_path.substr(mount.prefix.size()));
+
+	const std::lock_guard lock(mutex);
+	if (const auto it = index.find(request_path); it != index.end()) {
+		const auto entry = it->second;
+		index.erase(it);
+		entries.erase(entry);
+	}
+	if (file && config.max_open_files > 0) {
+		while (entries.size() >= config.max_open_files) {
+			index.erase(entries.back().key);
+			entries.pop_back();
+		}
+		entries.push_front(Entry{ std::string(request_path), file });
+		index.emplace(entries.front().key, entries.begin());
+	}
+	return file;
+}
+
+void
+StaticFileRequestHandler::Send(const HttpRequest &request, const File &file, HttpResponder &responder)
+{
+	HttpResponse response{
+		.status = HTTP_STATUS_OK,
+		.headers = std::pmr::vector<HttpResponse::Header>(request.arena),
+	};
+	response.headers.emplace_back("ETag", file.etag);
+	response.headers.emplace_back("Last-Modified", file.last_modified);
+
+	// If-Modified-Since is only compared with our own Last-Modified, which clients send back unchanged
+	const auto if_none_match = request.FindHeader("If-None-Match");
+	const auto if_modified_since = request.FindHeader("If-Modified-Since");
+	if (if_none_match ? etag_list_matches(*if_none_match, file.etag)
+			  : if_modified_since && *if_modified_since == file.last_modified) {
+		response.status = HTTP_STATUS_NOT_MODIFIED;
+		response.content_length = 0;
+		responder.SendHeaders(std::move(response));
+		return;
+	}
+
+	response.headers.emplace_back("Content-Type", file.content_type);
+	const bool get = request.method == HTTP_METHOD_GET;
+	const auto range =
+	    apply_range(response, file.size, get ? request.FindHeader("Range") : std::nullopt,
+			get ? request.FindHeader("If-Range") : std::nullopt);
+	responder.SendHeaders(std::move(response));
+	if (get && range.type != RangeRequest::Type::UNSATISFIABLE && range.Size() > 0) {
+		responder.SendFile(file.fd, range.start, range.Size());
+	}
+}
+
+void
+StaticFileRequestHandler::Process(HttpRequest &&request, HttpResponder &responder)
+{
+	const auto path = request.uri.path;
+	const auto mount = std::find_if(config.mounts.begin(), config.mounts.end(), [path](const auto &m) {
+		return path.starts_with(m.prefix);
+	});
+	if ((request.method != HTTP_METHOD_GET && request.method != HTTP_METHOD_HEAD) || mount == config.mounts.end()) {
+		next->Process(std::move(request), responder);
+		return;
+	}
+
+	{
+		const Py::ReleaseGilIfHeld release;
+		if (const auto file = Lookup(*mount, path)) {
+			Send(request, *file, responder);
+			return;
+		}
+	}
+	next->Process(std::move(request), responder);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "http.hxx"
+
+struct StaticConfig {
+	struct Mount {
+		// Starts and ends with a slash
+		std::string prefix;
+		// Absolute and without symlinks
+		std::string root;
+	};
+
+	std::vector<Mount> mounts;
+	// The number of files that are kept open
+	size_t max_open_files = 1024;
+
+	// Parses "<prefix>=<dir>"
+	void AddMount(std::string_view spec);
+};
+
+// Serves GET and HEAD requests for files below the configured path prefixes from their document roots, without
+// calling the application and without holding the GIL. The files are kept open together with their ETag and
+// Last-Modified headers and are only opened again when stat() shows that they have changed. Requests for files that
+// don't exist are passed on to the application, which may have its own ways to find them.
+class StaticFileRequestHandler final : public RequestHandler {
+	struct File {
+		int fd;
+		// Where the file was found, to check whether it has changed
+		std::string path;
+		dev_t dev;
+		ino_t ino;
+		uint64_t size;
+		struct timespec mtime;
+		std::string etag;
+		std::string last_modified;
+		std::string_view content_type;
+
+		File(int fd) : fd(fd) {}
+		~File();
+
+		File(const File &) = delete;
+		File &operator=(const File &) = delete;
+	};
+
+	struct Entry {
+		std::string key;
+		std::shared_ptr<const File> file;
+	};
+
+	std::unique_ptr<RequestHandler> next;
+	StaticConfig config;
+
+	std::mutex mutex;
+	// Most recently used first
+	std::list<Entry> entries;
+	std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+
+	static std::shared_ptr<const File> OpenFile(const StaticConfig::Mount &mount, std::string_view relative);
+	std::shared_ptr<const File> Lookup(const StaticConfig::Mount &mount, std::string_view request_path);
+
+	void Send(const HttpRequest &request, const File &file, HttpResponder &responder);
+
+public:
+	StaticFileRequestHandler(std::unique_ptr<RequestHandler> next, StaticConfig config)
+	  : next(std::move(next))
+	  , config(std::move(config))
+	{
+	}
+
+	void Process(HttpRequest &&request, HttpResponder &responder) override;
+	void Prepare() noexcept override { next->Prepare(); }
+};
@@ -1,4 +1,8 @@
 #include "was.hxx"
+#include "memory.hxx"
+#include "metrics.hxx"
+#include "python.hxx"
+#include "watchdog.hxx"
 
 #include <http/header.h>
 #include <util/NumberParser.hxx>
@@ -6,108 +10,351 @@
 
 #include <fmt/format.h>
 
-namespace {
-// This is a WasInputStream as opposed to a FdInputStream, because we need to call was_simple_received, even if we were
-// reading from the fd directly and not using was_simple_read.
-class WasInputStream : public InputStream {
-	struct was_simple *was;
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
 
-public:
-	WasInputStream(struct was_simple *was, std::optional<uint64_t> content_length)
-	  : InputStream(content_length)
-	  , was(was)
-	{
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+int
+create_eventfd()
+{
+	const int fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd < 0) {
+		throw std::system_error(errno, std::system_category(), "Could not create eventfd");
 	}
+	return fd;
+}
 
-	size_t Read(std::span<char> dest) override
-	{
-		// We want to do a blocking read, so we use was_simpe_read
-		const auto n = was_simple_read(was, dest.data(), dest.size());
-		if (n == -2) {
-			throw std::runtime_error("Error in was_simple_read");
-		}
-		if (n == -1) {
-			throw std::system_error(errno, std::system_category());
+WasInputStream::~WasInputStream()
+{
+	// Don't leave the signal behind for the next request
+	if (cancelled) {
+		uint64_t value;
+		[[maybe_unused]] const auto n = ::read(cancel_fd, &value, sizeof(value));
+	}
+}
+
+bool
+WasInputStream::WaitReadable()
+{
+	// was_simple_input_poll() handles the control channel as well, so the input may be ready when either is
+	std::array<struct pollfd, 3> fds{ {
+		{ .fd = control_fd, .events = POLLIN, .revents = 0 },
+		{ .fd = was_simple_input_fd(was), .events = POLLIN, .revents = 0 },
+		{ .fd = cancel_fd, .events = POLLIN, .revents = 0 },
+	} };
+	while (::poll(fds.data(), fds.size(), -1) < 0) {
+		if (errno != EINTR) {
+			throw std::system_error(errno, std::system_category(), "poll() failed");
 		}
-		assert(n >= 0);
-		return static_cast<size_t>(n);
 	}
-};
+	return !cancelled;
+}
 
-// You must create a separate object for each request!
-struct WasResponder : public HttpResponder {
-	struct was_simple *was;
-	std::optional<uint64_t> content_length_left = 0;
+void
+WasInputStream::Cancel() noexcept
+{
+	cancelled = true;
+	const uint64_t one = 1;
+	[[maybe_unused]] const auto n = ::write(cancel_fd, &one, sizeof(one));
+}
 
-	WasResponder(struct was_simple *was) : was(was) {}
+size_t
+WasInputStream::Read(std::span<char> dest)
+{
+	// Background threads of the application can run while we wait for the client
+	const Py::ReleaseGilIfHeld release;
+	if (cancelled) {
+		return 0;
+	}
+	switch (was_simple_input_poll(was, 0)) {
+	case WAS_SIMPLE_POLL_SUCCESS: break;
+	// The whole body has been received, none of the file descriptors will become readable again
+	case WAS_SIMPLE_POLL_END: return 0;
+	case WAS_SIMPLE_POLL_TIMEOUT:
+		if (!WaitReadable()) {
+			return 0;
+		}
+		break;
+	// Reported by was_simple_read
+	case WAS_SIMPLE_POLL_ERROR:
+	case WAS_SIMPLE_POLL_CLOSED: break;
+	}
+	// We want to do a blocking read, so we use was_simpe_read
+	const auto n = was_simple_read(was, dest.data(), dest.size());
+	if (n == -2) {
+		throw std::runtime_error("Error in was_simple_read");
+	}
+	if (n == -1) {
+		throw std::system_error(errno, std::system_category());
+	}
+	assert(n >= 0);
+	return static_cast<size_t>(n);
+}
 
-	void SendHeadersImpl(HttpResponse &&response) override
-	{
-		assert(http_status_is_valid(response.status));
+uint64_t
+WasInputStream::CopyTo(int fd)
+{
+	static constexpr size_t max_splice = 1024 * 1024;
 
-		if (!was_simple_status(was, response.status)) {
-			throw std::runtime_error("Error in was_simple_status");
+	const Py::ReleaseGilIfHeld release;
+	const int in_fd = was_simple_input_fd(was);
+	uint64_t total = 0;
+
+	while (true) {
+		switch (was_simple_input_poll(was, -1)) {
+		case WAS_SIMPLE_POLL_SUCCESS: break;
+		case WAS_SIMPLE_POLL_END: return total;
+		case WAS_SIMPLE_POLL_TIMEOUT: continue;
+		case WAS_SIMPLE_POLL_ERROR: throw std::runtime_error("Error in was_simple_input_poll");
+		case WAS_SIMPLE_POLL_CLOSED: throw std::runtime_error("Request body was closed prematurely");
 		}
 
-		for (const auto &[name, value] : response.headers) {
-			if (!was_simple_set_header_n(was, name.data(), name.size(), value.data(), value.size())) {
-				throw std::runtime_error("was_simple_set_header_n failed");
+		// Never take more from the pipe than belongs to this request
+		const auto remaining = was_simple_input_remaining(was);
+		const size_t to_splice = remaining >= 0 ? std::min<uint64_t>(remaining, max_splice) : max_splice;
+		const auto n = ::splice(in_fd, nullptr, fd, nullptr, to_splice, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+			if (errno == EINVAL && total == 0) {
+				// The file system does not support splice, so we have to copy
+				return InputStream::CopyTo(fd);
 			}
+			throw std::system_error(errno, std::system_category(), "Error splicing request body to file");
+		}
+		if (n == 0) {
+			throw std::runtime_error("Request body was closed prematurely");
+		}
+
+		if (!was_simple_received(was, n)) {
+			throw std::runtime_error("was_simple_received failed");
+		}
+		total += n;
+	}
+}
+
+void
+WasResponder::SendHeadersImpl(HttpResponse &&response)
+{
+	const Py::ReleaseGilIfHeld release;
+	assert(http_status_is_valid(response.status));
+
+	if (!was_simple_status(was, response.status)) {
+		throw std::runtime_error("Error in was_simple_status");
+	}
+
+	for (const auto &[name, value] : response.headers) {
+		if (!was_simple_set_header_n(was, name.data(), name.size(), value.data(), value.size())) {
+			throw std::runtime_error("was_simple_set_header_n failed");
 		}
+	}
+
+	content_length_left = response.content_length;
+
+	if (response.content_length == 0) {
+		if (!was_simple_end(was)) {
+			throw std::runtime_error("was_simple_end failed");
+		}
+	} else if (response.content_length) {
+		// This should be done early, but the state won't match if I do it any earlier than here
+		if (!was_simple_set_length(was, *response.content_length)) {
+			throw std::runtime_error("was_simple_set_length failed");
+		}
+	}
+}
+
+void
+WasResponder::End()
+{
+	// Responses with a Content-Length end with its last byte
+	if (!HeadersSent() || content_length_left) {
+		return;
+	}
 
-		content_length_left = response.content_length;
+	const Py::ReleaseGilIfHeld release;
+	if (!was_simple_end(was)) {
+		throw std::runtime_error("was_simple_end failed");
+	}
+}
 
-		if (response.content_length == 0) {
-			if (!was_simple_end(was)) {
-				throw std::runtime_error("was_simple_end failed");
+void
+WasResponder::SendBodyImpl(std::string_view body_data)
+{
+	const Py::ReleaseGilIfHeld release;
+	const PhaseTimer timer(Phase::SEND);
+	if (body_data.size() == 0 && content_length_left == 0) {
+		// If the initial Content-Length was 0, we have already called was_simple_end,
+		// so we must not call was_simple_write, even with length = 0.
+		return;
+	}
+
+	const auto write_len =
+	    content_length_left ? std::min(*content_length_left, body_data.size()) : body_data.size();
+
+	if (!was_simple_write(was, body_data.data(), write_len)) {
+		throw std::runtime_error("was_simple_write failed");
+	}
+
+	if (content_length_left) {
+		if (body_data.size() > content_length_left) {
+			throw std::runtime_error(
+			    fmt::format("Attempting to send {} bytes, but only {} bytes left to sent", body_data.size(),
+					*content_length_left));
+		}
+		*content_length_left -= body_data.size();
+	}
+}
+
+void
+WasResponder::SendBodyChunksImpl(std::span<const std::string_view> chunks)
+{
+	const Py::ReleaseGilIfHeld release;
+	const PhaseTimer timer(Phase::SEND);
+	std::array<struct iovec, 64> iov;
+	uint64_t total = 0;
+	for (const auto chunk : chunks) {
+		total += chunk.size();
+	}
+
+	if (total == 0 && content_length_left == 0) {
+		// See SendBodyImpl
+		return;
+	}
+
+	const int fd = was_simple_output_fd(was);
+	uint64_t write_left = content_length_left ? std::min(*content_length_left, total) : total;
+	auto next = chunks.begin();
+	size_t next_offset = 0;
+
+	while (write_left > 0) {
+		// Fill the iovec array from where the last writev() stopped
+		size_t num_iov = 0;
+		uint64_t iov_size = 0;
+		for (auto it = next; it != chunks.end() && num_iov < iov.size() && iov_size < write_left; ++it) {
+			const auto data = it->substr(it == next ? next_offset : 0);
+			if (data.empty()) {
+				continue;
 			}
-		} else if (response.content_length) {
-			// This should be done early, but the state won't match if I do it any earlier than here
-			if (!was_simple_set_length(was, *response.content_length)) {
-				throw std::runtime_error("was_simple_set_length failed");
+			const auto len = std::min<uint64_t>(data.size(), write_left - iov_size);
+			iov[num_iov++] = { .iov_base = const_cast<char *>(data.data()), .iov_len = len };
+			iov_size += len;
+		}
+
+		switch (was_simple_output_poll(was, -1)) {
+		case WAS_SIMPLE_POLL_SUCCESS: break;
+		case WAS_SIMPLE_POLL_ERROR: throw std::runtime_error("Error in was_simple_output_poll");
+		case WAS_SIMPLE_POLL_TIMEOUT: continue;
+		case WAS_SIMPLE_POLL_END:
+		case WAS_SIMPLE_POLL_CLOSED: throw std::runtime_error("Response body was closed by the WAS client");
+		}
+
+		const auto n = ::writev(fd, iov.data(), num_iov);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
 			}
+			throw std::system_error(errno, std::system_category(), "Error writing response body");
+		}
+
+		if (!was_simple_sent(was, n)) {
+			throw std::runtime_error("was_simple_sent failed");
 		}
+		write_left -= n;
+
+		// Skip what has been written
+		auto written = static_cast<size_t>(n);
+		while (next != chunks.end() && written >= next->size() - next_offset) {
+			written -= next->size() - next_offset;
+			++next;
+			next_offset = 0;
+		}
+		next_offset += written;
 	}
 
-	// Needs to be called before SendHeaders
-	void SendBodyImpl(std::string_view body_data) override
-	{
-		if (body_data.size() == 0 && content_length_left == 0) {
-			// If the initial Content-Length was 0, we have already called was_simple_end,
-			// so we must not call was_simple_write, even with length = 0.
-			return;
+	if (content_length_left) {
+		if (total > content_length_left) {
+			throw std::runtime_error(
+			    fmt::format("Attempting to send {} bytes, but only {} bytes left to sent", total,
+					*content_length_left));
 		}
+		*content_length_left -= total;
+	}
+}
 
-		const auto write_len =
-		    content_length_left ? std::min(*content_length_left, body_data.size()) : body_data.size();
+void
+WasResponder::SendFileImpl(int fd, uint64_t offset, uint64_t length)
+{
+	const Py::ReleaseGilIfHeld release;
+	const PhaseTimer timer(Phase::SEND);
+	if (length == 0 && content_length_left == 0) {
+		// See SendBodyImpl
+		return;
+	}
+
+	const int out_fd = was_simple_output_fd(was);
+	auto position = static_cast<loff_t>(offset);
+	uint64_t write_left = content_length_left ? std::min(*content_length_left, length) : length;
 
-		if (!was_simple_write(was, body_data.data(), write_len)) {
-			throw std::runtime_error("was_simple_write failed");
+	while (write_left > 0) {
+		switch (was_simple_output_poll(was, -1)) {
+		case WAS_SIMPLE_POLL_SUCCESS: break;
+		case WAS_SIMPLE_POLL_ERROR: throw std::runtime_error("Error in was_simple_output_poll");
+		case WAS_SIMPLE_POLL_TIMEOUT: continue;
+		case WAS_SIMPLE_POLL_END:
+		case WAS_SIMPLE_POLL_CLOSED: throw std::runtime_error("Response body was closed by the WAS client");
 		}
 
-		if (content_length_left) {
-			if (body_data.size() > content_length_left) {
-				throw std::runtime_error(
-				    fmt::format("Attempting to send {} bytes, but only {} bytes left to sent",
-						body_data.size(),
-						*content_length_left));
+		const auto n = ::splice(fd, &position, out_fd, nullptr, write_left, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
 			}
-			*content_length_left -= body_data.size();
+			if (errno == EINVAL && static_cast<uint64_t>(position) == offset) {
+				// The file system does not support splice, so we have to copy
+				HttpResponder::SendFileImpl(fd, offset, length);
+				return;
+			}
+			throw std::system_error(errno, std::system_category(), "Error splicing file to response body");
+		}
+		if (n == 0) {
+			throw std::runtime_error("File is shorter than expected");
+		}
+
+		if (!was_simple_sent(was, n)) {
+			throw std::runtime_error("was_simple_sent failed");
 		}
+		write_left -= n;
+	}
+
+	if (content_length_left) {
+		if (length > content_length_left) {
+			throw std::runtime_error(
+			    fmt::format("Attempting to send {} bytes, but only {} bytes left to sent", length,
+					*content_length_left));
+		}
+		*content_length_left -= length;
 	}
-};
 }
 
-void
-Was::ProcessRequest(RequestHandler &handler, std::string_view uri) noexcept
+std::optional<HttpRequest>
+Was::ReadRequest(std::string_view uri) noexcept
 {
+	const PhaseTimer timer(Phase::READ_REQUEST);
+
 	const auto method = was_simple_get_method(was);
 	if (method == HTTP_METHOD_INVALID) {
 		fmt::print(stderr, "Invalid method: {}\n", fmt::underlying(method));
 		if (!was_simple_status(was, HTTP_STATUS_METHOD_NOT_ALLOWED)) {
 			fmt::print(stderr, "Error in was_simple_status\n");
 		}
-		return;
+		return std::nullopt;
 	}
 
 	const auto remote_host = was_simple_get_remote_host(was);
@@ -120,8 +367,10 @@ Was::ProcessRequest(RequestHandler &handler, std::string_view uri) noexcept
 	const auto remote_host_sv = remote_host ? std::string_view(remote_host) : std::string_view();
 	const auto remote_addr = remote_host_sv.substr(0, remote_host_sv.find(':'));
 
+	arena.Reset();
+
 	HttpRequest request{
-		.remote_addr = std::string(remote_addr),
+		.remote_addr = remote_addr,
 		.script_name = script_name ? script_name : "",
 		.server_name = "localhost",
 		.server_port = "80",
@@ -137,6 +386,10 @@ Was::ProcessRequest(RequestHandler &handler, std::string_view uri) noexcept
 			.path = path ? path : parsed_uri.path,
 			.query = query ? query : parsed_uri.query,
 		    },
+		.headers = std::pmr::vector<HttpRequest::Header>(arena.Get()),
+		.parameters = std::pmr::vector<HttpRequest::Header>(arena.Get()),
+		.body = {},
+		.arena = arena.Get(),
 	};
 
 	auto it = was_simple_get_header_iterator(was);
@@ -157,6 +410,12 @@ Was::ProcessRequest(RequestHandler &handler, std::string_view uri) noexcept
 	}
 	was_simple_iterator_free(it);
 
+	it = was_simple_get_parameter_iterator(was);
+	while ((elem = was_simple_iterator_next(it))) {
+		request.parameters.emplace_back(elem->name, elem->value);
+	}
+	was_simple_iterator_free(it);
+
 	if (request.server_port.empty()) {
 		request.server_port = request.scheme == "https" ? "443" : "80";
 	}
@@ -168,30 +427,35 @@ Was::ProcessRequest(RequestHandler &handler, std::string_view uri) noexcept
 		const auto input_remaining = was_simple_input_remaining(was);
 		const auto input_remaining_opt =
 		    input_remaining >= 0 ? std::optional<uint64_t>(input_remaining) : std::nullopt;
-		request.body = std::make_unique<WasInputStream>(was, input_remaining_opt);
+		request.body = std::make_unique<WasInputStream>(was, GetControlFd(), cancel_fd, input_remaining_opt);
 	}
 
-	WasResponder responder{ was };
-	try {
-		handler.Process(std::move(request), responder);
-	} catch (std::exception &exc) {
-		// If was_simple_status, was_simple_set_header, etc. fail, the cause is either a programming error or an
-		// IO Error on the command channel, in which case it doesn't make sense to do anything else and we will
-		// likely terminate soon.
-		// I log the errors for each function in case it was a programming error (wrong state).
-		// In the case of an IO Error, was_simple_accept will clean up the current request and either fail
-		// itself in which case we gracefully terminate the loop in `Run` and exit the program or it will clean
-		// up the current request and try another one.
-		// We don't know what kind of exception we got, so it's possible a was_simple_* function failed, but
-		// was_simple_abort will not do anything if the state is ERROR, so in case it was something else, we
-		// abort the request here.
-		fmt::print(stderr, "Exception handling request: {}\n", exc.what());
-		if (!was_simple_abort(was)) {
-			fmt::print(stderr, "Error in was_simple_abort\n");
-		}
-		return;
+	return request;
+}
+
+void
+Was::AbortRequest(const std::exception &exc) noexcept
+{
+	// If was_simple_status, was_simple_set_header, etc. fail, the cause is either a programming error or an
+	// IO Error on the command channel, in which case it doesn't make sense to do anything else and we will
+	// likely terminate soon.
+	// I log the errors for each function in case it was a programming error (wrong state).
+	// In the case of an IO Error, was_simple_accept will clean up the current request and either fail
+	// itself in which case we gracefully terminate the loop in `Run` and exit the program or it will clean
+	// up the current request and try another one.
+	// We don't know what kind of exception we got, so it's possible a was_simple_* function failed, but
+	// was_simple_abort will not do anything if the state is ERROR, so in case it was something else, we
+	// abort the request here.
+	fmt::print(stderr, "Exception handling request: {}\n", exc.what());
+	Metrics::CountAbortedRequest();
+	if (!was_simple_abort(was)) {
+		fmt::print(stderr, "Error in was_simple_abort\n");
 	}
+}
 
+void
+Was::CheckResponseComplete(const WasResponder &responder) noexcept
+{
 	// We are supposed to log here and close the connection (according to PEP-3333). We don't really have that
 	// option through WAS.
 	// Also WSGI is from 2010, so what they really meant is probably that we should close the HTTP/1.1 connection,
@@ -205,14 +469,68 @@ Was::ProcessRequest(RequestHandler &handler, std::string_view uri) noexcept
 	}
 }
 
-Was::Was() : was(was_simple_new()) {}
-Was::~Was() { was_simple_free(was); }
+void
+Was::ProcessRequest(RequestHandler &handler, std::string_view uri) noexcept
+{
+	const RequestTimer timer(uri);
+	const WatchedRequest watched(uri);
+	auto request = ReadRequest(uri);
+	if (!request) {
+		return;
+	}
+
+	WasResponder responder{ was };
+	try {
+		handler.Process(std::move(*request), responder);
+		responder.End();
+	} catch (std::exception &exc) {
+		AbortRequest(exc);
+		return;
+	}
+
+	CheckResponseComplete(responder);
+}
+
+Was::Was() : was(was_simple_new()), cancel_fd(create_eventfd()) {}
+
+Was::Was(int control_fd, int input_fd, int output_fd)
+  : was(was_simple_new_fds(control_fd, input_fd, output_fd))
+  , fds{ control_fd, input_fd, output_fd }
+  , cancel_fd(create_eventfd())
+{
+}
+
+Was::~Was()
+{
+	::close(cancel_fd);
+	was_simple_free(was);
+	// was_simple_free() leaves the file descriptors alone, so we have to close the ones we own ourselves.
+	for (const auto fd : fds) {
+		if (fd >= 0) {
+			::close(fd);
+		}
+	}
+}
 
 void
 Was::Run(RequestHandler &handler) noexcept
 {
-	const char *uri = nullptr;
-	while ((uri = was_simple_accept(was))) {
+	const Watchdog watchdog;
+
+	while (true) {
+		handler.Prepare();
+		if (Recycle::Requested()) {
+			break;
+		}
+
+		const char *uri;
+		{
+			const Py::ReleaseGilIfHeld release;
+			uri = was_simple_accept(was);
+		}
+		if (!uri) {
+			break;
+		}
 		ProcessRequest(handler, uri);
 	}
 }
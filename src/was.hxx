@@ -1,21 +1,104 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <exception>
+#include <optional>
 #include <string_view>
 
 #include "http.hxx"
 
 struct was_simple;
 
+// This is a WasInputStream as opposed to a FdInputStream, because we need to call was_simple_received, even if we were
+// reading from the fd directly and not using was_simple_read.
+class WasInputStream : public InputStream {
+	struct was_simple *was;
+	const int control_fd;
+	// An eventfd of the Was object that Cancel signals
+	const int cancel_fd;
+	std::atomic<bool> cancelled = false;
+
+	// Returns false, if the stream was cancelled
+	bool WaitReadable();
+
+public:
+	WasInputStream(struct was_simple *was, int control_fd, int cancel_fd, std::optional<uint64_t> content_length)
+	  : InputStream(content_length)
+	  , was(was)
+	  , control_fd(control_fd)
+	  , cancel_fd(cancel_fd)
+	{
+	}
+
+	~WasInputStream() override;
+
+	size_t Read(std::span<char> dest) override;
+
+	// Moves the body from the input pipe into the file with splice()
+	uint64_t CopyTo(int fd) override;
+
+	void Cancel() noexcept override;
+};
+
+// Returns a non-blocking eventfd, throws std::system_error on failure
+int
+create_eventfd();
+
+// You must create a separate object for each request!
+struct WasResponder : public HttpResponder {
+	struct was_simple *was;
+	std::optional<uint64_t> content_length_left = 0;
+
+	WasResponder(struct was_simple *was) : was(was) {}
+
+	void SendHeadersImpl(HttpResponse &&response) override;
+
+	// Needs to be called before SendHeaders
+	void SendBodyImpl(std::string_view body_data) override;
+
+	// Writes the chunks directly from their buffers to the output pipe with writev()
+	void SendBodyChunksImpl(std::span<const std::string_view> chunks) override;
+
+	// Moves the file into the output pipe with splice(), so the data never has to be copied to user space
+	void SendFileImpl(int fd, uint64_t offset, uint64_t length) override;
+
+	// Ends a response without Content-Length right away, instead of with the next was_simple_accept, so the
+	// client can send the next request while we prepare for it
+	void End();
+};
+
 class Was {
 	struct was_simple *was;
+	// Only set, if we own the file descriptors
+	std::array<int, 3> fds = { -1, -1, -1 };
+	// Passed to each WasInputStream, so it can be cancelled
+	int cancel_fd;
+	RequestArena arena;
 
-	void EndRequest() noexcept;
 	void ProcessRequest(RequestHandler &handler, std::string_view url) noexcept;
 
 public:
 	Was();
+	// Takes ownership of the file descriptors
+	Was(int control_fd, int input_fd, int output_fd);
 	~Was();
 	operator struct was_simple *() const { return was; }
 
+	// was_simple_new() uses the standard file descriptors of a WAS child process
+	int GetControlFd() const noexcept { return fds[0] >= 0 ? fds[0] : 3; }
+
+	// Builds the HttpRequest for the request that has just been accepted, including a WasInputStream for the
+	// request body. The strings in it point into the was_simple object and are only valid until the next
+	// was_simple_accept. Resets the arena, so the previous request must be complete.
+	// Returns nullopt (after sending an error response), if the request cannot be handled at all.
+	std::optional<HttpRequest> ReadRequest(std::string_view uri) noexcept;
+
+	// Logs the exception that was thrown while handling the current request and aborts it
+	void AbortRequest(const std::exception &exc) noexcept;
+
+	// Logs, if the response body was shorter than the announced Content-Length
+	static void CheckResponseComplete(const WasResponder &responder) noexcept;
+
 	void Run(RequestHandler &handler) noexcept;
 };
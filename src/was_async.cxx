@@ -0,0 +1,412 @@
+#include "was_async.hxx"
+#include "memory.hxx"
+#include "metrics.hxx"
+#include "python.hxx"
+#include "watchdog.hxx"
+
+#include <was/simple.h>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace {
+class ReadAheadInputStream : public InputStream {
+	WasIoThread &io;
+	uint64_t request_id;
+
+public:
+	ReadAheadInputStream(WasIoThread &io, uint64_t request_id, std::optional<uint64_t> content_length)
+	  : InputStream(content_length)
+	  , io(io)
+	  , request_id(request_id)
+	{
+	}
+
+	size_t Read(std::span<char> dest) override { return io.Read(request_id, dest); }
+
+	void Cancel() noexcept override { io.CancelRead(request_id); }
+};
+
+// Forwards everything to a WasResponder, which is only ever called from the I/O thread. The time it spends there
+// (Phase::SEND) is added to the RequestTimer of the application thread.
+class AsyncResponder : public HttpResponder {
+	WasIoThread &io;
+	WasResponder &responder;
+	RequestTimer &timer;
+
+	// Queues `function` to be called with the responder on the I/O thread
+	template<typename F>
+	void Push(F &&function, size_t size)
+	{
+		io.Push([&responder = responder, &timer = timer, function = std::forward<F>(function)]() mutable {
+			const AttachRequestTimer attach(timer);
+			function(responder);
+		}, size);
+	}
+
+public:
+	AsyncResponder(WasIoThread &io, WasResponder &responder, RequestTimer &timer)
+	  : io(io)
+	  , responder(responder)
+	  , timer(timer)
+	{
+	}
+
+	void End() { Push([](WasResponder &r) { r.End(); }, 0); }
+
+protected:
+	void SendHeadersImpl(HttpResponse &&response) override
+	{
+		Push([response = std::move(response)](WasResponder &r) mutable { r.SendHeaders(std::move(response)); },
+		     0);
+	}
+
+	void SendBodyImpl(std::string_view body_data) override
+	{
+		const auto size = body_data.size();
+		Push([data = std::string(body_data)](WasResponder &r) { r.SendBody(data); }, size);
+	}
+
+	// The chunks have to be copied anyway, so they are joined and written at once
+	void SendBodyChunksImpl(std::span<const std::string_view> chunks) override
+	{
+		std::string data;
+		for (const auto chunk : chunks) {
+			data.append(chunk);
+		}
+		const auto size = data.size();
+		Push([data = std::move(data)](WasResponder &r) { r.SendBody(data); }, size);
+	}
+
+	// The application closes the file after we return, so the I/O thread gets its own descriptor
+	void SendFileImpl(int fd, uint64_t offset, uint64_t length) override
+	{
+		const int dup_fd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (dup_fd < 0) {
+			throw std::system_error(errno, std::system_category(), "Could not duplicate file descriptor");
+		}
+		auto file = std::shared_ptr<int>(new int(dup_fd), [](int *p) {
+			::close(*p);
+			delete p;
+		});
+		Push([file, offset, length](WasResponder &r) { r.SendFile(*file, offset, length); }, 0);
+	}
+};
+}
+
+WasIoThread::WasIoThread(struct was_simple *was, int control_fd)
+  : was(was)
+  , control_fd(control_fd)
+  , wakeup_fd(create_eventfd())
+  , thread([this]() { Run(); })
+{
+}
+
+WasIoThread::~WasIoThread()
+{
+	{
+		const std::lock_guard lock(mutex);
+		stop = true;
+		NotifyIo();
+	}
+	thread.join();
+	::close(wakeup_fd);
+}
+
+void
+WasIoThread::NotifyIo() noexcept
+{
+	io_cond.notify_one();
+	if (polling) {
+		const uint64_t one = 1;
+		[[maybe_unused]] const auto n = ::write(wakeup_fd, &one, sizeof(one));
+	}
+}
+
+bool
+WasIoThread::WantReadAhead() const noexcept
+{
+	return source && !input_eof && !error && InputAvailable() < max_read_ahead;
+}
+
+void
+WasIoThread::ReadAhead(std::unique_lock<std::mutex> &lock) noexcept
+{
+	auto *const stream = source;
+	busy = true;
+	polling = true;
+	lock.unlock();
+
+	std::array<char, 16384> chunk;
+	size_t n = 0;
+	bool eof = false;
+	std::exception_ptr read_error;
+	try {
+		// The end of a body with a known length is not signalled on any file descriptor, so it has to be
+		// checked before waiting
+		auto result = was_simple_input_poll(was, 0);
+		if (result == WAS_SIMPLE_POLL_TIMEOUT) {
+			// Don't block in was_simple_read, so new commands are executed in time, even if the
+			// application sends a response before it has read the request body. was_simple_input_poll()
+			// handles the control channel as well, so the input is ready when either of them is.
+			std::array<struct pollfd, 3> fds{ {
+				{ .fd = control_fd, .events = POLLIN, .revents = 0 },
+				{ .fd = was_simple_input_fd(was), .events = POLLIN, .revents = 0 },
+				{ .fd = wakeup_fd, .events = POLLIN, .revents = 0 },
+			} };
+			if (::poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) {
+				throw std::system_error(errno, std::system_category(), "poll() failed");
+			}
+			if (fds[2].revents != 0) {
+				uint64_t value;
+				[[maybe_unused]] const auto r = ::read(wakeup_fd, &value, sizeof(value));
+			}
+			if (fds[0].revents != 0 || fds[1].revents != 0) {
+				result = was_simple_input_poll(was, 0);
+			}
+		}
+		switch (result) {
+		case WAS_SIMPLE_POLL_SUCCESS:
+			n = stream->Read(chunk);
+			eof = n == 0;
+			break;
+		case WAS_SIMPLE_POLL_END: eof = true; break;
+		case WAS_SIMPLE_POLL_TIMEOUT: break;
+		case WAS_SIMPLE_POLL_ERROR: throw std::runtime_error("Error in was_simple_input_poll");
+		case WAS_SIMPLE_POLL_CLOSED: throw std::runtime_error("Request body was closed prematurely");
+		}
+	} catch (...) {
+		read_error = std::current_exception();
+	}
+
+	lock.lock();
+	busy = false;
+	polling = false;
+	// The request may have ended while we were reading
+	if (source == stream) {
+		if (n > 0) {
+			// Drop consumed data, but only once there is enough of it to make the move worthwhile
+			if (input_position == input_buffer.size() || input_position >= max_read_ahead) {
+				input_buffer.erase(0, input_position);
+				input_position = 0;
+			}
+			input_buffer.append(chunk.data(), n);
+		}
+		input_eof = input_eof || eof;
+		if (read_error && !error) {
+			error = read_error;
+		}
+	}
+	app_cond.notify_all();
+}
+
+void
+WasIoThread::Run() noexcept
+{
+	std::unique_lock lock(mutex);
+	while (!stop) {
+		if (!commands.empty()) {
+			auto command = std::move(commands.front());
+			commands.pop_front();
+			busy = true;
+			lock.unlock();
+
+			std::exception_ptr command_error;
+			try {
+				command.function();
+			} catch (...) {
+				command_error = std::current_exception();
+			}
+
+			lock.lock();
+			busy = false;
+			queued_bytes -= command.size;
+			if (command_error && !error) {
+				error = command_error;
+				// Once a command has failed, the response is broken anyway
+				for (const auto &c : commands) {
+					queued_bytes -= c.size;
+				}
+				commands.clear();
+			}
+			app_cond.notify_all();
+		} else if (WantReadAhead()) {
+			ReadAhead(lock);
+		} else {
+			io_cond.wait(lock);
+		}
+	}
+}
+
+void
+WasIoThread::WaitIdle(std::unique_lock<std::mutex> &lock) noexcept
+{
+	source = nullptr;
+	NotifyIo();
+	app_cond.wait(lock, [this]() { return commands.empty() && !busy; });
+}
+
+uint64_t
+WasIoThread::StartRequest(InputStream *_source) noexcept
+{
+	{
+		const std::lock_guard lock(mutex);
+		assert(commands.empty() && !busy);
+		++request_id;
+		source = _source;
+		input_buffer.clear();
+		input_position = 0;
+		input_eof = _source == nullptr;
+		error = nullptr;
+	}
+	io_cond.notify_one();
+	return request_id;
+}
+
+size_t
+WasIoThread::Read(uint64_t id, std::span<char> dest)
+{
+	// Released before locking the mutex, so it is never held while waiting for the GIL
+	const Py::ReleaseGilIfHeld release;
+	std::unique_lock lock(mutex);
+	app_cond.wait(lock, [&]() {
+		return id != request_id || id == cancelled_id || InputAvailable() > 0 || input_eof || error;
+	});
+
+	if (id != request_id || id == cancelled_id) {
+		return 0;
+	}
+
+	if (InputAvailable() == 0) {
+		if (error && !input_eof) {
+			std::rethrow_exception(error);
+		}
+		return 0;
+	}
+
+	const auto n = std::min(dest.size(), InputAvailable());
+	std::copy_n(input_buffer.data() + input_position, n, dest.data());
+	input_position += n;
+	io_cond.notify_one();
+	return n;
+}
+
+void
+WasIoThread::CancelRead(uint64_t id) noexcept
+{
+	{
+		const std::lock_guard lock(mutex);
+		cancelled_id = id;
+	}
+	app_cond.notify_all();
+}
+
+void
+WasIoThread::Push(std::function<void()> function, size_t size)
+{
+	const Py::ReleaseGilIfHeld release;
+	std::unique_lock lock(mutex);
+	// Always accept at least one command, so a single big chunk cannot block forever
+	app_cond.wait(lock, [&]() { return error || commands.empty() || queued_bytes + size <= max_queued_bytes; });
+	if (error) {
+		std::rethrow_exception(error);
+	}
+	commands.push_back(Command{ std::move(function), size });
+	queued_bytes += size;
+	NotifyIo();
+}
+
+void
+WasIoThread::Finish()
+{
+	const Py::ReleaseGilIfHeld release;
+	std::unique_lock lock(mutex);
+	WaitIdle(lock);
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+void
+WasIoThread::Cancel() noexcept
+{
+	const Py::ReleaseGilIfHeld release;
+	std::unique_lock lock(mutex);
+	commands.clear();
+	queued_bytes = 0;
+	WaitIdle(lock);
+}
+
+AsyncWas::AsyncWas() : io(was, was.GetControlFd()) {}
+
+AsyncWas::AsyncWas(int control_fd, int input_fd, int output_fd)
+  : was(control_fd, input_fd, output_fd)
+  , io(was, control_fd)
+{
+}
+
+void
+AsyncWas::ProcessRequest(RequestHandler &handler, std::string_view uri) noexcept
+{
+	// Not const, because the I/O thread adds to it
+	RequestTimer timer(uri);
+	const WatchedRequest watched(uri);
+	auto request = was.ReadRequest(uri);
+	if (!request) {
+		return;
+	}
+
+	// The WasInputStream is only used by the I/O thread, the application reads from the read-ahead buffer
+	std::unique_ptr<InputStream> source = std::move(request->body);
+	const auto request_id = io.StartRequest(source.get());
+	if (source) {
+		request->body = std::make_unique<ReadAheadInputStream>(io, request_id, source->ContentLength());
+	}
+
+	WasResponder responder{ was };
+	AsyncResponder async_responder{ io, responder, timer };
+	try {
+		handler.Process(std::move(*request), async_responder);
+		async_responder.End();
+		// While the I/O thread sends the rest of the response
+		handler.Prepare();
+		io.Finish();
+	} catch (std::exception &exc) {
+		io.Cancel();
+		was.AbortRequest(exc);
+		return;
+	}
+
+	Was::CheckResponseComplete(responder);
+}
+
+void
+AsyncWas::Run(RequestHandler &handler) noexcept
+{
+	const Watchdog watchdog;
+
+	// Later it's done in ProcessRequest, while the response is being sent
+	handler.Prepare();
+
+	while (!Recycle::Requested()) {
+		const char *uri;
+		{
+			const Py::ReleaseGilIfHeld release;
+			uri = was_simple_accept(was);
+		}
+		if (!uri) {
+			break;
+		}
+		ProcessRequest(handler, uri);
+	}
+}
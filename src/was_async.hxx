@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "http.hxx"
+#include "was.hxx"
+
+// Executes all blocking I/O on the WAS channels of one connection. While a request is active, the I/O thread has
+// exclusive access to the was_simple object: It reads the request body ahead into a buffer and executes the
+// response commands queued by the application thread, so pipe I/O overlaps with the work of the interpreter.
+// Between requests (after Finish/Cancel) the I/O thread is idle and the was_simple object may be used directly.
+class WasIoThread {
+	struct Command {
+		std::function<void()> function;
+		size_t size;
+	};
+
+	struct was_simple *was;
+	const int control_fd;
+	// An eventfd that interrupts the poll() of ReadAhead, so new commands are executed without delay
+	const int wakeup_fd;
+
+	std::mutex mutex;
+	// Signalled for the I/O thread: new commands, buffer space, request start/end, stop
+	std::condition_variable io_cond;
+	// Signalled for the application thread: new input data, commands done, errors
+	std::condition_variable app_cond;
+
+	std::deque<Command> commands;
+	size_t queued_bytes = 0;
+	bool busy = false;
+	// Set while ReadAhead waits for input and has to be woken with `wakeup_fd`
+	bool polling = false;
+
+	// Read-ahead state of the current request
+	uint64_t request_id = 0;
+	// Reads of this request return 0 right away
+	uint64_t cancelled_id = 0;
+	InputStream *source = nullptr;
+	std::string input_buffer;
+	size_t input_position = 0;
+	bool input_eof = false;
+
+	std::exception_ptr error;
+	bool stop = false;
+
+	std::thread thread;
+
+	size_t InputAvailable() const noexcept { return input_buffer.size() - input_position; }
+	// Must be called with the mutex held
+	void NotifyIo() noexcept;
+	bool WantReadAhead() const noexcept;
+	void ReadAhead(std::unique_lock<std::mutex> &lock) noexcept;
+	void Run() noexcept;
+	void WaitIdle(std::unique_lock<std::mutex> &lock) noexcept;
+
+public:
+	static constexpr size_t max_read_ahead = 256 * 1024;
+	static constexpr size_t max_queued_bytes = 1024 * 1024;
+
+	// Throws std::system_error if the eventfd cannot be created
+	WasIoThread(struct was_simple *was, int control_fd);
+	~WasIoThread();
+
+	WasIoThread(const WasIoThread &) = delete;
+	WasIoThread &operator=(const WasIoThread &) = delete;
+
+	// Starts reading the request body from `source` (may be nullptr), which must stay alive until Finish/Cancel.
+	// Returns the id of the request, which must be passed to Read.
+	uint64_t StartRequest(InputStream *source) noexcept;
+
+	// Called from the application thread. Returns 0 on EOF or if `id` is not the current request anymore.
+	size_t Read(uint64_t id, std::span<char> dest);
+
+	// Makes all current and later Reads of request `id` return 0. May be called from any thread.
+	void CancelRead(uint64_t id) noexcept;
+
+	// Queues a command for the I/O thread. `size` is the number of body bytes it holds and is used to limit the
+	// amount of memory used by queued commands. Throws the error of a previous command, if there was one.
+	void Push(std::function<void()> function, size_t size);
+
+	// Waits until all queued commands have been executed and stops reading ahead.
+	// Throws the first error that occured in the I/O thread.
+	void Finish();
+
+	// Discards all queued commands and stops reading ahead.
+	void Cancel() noexcept;
+};
+
+class AsyncWas {
+	Was was;
+	WasIoThread io;
+
+	void ProcessRequest(RequestHandler &handler, std::string_view uri) noexcept;
+
+public:
+	AsyncWas();
+	// Takes ownership of the file descriptors
+	AsyncWas(int control_fd, int input_fd, int output_fd);
+
+	void Run(RequestHandler &handler) noexcept;
+};
@@ -0,0 +1,286 @@
+#include "watchdog.hxx"
+#include "python.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+WatchdogConfig Watchdog::config;
+
+namespace {
+
+thread_local Watchdog *current_watchdog = nullptr;
+
+// Collected samples are appended to the profile at least this often
+constexpr std::chrono::seconds flush_interval{ 60 };
+
+struct Frame {
+	std::string function;
+	std::string filename;
+	int line;
+};
+
+struct ThreadStack {
+	uint64_t id;
+	// Innermost frame first
+	std::vector<Frame> frames;
+};
+
+std::string
+utf8(PyObject *str)
+{
+	const char *s = str ? PyUnicode_AsUTF8(str) : nullptr;
+	if (!s) {
+		PyErr_Clear();
+		return "?";
+	}
+	return s;
+}
+
+// The Python stacks of all threads of the interpreter except `self`, which have any. The GIL must be held, so the
+// other threads can't change their frames.
+std::vector<ThreadStack>
+get_stacks(PyInterpreterState *interpreter, PyThreadState *self)
+{
+	std::vector<ThreadStack> stacks;
+	if constexpr (Py::free_threaded) {
+		// Nothing stops the other threads from changing their frames while we walk them
+		return stacks;
+	}
+
+	for (auto *ts = PyInterpreterState_ThreadHead(interpreter); ts; ts = PyThreadState_Next(ts)) {
+		if (ts == self) {
+			continue;
+		}
+
+		ThreadStack stack{ .id = PyThreadState_GetID(ts), .frames = {} };
+		auto frame = Py::wrap(reinterpret_cast<PyObject *>(PyThreadState_GetFrame(ts)));
+		while (frame) {
+			auto *f = reinterpret_cast<PyFrameObject *>(static_cast<PyObject *>(frame));
+			auto code = Py::wrap(reinterpret_cast<PyObject *>(PyFrame_GetCode(f)));
+			auto *c = reinterpret_cast<PyCodeObject *>(static_cast<PyObject *>(code));
+#if PY_VERSION_HEX >= 0x030B0000
+			auto *name = c->co_qualname;
+#else
+			auto *name = c->co_name;
+#endif
+			stack.frames.push_back(Frame{ utf8(name), utf8(c->co_filename), PyFrame_GetLineNumber(f) });
+			frame = Py::wrap(reinterpret_cast<PyObject *>(PyFrame_GetBack(f)));
+		}
+
+		if (!stack.frames.empty()) {
+			stacks.push_back(std::move(stack));
+		}
+	}
+	return stacks;
+}
+
+// Holds the GIL of the watchdog's interpreter with its own thread state
+class WithGil {
+	PyThreadState *state;
+
+public:
+	explicit WithGil(PyThreadState *state) noexcept : state(state) { PyEval_RestoreThread(state); }
+	~WithGil() { PyEval_SaveThread(); }
+
+	WithGil(const WithGil &) = delete;
+	WithGil &operator=(const WithGil &) = delete;
+};
+
+}
+
+Watchdog::Watchdog() noexcept
+{
+	if (!config.Enabled()) {
+		return;
+	}
+
+	interpreter = PyInterpreterState_Get();
+	last_flush = Clock::now();
+	try {
+		thread = std::thread([this]() { Run(); });
+	} catch (const std::exception &exc) {
+		fmt::print(stderr, "Could not start watchdog: {}\n", exc.what());
+		return;
+	}
+	current_watchdog = this;
+}
+
+Watchdog::~Watchdog()
+{
+	if (!thread.joinable()) {
+		return;
+	}
+
+	current_watchdog = nullptr;
+	{
+		const std::lock_guard lock(mutex);
+		stop = true;
+	}
+	cond.notify_one();
+	// The thread needs the GIL to delete its thread state
+	const Py::ReleaseGilIfHeld release;
+	thread.join();
+}
+
+void
+Watchdog::ReportSlowRequest(PyThreadState *state, std::string_view request_uri, Clock::duration duration)
+{
+	// Printed before we wait for the GIL, in case the application holds it and never lets go
+	const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+	fmt::print(stderr, "Slow request: {} is running for {} ms\n", request_uri, ms);
+
+	std::vector<ThreadStack> stacks;
+	{
+		const WithGil gil(state);
+		stacks = get_stacks(interpreter, state);
+	}
+
+	std::string message;
+	for (const auto &stack : stacks) {
+		message += fmt::format("Thread {} (most recent call first):\n", stack.id);
+		for (const auto &frame : stack.frames) {
+			message += fmt::format("  File \"{}\", line {}, in {}\n", frame.filename, frame.line,
+					       frame.function);
+		}
+	}
+	fmt::print(stderr, "{}", message);
+}
+
+void
+Watchdog::Sample(PyThreadState *state)
+{
+	std::vector<ThreadStack> stacks;
+	{
+		const WithGil gil(state);
+		stacks = get_stacks(interpreter, state);
+	}
+
+	for (const auto &stack : stacks) {
+		// Folded stacks start with the outermost frame and must not contain the separators
+		std::string folded;
+		for (auto frame = stack.frames.rbegin(); frame != stack.frames.rend(); ++frame) {
+			if (!folded.empty()) {
+				folded.push_back(';');
+			}
+			auto name = fmt::format("{} ({})", frame->function, frame->filename);
+			std::replace(name.begin(), name.end(), ';', ':');
+			folded.append(name);
+		}
+		const std::lock_guard lock(mutex);
+		++samples[std::move(folded)];
+	}
+}
+
+void
+Watchdog::FlushSamples() noexcept
+{
+	std::string data;
+	{
+		const std::lock_guard lock(mutex);
+		for (const auto &[stack, count] : samples) {
+			data += fmt::format("{} {}\n", stack, count);
+		}
+		samples.clear();
+		last_flush = Clock::now();
+	}
+	if (data.empty()) {
+		return;
+	}
+
+	// Appended with a single write, so the profiles of all workers can share a file
+	const int fd = ::open(config.profile_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || ::write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+		fmt::print(stderr, "Could not write profile to '{}': {}\n", config.profile_path, strerror(errno));
+	}
+	if (fd >= 0) {
+		::close(fd);
+	}
+}
+
+void
+Watchdog::Run() noexcept
+{
+	auto *const state = PyThreadState_New(interpreter);
+
+	const bool profile = !config.profile_path.empty();
+	const auto sample_interval =
+	    std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(1)) / std::max(config.profile_hz, 1u);
+	// Requests are not announced to this thread, it notices them when it checks
+	const auto check_interval = std::clamp<Clock::duration>(config.slow_threshold / 4,
+								std::chrono::milliseconds(10), std::chrono::seconds(1));
+	const auto interval = profile ? std::min(sample_interval, check_interval) : check_interval;
+
+	std::unique_lock lock(mutex);
+	while (!stop) {
+		cond.wait_for(lock, interval);
+		if (stop) {
+			break;
+		}
+
+		const auto now = Clock::now();
+		const auto running = now - start;
+		const bool slow =
+		    active && config.slow_threshold.count() > 0 && !reported && running >= config.slow_threshold;
+		const bool sample = active && profile;
+		const bool flush = profile && now - last_flush >= flush_interval;
+		if (!slow && !sample && !flush) {
+			continue;
+		}
+		const std::string request_uri = slow ? uri : std::string();
+		reported = reported || slow;
+		lock.unlock();
+
+		try {
+			if (slow) {
+				ReportSlowRequest(state, request_uri, running);
+			}
+			if (sample) {
+				Sample(state);
+			}
+		} catch (const std::exception &exc) {
+			fmt::print(stderr, "Error in watchdog: {}\n", exc.what());
+		}
+		if (flush) {
+			FlushSamples();
+		}
+
+		lock.lock();
+	}
+	lock.unlock();
+
+	if (profile) {
+		FlushSamples();
+	}
+
+	PyEval_RestoreThread(state);
+	PyThreadState_Clear(state);
+	PyThreadState_DeleteCurrent();
+}
+
+WatchedRequest::WatchedRequest(std::string_view uri) noexcept : watchdog(current_watchdog)
+{
+	if (!watchdog) {
+		return;
+	}
+	const std::lock_guard lock(watchdog->mutex);
+	watchdog->active = true;
+	watchdog->reported = false;
+	watchdog->uri = uri;
+	watchdog->start = Watchdog::Clock::now();
+}
+
+WatchedRequest::~WatchedRequest()
+{
+	if (!watchdog) {
+		return;
+	}
+	const std::lock_guard lock(watchdog->mutex);
+	watchdog->active = false;
+}
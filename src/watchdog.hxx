@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+// From Python.h, which is not needed by the users of this header
+typedef struct _is PyInterpreterState;
+typedef struct _ts PyThreadState;
+
+struct WatchdogConfig {
+	// Requests that take longer are logged with the Python stacks of all threads, 0 disables it
+	std::chrono::milliseconds slow_threshold{ 0 };
+	// The Python stacks are sampled while requests are processed and appended to this file as folded stacks
+	// (flamegraph.pl, speedscope, ...), empty disables it
+	std::string profile_path;
+	unsigned profile_hz = 10;
+
+	bool Enabled() const noexcept { return slow_threshold.count() > 0 || !profile_path.empty(); }
+};
+
+// A thread that watches the requests of the thread that created it. It must be created with the GIL held, it then
+// gets a thread state of its own in the same interpreter, with which it takes the GIL to read the Python stacks.
+class Watchdog {
+	using Clock = std::chrono::steady_clock;
+
+	static WatchdogConfig config;
+
+	PyInterpreterState *interpreter = nullptr;
+
+	// The mutex is never held while waiting for the GIL, so it can be locked with the GIL held
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool stop = false;
+	// The request that is being processed, if `active`
+	bool active = false;
+	bool reported = false;
+	std::string uri;
+	Clock::time_point start;
+
+	// folded stack -> number of samples
+	std::unordered_map<std::string, uint64_t> samples;
+	Clock::time_point last_flush;
+
+	std::thread thread;
+
+	void Run() noexcept;
+	void ReportSlowRequest(PyThreadState *state, std::string_view request_uri, Clock::duration duration);
+	void Sample(PyThreadState *state);
+	void FlushSamples() noexcept;
+
+public:
+	// Must be called before the first Watchdog is created
+	static void Enable(WatchdogConfig config) { Watchdog::config = std::move(config); }
+
+	// Does nothing, if not enabled
+	Watchdog() noexcept;
+	~Watchdog();
+
+	Watchdog(const Watchdog &) = delete;
+	Watchdog &operator=(const Watchdog &) = delete;
+
+	friend class WatchedRequest;
+};
+
+// Tells the Watchdog of this thread, if any, that a request is being processed, from construction to destruction
+class WatchedRequest {
+	Watchdog *watchdog;
+
+public:
+	explicit WatchedRequest(std::string_view uri) noexcept;
+	~WatchedRequest();
+
+	WatchedRequest(const WatchedRequest &) = delete;
+	WatchedRequest &operator=(const WatchedRequest &) = delete;
+};
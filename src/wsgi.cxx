@@ -3,12 +3,20 @@
 #include <fmt/core.h>
 
 #include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
 #include <stdexcept>
+#include <vector>
 
+#include "file_wrapper.hxx"
+#include "header.hxx"
+#include "metrics.hxx"
+#include "module.hxx"
 #include "http.hxx"
 #include "python.hxx"
+#include "range.hxx"
 
-#include "http/header.h"
 #include "util/CharUtil.hxx"
 #include "util/NumberParser.hxx"
 
@@ -16,12 +24,142 @@
 
 namespace {
 
+// Read-ahead buffer on top of the InputStream of a request, so readline() does not have to read byte by byte
+class BufferedInput {
+	static constexpr size_t max_buffer_size = 64 * 1024;
+
+	std::unique_ptr<InputStream> stream;
+	std::vector<char> buffer;
+	size_t start = 0;
+	size_t end = 0;
+	// Number of bytes read from the stream so far
+	uint64_t received = 0;
+	bool eof = false;
+
+	// Never asks the stream for more than the Content-Length, because a read after the end may have to wait for
+	// the stream to notice the end
+	size_t ReadStream(std::span<char> dest)
+	{
+		const auto content_length = stream->ContentLength();
+		if (!eof && content_length && received >= *content_length) {
+			eof = true;
+		}
+		if (eof || dest.empty()) {
+			return 0;
+		}
+		if (content_length) {
+			dest = dest.first(std::min<uint64_t>(dest.size(), *content_length - received));
+		}
+		const auto n = stream->Read(dest);
+		received += n;
+		if (n == 0 || (content_length && received >= *content_length)) {
+			eof = true;
+		}
+		return n;
+	}
+
+	// Reads more data into the buffer, returns false on EOF
+	bool Fill()
+	{
+		if (eof) {
+			return false;
+		}
+
+		if (buffer.empty()) {
+			// No need to allocate more than the whole body
+			const auto content_length = stream->ContentLength();
+			buffer.resize(content_length ? std::clamp<uint64_t>(*content_length, 1, max_buffer_size)
+						     : max_buffer_size);
+		} else if (start > 0) {
+			std::memmove(buffer.data(), buffer.data() + start, end - start);
+			end -= start;
+			start = 0;
+		}
+
+		if (end == buffer.size()) {
+			// A line that is longer than the buffer
+			buffer.resize(buffer.size() * 2);
+		}
+
+		const auto n = ReadStream({ buffer.data() + end, buffer.size() - end });
+		end += n;
+		return n > 0;
+	}
+
+public:
+	explicit BufferedInput(std::unique_ptr<InputStream> stream) : stream(std::move(stream)) {}
+
+	std::string_view Buffered() const noexcept { return { buffer.data() + start, end - start }; }
+
+	void Consume(size_t n) noexcept
+	{
+		assert(n <= end - start);
+		start += n;
+		if (start == end) {
+			start = end = 0;
+		}
+	}
+
+	// The number of bytes that can still be read, if it is known
+	std::optional<uint64_t> Remaining() const noexcept
+	{
+		if (eof) {
+			return end - start;
+		}
+		const auto content_length = stream->ContentLength();
+		if (!content_length) {
+			return std::nullopt;
+		}
+		return end - start + (*content_length > received ? *content_length - received : 0);
+	}
+
+	// Fills `dest` from the buffer and then directly from the stream. Only returns less than dest.size() at EOF.
+	size_t Read(std::span<char> dest)
+	{
+		const auto buffered = Buffered();
+		size_t n = std::min(buffered.size(), dest.size());
+		std::memcpy(dest.data(), buffered.data(), n);
+		Consume(n);
+
+		while (n < dest.size()) {
+			const auto r = ReadStream(dest.subspan(n));
+			if (r == 0) {
+				break;
+			}
+			n += r;
+		}
+		return n;
+	}
+
+	// Fills the buffer until it contains a newline, `limit` bytes or everything until EOF and returns the length of
+	// the line at the start of the buffer, including the newline.
+	size_t FindLine(size_t limit)
+	{
+		size_t searched = 0;
+		while (true) {
+			const auto data = Buffered();
+			const auto n = std::min(data.size(), limit);
+			if (n > searched) {
+				const auto nl = data.substr(0, n).find('\n', searched);
+				if (nl != std::string_view::npos) {
+					return nl + 1;
+				}
+			}
+			if (n == limit || !Fill()) {
+				return n;
+			}
+			searched = n;
+		}
+	}
+};
+
 struct WsgiInputStream {
 	PyObject ob_base;
 
-	InputStream *stream; // This is an owning pointer, but this type needs to be POD
+	BufferedInput *input; // This is an owning pointer, but this type needs to be POD
 
 	static PyObject *read(PyObject *self, PyObject *args);
+	static PyObject *readinto(PyObject *self, PyObject *args);
 	static PyObject *readline(PyObject *self, PyObject *args);
 	static PyObject *readlines(PyObject *self, PyObject *args);
 	static PyObject *iter(PyObject *self);
@@ -29,59 +167,196 @@ struct WsgiInputStream {
 	static void dealloc(PyObject *self);
 
 	static PyMethodDef *GetMethodDef() noexcept;
-	static PyTypeObject *GetTypeObject();
+	static Py::Object CreateType();
 
-	static Py::Object CreatePyObject(InputStream *stream);
+	static Py::Object CreatePyObject(PyObject *type, std::unique_ptr<InputStream> stream);
 };
 
+// Parses the optional size/hint argument of the read methods, None or a negative value means no limit
+bool
+parse_size_arg(PyObject *args, Py_ssize_t &size)
+{
+	PyObject *arg = Py_None;
+	if (!PyArg_ParseTuple(args, "|O", &arg)) {
+		return false;
+	}
+	if (arg == Py_None) {
+		size = -1;
+		return true;
+	}
+	size = PyNumber_AsSsize_t(arg, PyExc_OverflowError);
+	return size != -1 || !PyErr_Occurred();
+}
+
+void
+set_read_error(const std::exception &exc)
+{
+	PyErr_SetString(PyExc_OSError, fmt::format("Error reading body from WsgiInputStream: {}", exc.what()).c_str());
+}
+
+// Reads `size` bytes (less only at EOF) into a bytes object that is allocated only once
 PyObject *
-WsgiInputStream::read(PyObject *self, PyObject *args)
+read_bytes(BufferedInput &input, size_t size)
 {
-	int64_t size = -1;
-	if (!PyArg_ParseTuple(args, "|L", &size)) {
+	PyObject *bytes = PyBytes_FromStringAndSize(nullptr, static_cast<Py_ssize_t>(size));
+	if (!bytes) {
 		return nullptr;
 	}
 
-	if (size == 0) {
-		return Py::to_bytes("").Release();
+	size_t n;
+	try {
+		n = input.Read({ PyBytes_AS_STRING(bytes), size });
+	} catch (const std::exception &exc) {
+		Py_DECREF(bytes);
+		set_read_error(exc);
+		return nullptr;
 	}
 
-	auto stream = reinterpret_cast<WsgiInputStream *>(self)->stream;
+	if (n < size && _PyBytes_Resize(&bytes, static_cast<Py_ssize_t>(n)) < 0) {
+		return nullptr;
+	}
+	return bytes;
+}
 
+// Reads until EOF, if the length of the body is unknown
+PyObject *
+read_all_bytes(BufferedInput &input)
+{
+	size_t capacity = std::max<size_t>(input.Buffered().size(), 64 * 1024);
+	PyObject *bytes = PyBytes_FromStringAndSize(nullptr, static_cast<Py_ssize_t>(capacity));
+	if (!bytes) {
+		return nullptr;
+	}
+
+	size_t size = 0;
 	try {
-		if (size > 0) {
-			std::string buf(size, '\0');
-			buf.resize(stream->Read(buf));
-			return Py::to_bytes(buf).Release();
+		while (true) {
+			const auto n = input.Read({ PyBytes_AS_STRING(bytes) + size, capacity - size });
+			size += n;
+			if (size < capacity) {
+				break;
+			}
+			capacity *= 2;
+			if (_PyBytes_Resize(&bytes, static_cast<Py_ssize_t>(capacity)) < 0) {
+				return nullptr;
+			}
 		}
+	} catch (const std::exception &exc) {
+		Py_DECREF(bytes);
+		set_read_error(exc);
+		return nullptr;
+	}
 
-		assert(size < 0);
-		std::array<char, 4096> read_buf;
-		std::string ret;
-		size_t n = 0;
-		while ((n = stream->Read(read_buf)) > 0) {
-			ret.append(std::string_view(read_buf.data(), n));
-		}
-		return Py::to_bytes(ret).Release();
+	if (_PyBytes_Resize(&bytes, static_cast<Py_ssize_t>(size)) < 0) {
+		return nullptr;
+	}
+	return bytes;
+}
+
+PyObject *
+read_line(BufferedInput &input, size_t limit)
+{
+	try {
+		const auto length = input.FindLine(limit);
+		auto line = Py::to_bytes(input.Buffered().substr(0, length));
+		input.Consume(length);
+		return line.Release();
 	} catch (const std::exception &exc) {
-		PyErr_SetString(PyExc_IOError,
-				fmt::format("Error reading body from WsgiInputStream: {}", errno).c_str());
+		set_read_error(exc);
 		return nullptr;
 	}
 }
 
 PyObject *
-WsgiInputStream::readline(PyObject * /*self*/, PyObject * /*args*/)
+WsgiInputStream::read(PyObject *self, PyObject *args)
 {
-	assert(false); // TODO: Implement this! Not used by flask or Django
-	return Py_None;
+	Py_ssize_t size;
+	if (!parse_size_arg(args, size)) {
+		return nullptr;
+	}
+
+	auto &input = *reinterpret_cast<WsgiInputStream *>(self)->input;
+	const auto remaining = input.Remaining();
+	if (size >= 0) {
+		// Don't allocate more than necessary for read(huge_number)
+		return read_bytes(input,
+				  remaining ? std::min<uint64_t>(static_cast<uint64_t>(size), *remaining)
+					    : static_cast<size_t>(size));
+	}
+	if (remaining) {
+		return read_bytes(input, *remaining);
+	}
+	return read_all_bytes(input);
 }
 
 PyObject *
-WsgiInputStream::readlines(PyObject * /*self*/, PyObject * /*args*/)
+WsgiInputStream::readinto(PyObject *self, PyObject *args)
 {
-	assert(false); // TODO: Implement this! Not used by flask or Django
-	return Py_None;
+	// Any writable buffer, e.g. a bytearray, memoryview or array. It can't be resized while we hold it.
+	Py_buffer buffer;
+	if (!PyArg_ParseTuple(args, "w*", &buffer)) {
+		return nullptr;
+	}
+
+	auto &input = *reinterpret_cast<WsgiInputStream *>(self)->input;
+	// Like read(), a buffer larger than the rest of the body gets a short count instead of waiting for more
+	auto size = static_cast<size_t>(buffer.len);
+	if (const auto remaining = input.Remaining()) {
+		size = std::min<uint64_t>(size, *remaining);
+	}
+	size_t n;
+	try {
+		n = input.Read({ static_cast<char *>(buffer.buf), size });
+	} catch (const std::exception &exc) {
+		PyBuffer_Release(&buffer);
+		set_read_error(exc);
+		return nullptr;
+	}
+	PyBuffer_Release(&buffer);
+	return PyLong_FromSize_t(n);
+}
+
+PyObject *
+WsgiInputStream::readline(PyObject *self, PyObject *args)
+{
+	Py_ssize_t size;
+	if (!parse_size_arg(args, size)) {
+		return nullptr;
+	}
+
+	auto &input = *reinterpret_cast<WsgiInputStream *>(self)->input;
+	return read_line(input, size < 0 ? SIZE_MAX : static_cast<size_t>(size));
+}
+
+PyObject *
+WsgiInputStream::readlines(PyObject *self, PyObject *args)
+{
+	Py_ssize_t hint;
+	if (!parse_size_arg(args, hint)) {
+		return nullptr;
+	}
+
+	auto lines = Py::wrap(PyList_New(0));
+	if (!lines) {
+		return nullptr;
+	}
+
+	auto &input = *reinterpret_cast<WsgiInputStream *>(self)->input;
+	Py_ssize_t total = 0;
+	while (hint <= 0 || total < hint) {
+		auto line = Py::wrap(read_line(input, SIZE_MAX));
+		if (!line) {
+			return nullptr;
+		}
+		if (PyBytes_Size(line) == 0) {
+			break;
+		}
+		total += PyBytes_Size(line);
+		if (PyList_Append(lines, line) < 0) {
+			return nullptr;
+		}
+	}
+	return lines.Release();
 }
 
 PyObject *
@@ -92,18 +367,26 @@ WsgiInputStream::iter(PyObject *self)
 }
 
 PyObject *
-WsgiInputStream::next(PyObject * /*self*/)
+WsgiInputStream::next(PyObject *self)
 {
-	assert(false); // TODO: Implement this! Not used by flask or Django
-	return Py_None;
+	auto &input = *reinterpret_cast<WsgiInputStream *>(self)->input;
+	auto line = Py::wrap(read_line(input, SIZE_MAX));
+	if (!line || PyBytes_Size(line) == 0) {
+		// Returning nullptr without an exception set ends the iteration
+		return nullptr;
+	}
+	return line.Release();
 }
 
 void
 WsgiInputStream::dealloc(PyObject *self)
 {
 	auto *obj = reinterpret_cast<WsgiInputStream *>(self);
-	delete obj->stream;
+	delete obj->input;
+	// Instances of heap types hold a reference to their type
+	auto *type = Py_TYPE(self);
 	PyObject_Del(self);
+	Py_DECREF(type);
 }
 
 PyMethodDef *
@@ -113,145 +396,57 @@ WsgiInputStream::GetMethodDef() noexcept
 	static PyMethodDef methods[]{
 		// read(size=-1): Read up to size bytes, size < 0 or None => read until EOF
 		{ "read", &WsgiInputStream::read, METH_VARARGS, "Read up to size bytes" },
+		// readinto(b): Read into the writable buffer b until it is full or EOF, returns the number of bytes
+		{ "readinto", &WsgiInputStream::readinto, METH_VARARGS, "Read into a buffer" },
 		// readline(size=-1): Read until next \n (including), but at most size bytes
 		{ "readline", &WsgiInputStream::readline, METH_VARARGS, "Read until next newline" },
 		// readlines(hint=-1): Read multiple lines as a list, at most hint bytes, hint <= 0 or None is no hint
 		{ "readlines", &WsgiInputStream::readlines, METH_VARARGS, "Read multiple lines" },
-		// The object must be iterable and return lines in each iteration
-		//{"__iter__", reinterpret_cast<PyCFunction>(iter), METH_NOARGS, "Return line iterator"},
-		//{"__next__", reinterpret_cast<PyCFunction>(next), METH_NOARGS, "Return line iterator"},
+		// The object must be iterable and return lines in each iteration, see Py_tp_iter and Py_tp_iternext
 		{ nullptr, nullptr, 0, nullptr } // Sentinel
 	};
 	return &methods[0];
 }
 
-PyTypeObject *
-WsgiInputStream::GetTypeObject()
-{
-	static auto type = []() {
-		PyTypeObject type = {
-			.tp_name = "python_was.WsgiInputStream",
-			.tp_basicsize = sizeof(WsgiInputStream),
-			.tp_dealloc = &WsgiInputStream::dealloc,
-			.tp_flags = Py_TPFLAGS_DEFAULT,
-			.tp_doc = "File-like object to read request body",
-			.tp_iter = iter,
-			.tp_iternext = next,
-			.tp_methods = GetMethodDef(),
-			.tp_new = PyType_GenericNew,
-		};
-
-		if (PyType_Ready(&type) < 0) {
-			Py::rethrow_python_exception();
-		}
-
-		return type;
-	}();
-	return &type;
-};
-
 Py::Object
-WsgiInputStream::CreatePyObject(InputStream *stream)
-{
-	auto *obj = PyObject_New(WsgiInputStream, GetTypeObject());
-	if (!obj) {
-		Py::rethrow_python_exception();
-	}
-	obj->stream = stream;
-	return Py::wrap(reinterpret_cast<PyObject *>(obj));
-}
-
-bool
-is_valid_header_name(std::string_view name) noexcept
-{
-	// https://datatracker.ietf.org/doc/html/rfc2616#section-2.2
-	static constexpr std::array<bool, 256> is_valid = []() {
-		std::array<bool, 256> v = {};
-
-		// "1*<any CHAR except CTLs or separators>", CHAR=(octets 0 - 127)
-		// Control Characters "<any US-ASCII control character (octets 0 - 31) and DEL (127)>"
-		std::fill(v.begin() + 32, v.begin() + 127, true);
-		assert(!v[0] && !v[31] && v[32] && v[126] && !v[127]);
-
-		// Separators
-		constexpr std::array separators = { '(', ')', '<', '>', '@', ',', ';', ':', '\\', '"',
-						    '/', '[', ']', '?', '=', '{', '}', ' ', '\t' };
-		for (const auto c : separators) {
-			v[c] = false;
-		}
-
-		return v;
-	}();
-
-	if (name.empty()) {
-		return false;
-	}
-
-	for (char c : name) {
-		if (!is_valid[static_cast<uint8_t>(c)]) {
-			return false;
-		}
-	}
-
-	return true;
-}
-
-bool
-check_header_name(std::string_view name) noexcept
+WsgiInputStream::CreateType()
 {
-	if (!is_valid_header_name(name)) {
-		PyErr_SetString(PyExc_ValueError, fmt::format("Invalid header name '{}'", name).c_str());
-		return false;
-	}
+	// This is a heap type instead of a static PyTypeObject, because every (sub-)interpreter needs its own type
+	// object, if it has its own GIL.
+	static PyType_Slot slots[] = {
+		{ Py_tp_dealloc, reinterpret_cast<void *>(&WsgiInputStream::dealloc) },
+		{ Py_tp_doc, const_cast<char *>("File-like object to read request body") },
+		{ Py_tp_iter, reinterpret_cast<void *>(&WsgiInputStream::iter) },
+		{ Py_tp_iternext, reinterpret_cast<void *>(&WsgiInputStream::next) },
+		{ Py_tp_methods, GetMethodDef() },
+		{ 0, nullptr }, // Sentinel
+	};
 
-	std::string lower(name.size(), '\0');
-	std::transform(name.begin(), name.end(), lower.begin(), ToLowerASCII);
-	// http_header_is_hop_by_hop also checks for Content-Length
-	if (lower != "content-length" && http_header_is_hop_by_hop(lower.c_str())) {
-		PyErr_SetString(PyExc_ValueError, fmt::format("Hop-by-hop header '{}' is not allowed", name).c_str());
-		return false;
-	}
-	return true;
-}
+	static PyType_Spec spec = {
+		.name = "python_was.WsgiInputStream",
+		.basicsize = sizeof(WsgiInputStream),
+		.itemsize = 0,
+		.flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+		.slots = slots,
+	};
 
-bool
-is_valid_header_value(std::string_view value) noexcept
-{
-	// https://www.rfc-editor.org/rfc/rfc7230#section-3.2
-	// Exclude line folding (obs-fold)
-	/*
-	field-content = field-vchar [ 1*( SP / HTAB ) field-vchar ]
-	field-value = *( field-content )
-	field-vchar = VCHAR / obs-text
-	*/
-	static constexpr std::array<bool, 256> is_valid = []() {
-		std::array<bool, 256> v = {};
-
-		std::fill(v.begin() + 0x21, v.begin() + 0x7E + 1, true); // VCHAR (%x21-7E)
-		std::fill(v.begin() + 0x80, v.begin() + 0xFF + 1, true); // obs-text (%x80-FF)
-		v[0x20] = true;						 // SP
-		v[0x09] = true;						 // HTAB
-
-		return v;
-	}();
-
-	for (char c : value) {
-		if (!is_valid[static_cast<uint8_t>(c)]) {
-			return false;
-		}
+	auto type = Py::wrap(PyType_FromSpec(&spec));
+	if (!type) {
+		Py::rethrow_python_exception();
 	}
-
-	return true;
+	return type;
 }
 
-bool
-check_header_value(std::string_view value) noexcept
+Py::Object
+WsgiInputStream::CreatePyObject(PyObject *type, std::unique_ptr<InputStream> stream)
 {
-	if (!is_valid_header_value(value)) {
-		PyErr_SetString(PyExc_ValueError, fmt::format("Invalid header value '{}'", value).c_str());
-		return false;
+	auto input = std::make_unique<BufferedInput>(std::move(stream));
+	auto *obj = PyObject_New(WsgiInputStream, reinterpret_cast<PyTypeObject *>(type));
+	if (!obj) {
+		Py::rethrow_python_exception();
 	}
-	return true;
+	obj->input = input.release();
+	return Py::wrap(reinterpret_cast<PyObject *>(obj));
 }
 
 // https://peps.python.org/pep-3333/#a-note-on-string-types
@@ -264,8 +459,11 @@ native_string(std::string_view str)
 	return Py::uc_from_latin1(str);
 }
 
-std::optional<std::string>
-from_native_string(PyObject *str)
+// Returns the Latin-1 encoding of a native string. For compact strings that only contain code points up to U+00FF
+// (almost all header names and values), that is the string's own memory, so nothing has to be converted and the
+// view is valid as long as `str` is alive. Everything else is converted into `storage`.
+std::optional<std::string_view>
+from_native_string(PyObject *str, std::pmr::string &storage)
 {
 	if (PyUnicode_READY(str) == -1) {
 		// Python exception is set
@@ -273,11 +471,15 @@ from_native_string(PyObject *str)
 	}
 
 	const auto length = PyUnicode_GET_LENGTH(str);
-	const auto data = PyUnicode_DATA(str);
 	const auto kind = PyUnicode_KIND(str);
+	if (kind == PyUnicode_1BYTE_KIND) {
+		return std::string_view(reinterpret_cast<const char *>(PyUnicode_1BYTE_DATA(str)),
+					static_cast<size_t>(length));
+	}
 
-	std::string result;
-	result.reserve(length);
+	const auto data = PyUnicode_DATA(str);
+	storage.clear();
+	storage.reserve(length);
 	for (Py_ssize_t i = 0; i < length; ++i) {
 		const Py_UCS4 ch = PyUnicode_READ(kind, data, i);
 		if (ch > 0xFF) {
@@ -290,10 +492,10 @@ from_native_string(PyObject *str)
 				.c_str());
 			return std::nullopt;
 		}
-		result.push_back(static_cast<char>(ch));
+		storage.push_back(static_cast<char>(ch));
 	}
 
-	return result;
+	return storage;
 }
 
 struct StartResponseContext {
@@ -301,6 +503,20 @@ struct StartResponseContext {
 	HttpResponder *responder;
 };
 
+// A capsule must not store a nullptr, so PyCapsule_SetPointer can't clear it. Instead the name of the capsule is
+// changed when the request is done (even if it failed), so PyCapsule_GetPointer fails in StartResponse. Then an
+// application that keeps a reference to start_response and calls it later does not get a use-after-free.
+class StartResponseCapsuleGuard {
+	PyObject *capsule;
+
+public:
+	explicit StartResponseCapsuleGuard(PyObject *capsule) noexcept : capsule(capsule) {}
+	~StartResponseCapsuleGuard() { PyCapsule_SetName(capsule, nullptr); }
+
+	StartResponseCapsuleGuard(const StartResponseCapsuleGuard &) = delete;
+	StartResponseCapsuleGuard &operator=(const StartResponseCapsuleGuard &) = delete;
+};
+
 PyObject *
 StartResponse(PyObject *self, PyObject *args)
 {
@@ -377,7 +593,12 @@ StartResponse(PyObject *self, PyObject *args)
 	// Servers should check for errors in the headers at the time start_response is called, so that an error can be
 	// raised while the application is still running.
 
+	// Only needed for strings that are not compact Latin-1
+	std::pmr::string name_storage(response.headers.get_allocator().resource());
+	std::pmr::string value_storage(response.headers.get_allocator().resource());
+
 	const auto len = PyList_Size(headers);
+	response.headers.reserve(response.headers.size() + len);
 	for (Py_ssize_t i = 0; i < len; i++) {
 		PyObject *item = PyList_GetItem(headers, i); // borrowed reference
 
@@ -391,7 +612,7 @@ StartResponse(PyObject *self, PyObject *args)
 			return nullptr;
 		}
 
-		const auto name = from_native_string(name_obj);
+		const auto name = from_native_string(name_obj, name_storage);
 		if (!name) {
 			return nullptr;
 		}
@@ -399,7 +620,7 @@ StartResponse(PyObject *self, PyObject *args)
 			return nullptr;
 		}
 
-		const auto value = from_native_string(value_obj);
+		const auto value = from_native_string(value_obj, value_storage);
 		if (!value) {
 			return nullptr;
 		}
@@ -419,6 +640,7 @@ StartResponse(PyObject *self, PyObject *args)
 			continue; // Content-Length should not be included in the WAS response
 		}
 
+		// Copied into the arena, because the application may modify the list after start_response
 		response.headers.emplace_back(*name, *value);
 	}
 
@@ -432,6 +654,59 @@ StartResponse(PyObject *self, PyObject *args)
 	Py_RETURN_NONE;
 }
 
+// A body string yielded by the application. `data` points directly into the memory of the Python object.
+struct BodyChunk {
+	Py::Object object;
+	Py::Buffer buffer;
+	std::string_view data;
+};
+
+constexpr Py_ssize_t max_gather_chunks = 64;
+
+// Returns false with a Python exception set, if `item` cannot be used as body data
+bool
+get_body_chunk(Py::Object item, BodyChunk &chunk)
+{
+	if (!item) {
+		return false;
+	}
+
+	if (PyUnicode_Check(item)) {
+		// PEP-3333 requires bytestrings, but we have always accepted str and sent it UTF-8 encoded.
+		// The UTF-8 representation is cached in the str object, so we have to keep a reference to it.
+		Py_ssize_t size = 0;
+		const auto data = PyUnicode_AsUTF8AndSize(item, &size);
+		if (!data) {
+			return false;
+		}
+		chunk.data = std::string_view(data, size);
+	} else {
+		chunk.buffer = Py::Buffer(item);
+		if (!chunk.buffer) {
+			return false;
+		}
+		chunk.data = chunk.buffer.View();
+	}
+
+	chunk.object = std::move(item);
+	return true;
+}
+
+// The total length of the body items of a list or tuple
+uint64_t
+get_body_length(PyObject *sequence, Py_ssize_t size)
+{
+	uint64_t length = 0;
+	for (Py_ssize_t i = 0; i < size; ++i) {
+		BodyChunk chunk;
+		if (!get_body_chunk(Py::wrap(PySequence_GetItem(sequence, i)), chunk)) {
+			Py::rethrow_python_exception();
+		}
+		length += chunk.data.size();
+	}
+	return length;
+}
+
 [[gnu::pure]] std::string
 TranslateHeader(std::string_view header_name) noexcept
 {
@@ -485,6 +760,11 @@ WsgiRequestHandler::FindApp(std::optional<std::string> module_name, std::optiona
 		throw std::runtime_error("Could not import module 'app' or 'wsgi'");
 	}
 
+	// The application may have been set explicitly, while the module was imported
+	if (auto app = Module::GetApp()) {
+		return app;
+	}
+
 	Py::Object app;
 	if (app_name) {
 		app = Py::wrap(PyObject_GetAttrString(module, app_name->c_str()));
@@ -508,54 +788,50 @@ WsgiRequestHandler::FindApp(std::optional<std::string> module_name, std::optiona
 		throw std::runtime_error("Could not find object 'app' or 'application' in module");
 	}
 
-	if (PyCoro_CheckExact(app)) {
-		throw std::runtime_error("Application is a coroutine. ASGI is not supported yet.");
-	}
-
 	return app;
 }
 
-WsgiRequestHandler::WsgiRequestHandler(Py::Object app) : app(std::move(app)) {}
+WsgiRequestHandler::WsgiRequestHandler(Py::Object app, bool multithread)
+  : app(std::move(app))
+  , multithread(multithread)
+  , input_stream_type(WsgiInputStream::CreateType())
+  , file_wrapper_type(FileWrapper::CreateType())
+  , environ_template(CreateEnvironTemplate())
+  , keys{
+	  .remote_addr = Py::intern("REMOTE_ADDR"),
+	  .request_method = Py::intern("REQUEST_METHOD"),
+	  .script_name = Py::intern("SCRIPT_NAME"),
+	  .path_info = Py::intern("PATH_INFO"),
+	  .query_string = Py::intern("QUERY_STRING"),
+	  .content_type = Py::intern("CONTENT_TYPE"),
+	  .content_length = Py::intern("CONTENT_LENGTH"),
+	  .server_name = Py::intern("SERVER_NAME"),
+	  .server_port = Py::intern("SERVER_PORT"),
+	  .server_protocol = Py::intern("SERVER_PROTOCOL"),
+	  .https = Py::intern("HTTPS"),
+	  .url_scheme = Py::intern("wsgi.url_scheme"),
+	  .input = Py::intern("wsgi.input"),
+	  .errors = Py::intern("wsgi.errors"),
+  }
+{
+}
 
-void
-WsgiRequestHandler::Process(HttpRequest &&req, HttpResponder &responder)
+Py::Object
+WsgiRequestHandler::CreateEnvironTemplate() const
 {
 	auto environ = Py::wrap(PyDict_New());
 	if (!environ) {
 		Py::rethrow_python_exception();
 	}
 
-	const auto content_type = req.FindHeader("Content-Type");
-
-	InputStream *body_stream = req.body ? req.body.release() : new NullInputStream;
-
-	// The spec is unclear, but Flask also passes Content-Length as a string
-	std::string content_length =
-	    body_stream->ContentLength() ? fmt::format("{}", *body_stream->ContentLength()) : "";
-
 	// All keys and values must be native strings
-
-	PyDict_SetItemString(environ, "REMOTE_ADDR", native_string(req.remote_addr));
-	PyDict_SetItemString(environ, "REQUEST_METHOD", native_string(http_method_to_string(req.method)));
-	PyDict_SetItemString(environ, "SCRIPT_NAME", native_string(req.script_name));
-	PyDict_SetItemString(environ, "PATH_INFO", native_string(req.uri.path));
-	PyDict_SetItemString(environ, "QUERY_STRING", native_string(req.uri.query));
-	PyDict_SetItemString(environ, "CONTENT_TYPE", native_string(content_type.value_or("")));
-	PyDict_SetItemString(environ, "CONTENT_LENGTH", native_string(content_length));
-	PyDict_SetItemString(environ, "SERVER_NAME", native_string(req.server_name));
-	PyDict_SetItemString(environ, "SERVER_PORT", native_string(req.server_port));
-	PyDict_SetItemString(environ, "SERVER_PROTOCOL", native_string(req.protocol));
 	PyDict_SetItemString(environ, "SERVER_SOFTWARE", native_string("python-was/v0.1"));
-	PyDict_SetItemString(environ, "HTTPS", native_string(req.scheme == "https" ? "on" : "")); // mod_ssl
 
 	PyDict_SetItemString(environ, "wsgi.version", Py::wrap(Py_BuildValue("(ii)", 1, 0)));
-	PyDict_SetItemString(environ, "wsgi.url_scheme", native_string(req.scheme));
-	PyDict_SetItemString(environ, "wsgi.input", WsgiInputStream::CreatePyObject(body_stream));
-	// stderr will be captured by beng-proxy and transmitted to a logging server
-	PyDict_SetItemString(environ, "wsgi.errors", PySys_GetObject("stderr"));
-	PyDict_SetItemString(environ, "wsgi.multithread", Py_False);
+	PyDict_SetItemString(environ, "wsgi.multithread", multithread ? Py_True : Py_False);
 	PyDict_SetItemString(environ, "wsgi.multiprocess", Py_True);
 	PyDict_SetItemString(environ, "wsgi.run_once", Py_False);
+	PyDict_SetItemString(environ, "wsgi.file_wrapper", file_wrapper_type);
 
 	// https://gist.github.com/mitsuhiko/5721547
 	// This is supported by many webservers (mod_wsgi, gunicorn) and applications (Flask/Werkzeug)
@@ -568,23 +844,144 @@ WsgiRequestHandler::Process(HttpRequest &&req, HttpResponder &responder)
 	// chunked request bodies.
 	PyDict_SetItemString(environ, "wsgi.input_terminated", Py_True);
 
+	if (PyErr_Occurred()) {
+		Py::rethrow_python_exception();
+	}
+	return environ;
+}
+
+namespace {
+// The request headers whose HTTP_* keys are cached
+constexpr std::array<std::string_view, 34> common_headers = {
+	"Accept",
+	"Accept-Charset",
+	"Accept-Encoding",
+	"Accept-Language",
+	"Authorization",
+	"Cache-Control",
+	"Connection",
+	"Cookie",
+	"DNT",
+	"Forwarded",
+	"Host",
+	"If-Match",
+	"If-Modified-Since",
+	"If-None-Match",
+	"If-Range",
+	"If-Unmodified-Since",
+	"Origin",
+	"Pragma",
+	"Priority",
+	"Range",
+	"Referer",
+	"Sec-Fetch-Dest",
+	"Sec-Fetch-Mode",
+	"Sec-Fetch-Site",
+	"Sec-Fetch-User",
+	"Upgrade-Insecure-Requests",
+	"User-Agent",
+	"Via",
+	"X-Forwarded-For",
+	"X-Forwarded-Host",
+	"X-Forwarded-Proto",
+	"X-Real-IP",
+	"X-Request-ID",
+	"X-Requested-With",
+};
+
+bool
+is_common_header(std::string_view name) noexcept
+{
+	return std::any_of(common_headers.begin(), common_headers.end(),
+			   [name](std::string_view common) { return HeaderMatch(name, common); });
+}
+}
+
+Py::Object
+WsgiRequestHandler::GetHeaderKey(std::string_view header_name)
+{
+	if (const auto it = header_keys.find(header_name); it != header_keys.end()) {
+		return Py::wrap(Py_NewRef(it->second));
+	}
+
+	auto key = native_string(TranslateHeader(header_name));
+	if (header_keys.size() < max_header_keys && is_common_header(header_name)) {
+		PyObject *interned = key.Release();
+		PyUnicode_InternInPlace(&interned);
+		key = interned;
+		header_keys.emplace(header_name, Py::wrap(Py_NewRef(interned)));
+	}
+	return key;
+}
+
+void
+WsgiRequestHandler::Prepare() noexcept
+{
+	if (!prepared_environ) {
+		prepared_environ = PyDict_Copy(environ_template);
+		// Process tries again
+		PyErr_Clear();
+	}
+}
+
+void
+WsgiRequestHandler::Process(HttpRequest &&req, HttpResponder &responder)
+{
+	// Each emplace() ends the previous phase
+	std::optional<PhaseTimer> phase_timer(std::in_place, Phase::ENVIRON);
+
+	auto environ = prepared_environ ? std::move(prepared_environ) : Py::wrap(PyDict_Copy(environ_template));
+	if (!environ) {
+		Py::rethrow_python_exception();
+	}
+
+	const auto content_type = req.FindHeader("Content-Type");
+
+	std::unique_ptr<InputStream> body_stream = req.body ? std::move(req.body) : std::make_unique<NullInputStream>();
+
+	// The spec is unclear, but Flask also passes Content-Length as a string
+	std::string content_length =
+	    body_stream->ContentLength() ? fmt::format("{}", *body_stream->ContentLength()) : "";
+
+	PyDict_SetItem(environ, keys.remote_addr, native_string(req.remote_addr));
+	PyDict_SetItem(environ, keys.request_method, native_string(http_method_to_string(req.method)));
+	PyDict_SetItem(environ, keys.script_name, native_string(req.script_name));
+	PyDict_SetItem(environ, keys.path_info, native_string(req.uri.path));
+	PyDict_SetItem(environ, keys.query_string, native_string(req.uri.query));
+	PyDict_SetItem(environ, keys.content_type, native_string(content_type.value_or("")));
+	PyDict_SetItem(environ, keys.content_length, native_string(content_length));
+	PyDict_SetItem(environ, keys.server_name, native_string(req.server_name));
+	PyDict_SetItem(environ, keys.server_port, native_string(req.server_port));
+	PyDict_SetItem(environ, keys.server_protocol, native_string(req.protocol));
+	PyDict_SetItem(environ, keys.https, native_string(req.scheme == "https" ? "on" : "")); // mod_ssl
+	PyDict_SetItem(environ, keys.url_scheme, native_string(req.scheme));
+	PyDict_SetItem(environ, keys.input, WsgiInputStream::CreatePyObject(input_stream_type, std::move(body_stream)));
+	// Looked up for every request, because the application may replace sys.stderr. It will be captured by
+	// beng-proxy and transmitted to a logging server.
+	PyObject *const errors = PySys_GetObject("stderr"); // borrowed reference
+	PyDict_SetItem(environ, keys.errors, errors ? errors : Py_None);
+
 	for (const auto &[name, value] : req.headers) {
 		if (HeaderMatch(name, "Content-Type") || HeaderMatch(name, "Content-Length")) {
 			continue;
 		}
-		const auto translated_name = TranslateHeader(name);
-		PyDict_SetItemString(environ, translated_name.c_str(), native_string(value));
+		PyDict_SetItem(environ, GetHeaderKey(name), native_string(value));
 	}
 
 	if (PyErr_Occurred()) {
 		Py::rethrow_python_exception();
 	}
 
-	HttpResponse response;
+	HttpResponse response{ .headers = std::pmr::vector<HttpResponse::Header>(req.arena) };
 	StartResponseContext start_response_ctx{ .response = &response, .responder = &responder };
-	auto start_response_ctx_capsule = PyCapsule_New(&start_response_ctx, "StartResponseContext", nullptr);
+	auto start_response_ctx_capsule = Py::wrap(PyCapsule_New(&start_response_ctx, "StartResponseContext", nullptr));
+	if (!start_response_ctx_capsule) {
+		Py::rethrow_python_exception();
+	}
+	const StartResponseCapsuleGuard capsule_guard(start_response_ctx_capsule);
 
-	PyMethodDef start_response_def = {
+	// The function object keeps a pointer to its PyMethodDef, which must therefore outlive every request
+	static PyMethodDef start_response_def = {
 		"start_response", (PyCFunction)StartResponse, METH_VARARGS, "WSGI start_response"
 	};
 	auto start_response_callable = Py::wrap(PyCFunction_New(&start_response_def, start_response_ctx_capsule));
@@ -594,7 +991,9 @@ WsgiRequestHandler::Process(HttpRequest &&req, HttpResponder &responder)
 
 	auto args = Py::wrap(
 	    PyTuple_Pack(2, static_cast<PyObject *>(environ), static_cast<PyObject *>(start_response_callable)));
+	phase_timer.emplace(Phase::APP_CALL);
 	auto result = Py::wrap(PyObject_CallObject(app, args));
+	phase_timer.emplace(Phase::ITERATE);
 	// If any Python exceptions are raised during start_response, they end up here, because Flask/Werkzeug
 	// do not catch them. I am not sure if the spec agrees with this, but this is a note for the future that
 	// this is known behavior.
@@ -602,34 +1001,93 @@ WsgiRequestHandler::Process(HttpRequest &&req, HttpResponder &responder)
 		Py::rethrow_python_exception();
 	}
 
-	auto result_iterator = Py::wrap(PyObject_GetIter(result));
-	if (!result_iterator) {
-		Py::rethrow_python_exception();
-	}
-
-	for (auto item = Py::wrap(PyIter_Next(result_iterator)); item; item = PyIter_Next(result_iterator)) {
-		// The application must invoke `start_response` before the iterable yields the first body bytestring.
-		// This may be performed by the iterable's first iteration, so this is the earliest we can check.
-		// `start_response` may also be invoked multiple times, so it cannot send the headers itself.
+	// The application must invoke `start_response` before the iterable yields the first body bytestring.
+	// This may be performed by the iterable's first iteration, so this is the earliest we can check.
+	// `start_response` may also be invoked multiple times, so it cannot send the headers itself.
+	const auto send_headers = [&]() {
 		if (!responder.HeadersSent()) {
 			if (response.status == 0) {
 				throw std::runtime_error("start_response must be called before the WSGI "
 							 "application yields the first body string");
 			}
-			// move in a loop is scary, but the check above should prevent this being done multiple times.
 			responder.SendHeaders(std::move(response));
 		}
-		responder.SendBody(Py::to_string_view(item));
-	}
+	};
 
-	// It's possible the iterable was empty and PyIter_Next returned null immediately
-	if (!responder.HeadersSent()) {
-		if (response.status == 0) {
-			throw std::runtime_error("start_response must be called before the WSGI "
-						 "application yields the first body string");
+	if (auto file = FileWrapper::GetFile(file_wrapper_type, result)) {
+		if (response.content_length) {
+			file->length = std::min(file->length, *response.content_length);
 		}
-		responder.SendHeaders(std::move(response));
+		// The file is seekable, so a range is sent by starting at another offset instead of discarding data
+		if (req.method == HTTP_METHOD_GET) {
+			const auto range =
+			    apply_range(response, file->length, req.FindHeader("Range"), req.FindHeader("If-Range"));
+			if (range.type == RangeRequest::Type::UNSATISFIABLE) {
+				file->length = 0;
+			} else {
+				file->offset += range.start;
+				file->length = range.Size();
+			}
+		} else {
+			response.content_length = file->length;
+		}
+		send_headers();
+		if (file->length > 0) {
+			responder.SendFile(file->fd, file->offset, file->length);
+		}
+	} else if (PyList_CheckExact(result) || PyTuple_CheckExact(result)) {
+		// All items of a list or tuple exist already, so we don't delay anything by sending them at once.
+		// This is what most frameworks return, so it's worth avoiding a system call per item.
+		const auto size = PySequence_Size(result);
+		std::vector<BodyChunk> chunks;
+		std::vector<std::string_view> views;
+		for (Py_ssize_t start = 0; start < size; start += max_gather_chunks) {
+			chunks.clear();
+			views.clear();
+			for (Py_ssize_t i = start; i < std::min(size, start + max_gather_chunks); ++i) {
+				auto &chunk = chunks.emplace_back();
+				if (!get_body_chunk(Py::wrap(PySequence_GetItem(result, i)), chunk)) {
+					Py::rethrow_python_exception();
+				}
+				views.push_back(chunk.data);
+			}
+			if (start == 0 && !response.content_length) {
+				// The whole body exists already, so beng-proxy can get its length and does not have to
+				// chunk the response or close the connection.
+				uint64_t length = 0;
+				if (size <= max_gather_chunks) {
+					for (const auto view : views) {
+						length += view.size();
+					}
+				} else {
+					length = get_body_length(result, size);
+				}
+				response.content_length = length;
+			}
+			send_headers();
+			responder.SendBodyChunks(views);
+		}
+	} else {
+		auto result_iterator = Py::wrap(PyObject_GetIter(result));
+		if (!result_iterator) {
+			Py::rethrow_python_exception();
+		}
+
+		for (auto item = Py::wrap(PyIter_Next(result_iterator)); item; item = PyIter_Next(result_iterator)) {
+			BodyChunk chunk;
+			if (!get_body_chunk(std::move(item), chunk)) {
+				Py::rethrow_python_exception();
+			}
+			send_headers();
+			responder.SendBody(chunk.data);
+		}
+	}
+
+	// It's possible the iterable was empty and PyIter_Next returned null immediately, then the body is empty
+	if (!responder.HeadersSent() && !response.content_length && !PyErr_Occurred()) {
+		response.content_length = 0;
 	}
+	send_headers();
 
 	// PyIter_Next will return null on error, so we need to check here
 	if (PyErr_Occurred()) {
@@ -643,12 +1101,4 @@ WsgiRequestHandler::Process(HttpRequest &&req, HttpResponder &responder)
 			Py::rethrow_python_exception();
 		}
 	}
-
-	// A capsule must not store a nullptr, so SetPointer will fail with nullptr.
-	// Instead we change the name, so GetPointer will fail in StartResponse.
-	// We reset the capsule so in case the Python code kept a reference to start_response
-	// and called it after this function has finished, we do not get a use-after-free.
-	if (PyCapsule_SetName(start_response_ctx_capsule, nullptr)) {
-		Py::rethrow_python_exception();
-	}
 }
@@ -5,14 +5,55 @@
 
 #include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 
 class WsgiRequestHandler final : public RequestHandler {
 	Py::Object app;
+	// Other threads run the same application at the same time (free-threaded Python)
+	bool multithread;
+	Py::Object input_stream_type;
+	Py::Object file_wrapper_type;
+
+	// The items of environ that are the same for every request, copied with PyDict_Copy
+	Py::Object environ_template;
+	// A copy made by Prepare for the next request
+	Py::Object prepared_environ;
+
+	// Interned keys of the items that are set for every request
+	struct EnvironKeys {
+		Py::Object remote_addr;
+		Py::Object request_method;
+		Py::Object script_name;
+		Py::Object path_info;
+		Py::Object query_string;
+		Py::Object content_type;
+		Py::Object content_length;
+		Py::Object server_name;
+		Py::Object server_port;
+		Py::Object server_protocol;
+		Py::Object https;
+		Py::Object url_scheme;
+		Py::Object input;
+		Py::Object errors;
+	} keys;
+
+	// HTTP_* keys by request header name, only for well-known headers, because the other names are chosen by the
+	// client. The size is limited, because the spelling of the names is, too.
+	struct StringHash : std::hash<std::string_view> {
+		using is_transparent = void;
+	};
+	static constexpr size_t max_header_keys = 256;
+	std::unordered_map<std::string, Py::Object, StringHash, std::equal_to<>> header_keys;
+
+	Py::Object CreateEnvironTemplate() const;
+	Py::Object GetHeaderKey(std::string_view header_name);
 
 public:
 	static Py::Object FindApp(std::optional<std::string> module_name, std::optional<std::string> app_name);
 
-	WsgiRequestHandler(Py::Object app);
+	WsgiRequestHandler(Py::Object app, bool multithread = false);
 
 	virtual void Process(HttpRequest &&req, HttpResponder &responder) override;
+	void Prepare() noexcept override;
 };
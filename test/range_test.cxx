@@ -0,0 +1,54 @@
+#include "range.hxx"
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+unsigned failures = 0;
+
+void
+check(bool condition, const char *what) noexcept
+{
+	if (!condition) {
+		std::fprintf(stderr, "FAIL: %s\n", what);
+		++failures;
+	}
+}
+
+void
+check_satisfiable(std::string_view value, uint64_t size, uint64_t start, uint64_t end) noexcept
+{
+	const auto range = RangeRequest::Parse(value, size);
+	if (range.type != RangeRequest::Type::SATISFIABLE || range.start != start || range.end != end) {
+		std::fprintf(stderr, "FAIL: %.*s of %llu bytes\n", static_cast<int>(value.size()), value.data(),
+			     static_cast<unsigned long long>(size));
+		++failures;
+	}
+}
+} // namespace
+
+int
+main()
+{
+	check_satisfiable("bytes=0-99", 1000, 0, 100);
+	check_satisfiable("bytes=100-", 1000, 100, 1000);
+	check_satisfiable("bytes=-100", 1000, 900, 1000);
+	check_satisfiable("bytes=-2000", 1000, 0, 1000);
+	check_satisfiable("bytes=900-1999", 1000, 900, 1000);
+	check_satisfiable("bytes=999-999", 1000, 999, 1000);
+
+	// The largest last-byte-pos must not wrap around when turned into an exclusive end
+	check_satisfiable("bytes=0-18446744073709551615", 1000, 0, 1000);
+	check_satisfiable("bytes=10-18446744073709551615", 1000, 10, 1000);
+	check(RangeRequest::Parse("bytes=0-18446744073709551615", 1000).Size() == 1000, "Size() of bytes=0-UINT64_MAX");
+
+	check(RangeRequest::Parse("bytes=1000-", 1000).type == RangeRequest::Type::UNSATISFIABLE, "start past the end");
+	check(RangeRequest::Parse("bytes=-0", 1000).type == RangeRequest::Type::UNSATISFIABLE, "empty suffix");
+	check(RangeRequest::Parse("bytes=5-4", 1000).type == RangeRequest::Type::NONE, "last before first");
+	check(RangeRequest::Parse("bytes=0-1,5-6", 1000).type == RangeRequest::Type::NONE, "multiple ranges");
+	check(RangeRequest::Parse("items=0-1", 1000).type == RangeRequest::Type::NONE, "other unit");
+	check(RangeRequest::Parse("bytes=0-18446744073709551616", 1000).type == RangeRequest::Type::NONE,
+	      "last-byte-pos out of range");
+
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
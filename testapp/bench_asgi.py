@@ -0,0 +1,52 @@
+# Reference ASGI application for `python-was --bench`, with the same routes as bench_wsgi.py (except /file).
+
+from urllib.parse import parse_qs
+
+HELLO = b"Hello, World!"
+
+
+def _param(scope, name, default):
+    values = parse_qs(scope["query_string"].decode("latin-1")).get(name)
+    return int(values[0]) if values else default
+
+
+async def _read_body(receive):
+    body = b""
+    while True:
+        message = await receive()
+        body += message.get("body", b"")
+        if not message.get("more_body", False):
+            return body
+
+
+async def app(scope, receive, send):
+    path = scope["path"]
+    status = 200
+    headers = [(b"content-type", b"application/octet-stream")]
+    chunks = None
+
+    if path == "/":
+        headers = [(b"content-type", b"text/plain")]
+        body = HELLO
+    elif path == "/bytes":
+        body = b"x" * _param(scope, "size", 1024)
+    elif path == "/chunks":
+        chunks = [b"x" * _param(scope, "size", 1024)] * _param(scope, "count", 16)
+    elif path == "/headers":
+        headers += [(f"x-header-{i}".encode(), b"value") for i in range(_param(scope, "count", 20))]
+        body = HELLO
+    elif path == "/echo":
+        body = await _read_body(receive)
+    elif path == "/lines":
+        body = str((await _read_body(receive)).count(b"\n")).encode()
+    else:
+        status = 404
+        body = b"Not Found"
+
+    await send({"type": "http.response.start", "status": status, "headers": headers})
+    if chunks is None:
+        await send({"type": "http.response.body", "body": body})
+    else:
+        for chunk in chunks:
+            await send({"type": "http.response.body", "body": chunk, "more_body": True})
+        await send({"type": "http.response.body", "body": b""})
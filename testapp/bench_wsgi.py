@@ -0,0 +1,66 @@
+# Reference WSGI application for `python-was --bench`, without any dependencies, so the numbers only depend on
+# python-was and the interpreter.
+#
+# /                          a tiny response
+# /bytes?size=<n>            a response of n bytes as a single item
+# /chunks?count=<n>&size=<m> n items of m bytes from a generator
+# /headers?count=<n>         n additional response headers
+# /echo                      the request body
+# /readinto                  the request body, read with wsgi.input.readinto() into a buffer larger than the body
+# /lines                     the number of lines in the request body, read by iterating wsgi.input
+# /file                      this file with wsgi.file_wrapper
+
+from urllib.parse import parse_qs
+
+HELLO = b"Hello, World!"
+
+
+def _param(environ, name, default):
+    values = parse_qs(environ.get("QUERY_STRING", "")).get(name)
+    return int(values[0]) if values else default
+
+
+def _chunks(count, size):
+    chunk = b"x" * size
+    for _ in range(count):
+        yield chunk
+
+
+def app(environ, start_response):
+    path = environ["PATH_INFO"]
+    headers = [("Content-Type", "application/octet-stream")]
+
+    if path == "/":
+        start_response("200 OK", [("Content-Type", "text/plain")])
+        return [HELLO]
+    if path == "/bytes":
+        start_response("200 OK", headers)
+        return [b"x" * _param(environ, "size", 1024)]
+    if path == "/chunks":
+        start_response("200 OK", headers)
+        return _chunks(_param(environ, "count", 16), _param(environ, "size", 1024))
+    if path == "/headers":
+        headers += [(f"X-Header-{i}", "value") for i in range(_param(environ, "count", 20))]
+        start_response("200 OK", headers)
+        return [HELLO]
+    if path == "/echo":
+        body = environ["wsgi.input"].read()
+        start_response("200 OK", headers)
+        return [body]
+    if path == "/readinto":
+        body = bytearray()
+        buffer = bytearray(65536)
+        while n := environ["wsgi.input"].readinto(buffer):
+            body += buffer[:n]
+        start_response("200 OK", headers)
+        return [bytes(body)]
+    if path == "/lines":
+        count = sum(1 for _ in environ["wsgi.input"])
+        start_response("200 OK", [("Content-Type", "text/plain")])
+        return [str(count).encode()]
+    if path == "/file":
+        start_response("200 OK", [("Content-Type", "text/x-python")])
+        return environ["wsgi.file_wrapper"](open(__file__, "rb"))
+
+    start_response("404 Not Found", [("Content-Type", "text/plain")])
+    return [b"Not Found"]